@@ -0,0 +1,389 @@
+#include "aio.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <exception>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// AsyncReader
+//
+
+AsyncReader::Ptr AsyncReader::open(int fd, unsigned depth, bool use_uring)
+{
+    if (depth == 0) {
+        depth = 1;
+    }
+
+    if (use_uring) {
+        AsyncReader *uring = UringReader::create(fd, depth);
+
+        if (uring != nullptr) {
+            return Ptr(uring);
+        }
+    }
+
+    return Ptr(new ThreadPoolReader(fd, depth));
+}
+
+AsyncReader::AsyncReader(int fd, unsigned depth) :
+    fd_(fd),
+    depth_(depth),
+    ops_(depth),
+    in_flight_(0)
+{
+    for (unsigned i = depth; i > 0; i--) {
+        free_slots_.push_back(i - 1);
+    }
+}
+
+AsyncReader::~AsyncReader()
+{
+}
+
+void AsyncReader::submit(const Request &req)
+{
+    if (free_slots_.empty()) {
+        std::cerr << "Asynchronous read queue overflow" << std::endl;
+        throw std::exception();
+    }
+
+    unsigned slot = free_slots_.back();
+    free_slots_.pop_back();
+
+    ops_[slot].req = req;
+    ops_[slot].done = 0;
+    in_flight_++;
+
+    Trace::count(Trace::IO_CALLS);
+    start(slot, req.offset, req.buf, req.len);
+}
+
+size_t AsyncReader::reap(std::vector<Completion> &out, bool wait)
+{
+    size_t before = out.size();
+
+    while (in_flight_ > 0) {
+        raw_.clear();
+        complete(raw_, wait);
+
+        for (size_t i = 0; i < raw_.size(); i++) {
+            unsigned slot = raw_[i].first;
+            ssize_t result = raw_[i].second;
+            Op &op = ops_[slot];
+
+            // Reading past the end of the file is an error too.
+            if (result == 0) {
+                result = -EIO;
+            }
+
+            if (result > 0) {
+                Trace::count(Trace::BYTES_READ, result);
+                op.done += result;
+
+                if (op.done < op.req.len) {
+                    Trace::count(Trace::IO_CALLS);
+                    start(slot, op.req.offset + op.done, op.req.buf + op.done,
+                          op.req.len - op.done);
+                    continue;
+                }
+
+                result = (ssize_t) op.req.len;
+            }
+
+            Completion c = { op.req.tag, result };
+            out.push_back(c);
+            free_slots_.push_back(slot);
+            in_flight_--;
+        }
+
+        if (out.size() > before || !wait) {
+            break;
+        }
+    }
+
+    return out.size() - before;
+}
+
+//////////////////////////////////////////////////////////////////////
+// UringReader
+//
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                         NULL, 0);
+}
+
+AsyncReader *UringReader::create(int fd, unsigned depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int ring_fd = uring_setup(depth, &p);
+
+    if (ring_fd < 0) {
+        return nullptr;
+    }
+
+    UringReader *reader = new UringReader(fd, depth, ring_fd);
+
+    if (!reader->map_rings(p)) {
+        delete reader;
+        return nullptr;
+    }
+
+    return reader;
+}
+
+UringReader::UringReader(int fd, unsigned depth, int ring_fd) :
+    AsyncReader(fd, depth),
+    ring_fd_(ring_fd),
+    to_submit_(0),
+    iovecs_(depth),
+    sq_ring_(MAP_FAILED),
+    sq_ring_size_(0),
+    cq_ring_(MAP_FAILED),
+    cq_ring_size_(0),
+    sqes_(MAP_FAILED),
+    sqes_size_(0)
+{
+}
+
+UringReader::~UringReader()
+{
+    // Nothing may still be writing into a caller's buffers.
+    std::vector<Completion> out;
+
+    try {
+        while (in_flight() > 0 && sqes_ != MAP_FAILED) {
+            reap(out);
+        }
+    } catch (std::exception &e) {
+        // The ring is broken; closing it is all that's left.
+    }
+
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_size_);
+    }
+
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+
+    close(ring_fd_);
+}
+
+//
+// Map the submission and completion rings and the submission entries,
+// as laid out in the parameters io_uring_setup() filled in.
+//
+bool UringReader::map_rings(const struct io_uring_params &p)
+{
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+
+    if (sq_ring_ == MAP_FAILED) {
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_CQ_RING);
+
+        if (cq_ring_ == MAP_FAILED) {
+            return false;
+        }
+    }
+
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd_, IORING_OFF_SQES);
+
+    if (sqes_ == MAP_FAILED) {
+        return false;
+    }
+
+    uint8_t *sq = static_cast<uint8_t *>(sq_ring_);
+    uint8_t *cq = static_cast<uint8_t *>(cq_ring_);
+
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes_ = cq + p.cq_off.cqes;
+
+    return true;
+}
+
+void UringReader::start(unsigned slot, uint64_t offset, uint8_t *buf, size_t len)
+{
+    // Only this thread moves the tail, so it can be read plainly.
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes_) + index;
+
+    // READV rather than READ, which only arrived in Linux 5.6
+    struct iovec &iov = iovecs_[slot];
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd_;
+    sqe->addr = (uint64_t) (uintptr_t) &iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = slot;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    to_submit_++;
+}
+
+void UringReader::complete(std::vector<std::pair<unsigned, ssize_t> > &out, bool wait)
+{
+    unsigned head = *cq_head_;
+    bool have = head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+    // Submitting and waiting are one system call.
+    if (to_submit_ > 0 || (wait && !have)) {
+        unsigned min_complete = (wait && !have) ? 1 : 0;
+        int ret = uring_enter(ring_fd_, to_submit_, min_complete,
+                              min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+        if (ret < 0 && errno != EINTR) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            throw std::exception();
+        }
+
+        if (ret > 0) {
+            to_submit_ -= std::min<unsigned>(to_submit_, (unsigned) ret);
+        }
+    }
+
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    const struct io_uring_cqe *cqes = static_cast<const struct io_uring_cqe *>(cqes_);
+
+    while (head != tail) {
+        const struct io_uring_cqe &cqe = cqes[head & *cq_mask_];
+        out.push_back(std::make_pair((unsigned) cqe.user_data, (ssize_t) cqe.res));
+        head++;
+    }
+
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+//////////////////////////////////////////////////////////////////////
+// ThreadPoolReader
+//
+
+ThreadPoolReader::ThreadPoolReader(int fd, unsigned depth) :
+    AsyncReader(fd, depth),
+    stopping_(false)
+{
+    for (unsigned i = 0; i < depth; i++) {
+        threads_.push_back(std::thread(&ThreadPoolReader::run, this));
+    }
+}
+
+ThreadPoolReader::~ThreadPoolReader()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    work_ready_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i].join();
+    }
+}
+
+void ThreadPoolReader::start(unsigned slot, uint64_t offset, uint8_t *buf, size_t len)
+{
+    Job job = { slot, offset, buf, len };
+
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        jobs_.push_back(job);
+    }
+    work_ready_.notify_one();
+}
+
+void ThreadPoolReader::complete(std::vector<std::pair<unsigned, ssize_t> > &out, bool wait)
+{
+    std::unique_lock<std::mutex> guard(lock_);
+
+    if (wait) {
+        done_ready_.wait(guard, [this]() { return !done_.empty(); });
+    }
+
+    out.insert(out.end(), done_.begin(), done_.end());
+    done_.clear();
+}
+
+void ThreadPoolReader::run()
+{
+    std::unique_lock<std::mutex> guard(lock_);
+
+    for (;;) {
+        work_ready_.wait(guard, [this]() { return stopping_ || !jobs_.empty(); });
+
+        // Jobs still queued at shutdown are finished, since callers'
+        // buffers may be the targets.
+        if (jobs_.empty()) {
+            return;
+        }
+
+        Job job = jobs_.front();
+        jobs_.pop_front();
+
+        guard.unlock();
+
+        ssize_t n;
+        do {
+            n = pread(fd_, job.buf, job.len, (off_t) job.offset);
+        } while (n < 0 && errno == EINTR);
+
+        ssize_t result = n < 0 ? -errno : n;
+
+        guard.lock();
+        done_.push_back(std::make_pair(job.slot, result));
+        done_ready_.notify_one();
+    }
+}
+
+}; // namespace
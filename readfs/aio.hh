@@ -0,0 +1,208 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_params;
+
+namespace loomcom {
+
+//
+// Asynchronous reads from a file, with up to `depth` reads in flight.
+//
+// On Linux this is an io_uring, driven through the raw system calls.
+// Where io_uring isn't available, or is turned off, a pool of `depth`
+// threads issues ordinary pread(2)s instead. Either way the caller
+// submits reads, carries on, and reaps completions in whatever order
+// the storage delivers them. Short reads are finished off internally,
+// so a completion is always for the whole read or an error.
+//
+// A reader belongs to one thread at a time.
+//
+class AsyncReader {
+public:
+    typedef std::unique_ptr<AsyncReader> Ptr;
+
+    struct Request {
+        uint64_t offset;
+        uint8_t *buf;
+        size_t len;
+        uint64_t tag;           // Handed back with the completion
+    };
+
+    struct Completion {
+        uint64_t tag;
+        ssize_t result;         // The request's length, or -errno
+    };
+
+    // Open a reader for `fd`. io_uring is tried first unless
+    // `use_uring` is false.
+    static Ptr open(int fd, unsigned depth, bool use_uring = true);
+
+    virtual ~AsyncReader();
+
+    virtual const char *name() const = 0;
+
+    unsigned depth() const { return depth_; }
+    unsigned in_flight() const { return in_flight_; }
+
+    // Queue a read. At most depth() may be in flight; reap first if
+    // they are. Throws if the read can't be queued.
+    void submit(const Request &req);
+
+    // Append finished reads to `out`. Waits for at least one if `wait`
+    // is true and any are in flight. Returns the number appended.
+    size_t reap(std::vector<Completion> &out, bool wait = true);
+
+    // Read every request, keeping the queue as full as possible, and
+    // call `done` with each one's index as it completes. Throws once
+    // everything in flight has drained if any read failed.
+    template <typename F>
+    void read_all(const std::vector<Request> &reqs, F done);
+
+protected:
+    AsyncReader(int fd, unsigned depth);
+
+    // Start reading into `slot`'s buffer.
+    virtual void start(unsigned slot, uint64_t offset, uint8_t *buf, size_t len) = 0;
+
+    // Collect raw completions as (slot, result) pairs, waiting for at
+    // least one if `wait` is true.
+    virtual void complete(std::vector<std::pair<unsigned, ssize_t> > &out, bool wait) = 0;
+
+    const int fd_;
+    const unsigned depth_;
+
+private:
+    struct Op {
+        Request req;
+        size_t done;
+    };
+
+    std::vector<Op> ops_;
+    std::vector<unsigned> free_slots_;
+    std::vector<std::pair<unsigned, ssize_t> > raw_;
+    unsigned in_flight_;
+};
+
+template <typename F>
+void AsyncReader::read_all(const std::vector<Request> &reqs, F done)
+{
+    std::vector<Completion> completions;
+    size_t next = 0;
+    bool failed = false;
+
+    while (next < reqs.size() || in_flight_ > 0) {
+        while (next < reqs.size() && in_flight_ < depth_ && !failed) {
+            Request r = reqs[next];
+            r.tag = next++;
+            submit(r);
+        }
+
+        completions.clear();
+        reap(completions);
+
+        for (size_t i = 0; i < completions.size(); i++) {
+            if (completions[i].result < 0) {
+                failed = true;
+            } else {
+                done((size_t) completions[i].tag);
+            }
+        }
+
+        if (failed && in_flight_ == 0) {
+            break;
+        }
+    }
+
+    if (failed) {
+        throw std::exception();
+    }
+}
+
+//
+// io_uring, set up and driven without liburing.
+//
+class UringReader : public AsyncReader {
+public:
+    // Returns nullptr if the kernel won't make a ring.
+    static AsyncReader *create(int fd, unsigned depth);
+
+    ~UringReader();
+
+    const char *name() const { return "io_uring"; }
+
+protected:
+    void start(unsigned slot, uint64_t offset, uint8_t *buf, size_t len);
+    void complete(std::vector<std::pair<unsigned, ssize_t> > &out, bool wait);
+
+private:
+    UringReader(int fd, unsigned depth, int ring_fd);
+
+    bool map_rings(const struct io_uring_params &p);
+
+    const int ring_fd_;
+    unsigned to_submit_;
+    std::vector<struct iovec> iovecs_;  // One per slot, for READV
+
+    // The mapped rings and the fields within them
+    void *sq_ring_;
+    size_t sq_ring_size_;
+    void *cq_ring_;
+    size_t cq_ring_size_;
+    void *sqes_;
+    size_t sqes_size_;
+
+    unsigned *sq_tail_;
+    unsigned *sq_mask_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned *cq_mask_;
+    void *cqes_;
+};
+
+//
+// A pool of threads calling pread(2).
+//
+class ThreadPoolReader : public AsyncReader {
+public:
+    ThreadPoolReader(int fd, unsigned depth);
+    ~ThreadPoolReader();
+
+    const char *name() const { return "pread threads"; }
+
+protected:
+    void start(unsigned slot, uint64_t offset, uint8_t *buf, size_t len);
+    void complete(std::vector<std::pair<unsigned, ssize_t> > &out, bool wait);
+
+private:
+    struct Job {
+        unsigned slot;
+        uint64_t offset;
+        uint8_t *buf;
+        size_t len;
+    };
+
+    void run();
+
+    std::mutex lock_;
+    std::condition_variable work_ready_;
+    std::condition_variable done_ready_;
+    std::deque<Job> jobs_;
+    std::vector<std::pair<unsigned, ssize_t> > done_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+};
+
+}; // namespace
@@ -0,0 +1,128 @@
+#include "arena.hh"
+
+#include <algorithm>
+#include <functional>
+
+#include <string.h>
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// Arena
+//
+
+Arena::Arena(size_t chunk_size) :
+    chunk_size_(chunk_size),
+    next_(nullptr),
+    left_(0),
+    used_(0)
+{
+}
+
+void *Arena::allocate(size_t size, size_t align)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+
+    size_t pad = (align - ((uintptr_t) next_ % align)) % align;
+
+    if (next_ == nullptr || pad + size > left_) {
+        // Oversized requests get a chunk of their own.
+        size_t len = std::max(chunk_size_, size + align);
+        chunks_.push_back(std::unique_ptr<char[]>(new char[len]));
+        next_ = chunks_.back().get();
+        left_ = len;
+        pad = (align - ((uintptr_t) next_ % align)) % align;
+    }
+
+    void *p = next_ + pad;
+    next_ += pad + size;
+    left_ -= pad + size;
+    used_ += size;
+
+    return p;
+}
+
+size_t Arena::bytes_allocated() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return used_;
+}
+
+size_t Arena::chunk_count() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return chunks_.size();
+}
+
+//////////////////////////////////////////////////////////////////////
+// NameTable
+//
+
+NameTable::NameTable(Arena &arena) :
+    arena_(arena),
+    slots_(1024),
+    count_(0)
+{
+}
+
+std::string_view NameTable::intern(std::string_view name)
+{
+    if (name.empty()) {
+        return name;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+
+    size_t mask = slots_.size() - 1;
+    size_t i = std::hash<std::string_view>()(name) & mask;
+
+    while (!slots_[i].empty()) {
+        if (slots_[i] == name) {
+            return slots_[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    char *copy = static_cast<char *>(arena_.allocate(name.size(), 1));
+    memcpy(copy, name.data(), name.size());
+
+    slots_[i] = std::string_view(copy, name.size());
+    std::string_view result = slots_[i];
+
+    // Keep the load factor under 3/4.
+    if (++count_ * 4 > slots_.size() * 3) {
+        grow();
+    }
+
+    return result;
+}
+
+size_t NameTable::size() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return count_;
+}
+
+void NameTable::grow()
+{
+    std::vector<std::string_view> old(slots_.size() * 2);
+    old.swap(slots_);
+
+    size_t mask = slots_.size() - 1;
+
+    for (size_t j = 0; j < old.size(); j++) {
+        if (old[j].empty()) {
+            continue;
+        }
+
+        size_t i = std::hash<std::string_view>()(old[j]) & mask;
+
+        while (!slots_[i].empty()) {
+            i = (i + 1) & mask;
+        }
+
+        slots_[i] = old[j];
+    }
+}
+
+}; // namespace
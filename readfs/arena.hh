@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// A bump allocator. Memory is carved out of large chunks and is only
+// given back when the arena itself goes away, all at once. Objects
+// made here are never destroyed, so they must be trivially
+// destructible.
+//
+class Arena {
+public:
+    const static size_t DEFAULT_CHUNK = 256 * 1024;
+
+    explicit Arena(size_t chunk_size = DEFAULT_CHUNK);
+
+    void *allocate(size_t size, size_t align);
+
+    template <typename T, typename... Args>
+    T *make(Args &&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    T *make_array(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena objects are never destroyed");
+        T *p = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++) {
+            new (p + i) T();
+        }
+        return p;
+    }
+
+    size_t bytes_allocated() const;
+    size_t chunk_count() const;
+
+private:
+    const size_t chunk_size_;
+
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<char[]> > chunks_;
+    char *next_;
+    size_t left_;
+    size_t used_;
+};
+
+//
+// Interned file names. Every distinct name is stored once in the
+// arena, and callers get back a view of that copy, so a name like
+// "bin" costs nothing after its first appearance.
+//
+class NameTable {
+public:
+    explicit NameTable(Arena &arena);
+
+    std::string_view intern(std::string_view name);
+
+    size_t size() const;
+
+private:
+    void grow();
+
+    Arena &arena_;
+
+    mutable std::mutex lock_;
+    // Open-addressed with linear probing; empty views are free slots.
+    std::vector<std::string_view> slots_;
+    size_t count_;
+};
+
+}; // namespace
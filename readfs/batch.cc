@@ -0,0 +1,342 @@
+#include "batch.hh"
+#include "vtoc.hh"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+namespace loomcom {
+
+std::vector<Batch::Image> Batch::read_manifest(const std::string &file_name)
+{
+    std::ifstream in(file_name);
+
+    if (!in) {
+        std::cerr << "Unable to open " << file_name << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    std::vector<Image> images;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Image image;
+
+        if (!(fields >> image.path) || image.path[0] == '#') {
+            continue;
+        }
+
+        if (!(fields >> image.partition)) {
+            image.partition = -1;
+        }
+
+        images.push_back(image);
+    }
+
+    return images;
+}
+
+Batch::Batch(const FileLoader::Options &options, unsigned threads, bool hash) :
+    options_(options),
+    hash_(hash),
+    scheduler_(threads),
+    seconds_(0)
+{
+    if (hash_) {
+        for (unsigned i = 0; i < scheduler_.threads(); i++) {
+            buffers_.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[Hasher::READ_CHUNK]));
+        }
+    }
+}
+
+Batch::~Batch()
+{
+    scheduler_.wait();
+}
+
+const int Batch::run(const std::vector<Image> &images)
+{
+    double start = now();
+
+    for (size_t i = 0; i < images.size(); i++) {
+        scans_.push_back(std::unique_ptr<Scan>(new Scan()));
+        Scan &scan = *scans_.back();
+
+        scan.image = images[i];
+        spawn(scan, [this, &scan]() { load(scan); });
+    }
+
+    scheduler_.wait();
+    seconds_ = now() - start;
+
+    int bad = 0;
+
+    for (size_t i = 0; i < scans_.size(); i++) {
+        if (scans_[i]->failed || scans_[i]->problems > 0) {
+            bad++;
+        }
+    }
+
+    return bad;
+}
+
+//
+// Queue a job for `scan`. Once an image has failed its remaining jobs
+// are skipped, and whichever job finishes last wraps the image up.
+//
+void Batch::spawn(Scan &scan, const Scheduler::Job &job)
+{
+    scan.pending++;
+
+    scheduler_.spawn([this, &scan, job]() {
+        if (!scan.failed) {
+            try {
+                job();
+            } catch (std::exception &e) {
+                scan.failed = true;
+            }
+        }
+
+        if (--scan.pending == 0) {
+            finish(scan);
+        }
+    });
+}
+
+void Batch::load(Scan &scan)
+{
+    scan.started = now();
+
+    FileLoader::Options options = options_;
+
+    scan.source = ImageSource::open(scan.image.path, options.use_mmap);
+
+    if (!Vtoc::select(*scan.source, scan.image.partition, options)) {
+        throw std::exception();
+    }
+
+    scan.loader.reset(new FileLoader(scan.source, options));
+    scan.loader->load();
+
+    const struct superblock &sb = scan.loader->superblock();
+    scan.block_size = scan.loader->block_size();
+    scan.fsize = sb.s_fsize;
+    scan.tfree = sb.s_tfree;
+
+    FileEntry::Ptr root = scan.loader->root();
+    scan.seen.insert(root->inode_num);
+
+    spawn(scan, [this, &scan]() { start_check(scan); });
+    spawn(scan, [this, &scan, root]() { walk_dir(scan, root, ""); });
+}
+
+void Batch::start_check(Scan &scan)
+{
+    scan.checker.reset(new Checker(*scan.loader, 1));
+    scan.checker->start(scheduler_.threads());
+
+    for (uint32_t first = 1; first <= scan.checker->inode_count();
+         first += Checker::INODE_RANGE) {
+        spawn(scan, [&scan, first]() {
+            scan.checker->check_range(first, (unsigned) Scheduler::current());
+        });
+    }
+}
+
+void Batch::walk_dir(Scan &scan, FileEntry::Ptr dir, const std::string &path)
+{
+    const FileEntry::List &entries = dir->dir_entries();
+
+    scan.dirs++;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        FileEntry::Ptr f = entries[i];
+
+        if (!f->is_dir && f->file_type != FileEntry::FT_REG) {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(scan.lock);
+
+            if (!scan.seen.insert(f->inode_num).second) {
+                continue;
+            }
+        }
+
+        std::string child = path + "/";
+        child.append(f->name);
+
+        if (f->is_dir) {
+            spawn(scan, [this, &scan, f, child]() { walk_dir(scan, f, child); });
+            continue;
+        }
+
+        scan.files++;
+        scan.bytes += f->inode.di_size;
+
+        if (hash_) {
+            spawn(scan, [this, &scan, f, child]() { hash_file(scan, f, child); });
+        }
+    }
+}
+
+void Batch::hash_file(Scan &scan, FileEntry::Ptr file, const std::string &path)
+{
+    Hasher::Record r;
+    r.hash = 0;
+    r.size = file->inode.di_size;
+    r.inum = file->inode_num;
+    r.path = path;
+    r.ok = false;
+
+    try {
+        r.hash = Hasher::hash_file(*scan.loader, *file, buffers_[Scheduler::current()].get());
+        r.ok = true;
+    } catch (std::exception &e) {
+        std::cerr << scan.image.path << ": Failed to read " << path << std::endl;
+    }
+
+    std::lock_guard<std::mutex> guard(scan.lock);
+    scan.records.push_back(r);
+
+    if (!r.ok) {
+        Checker::Problem p;
+        p.inum = r.inum;
+        p.what = "data of " + path + " is unreadable";
+        scan.problem_list.push_back(p);
+    }
+}
+
+//
+// Run once the last job of an image is done, on whichever worker ran it.
+//
+void Batch::finish(Scan &scan)
+{
+    if (!scan.failed && scan.checker) {
+        try {
+            scan.checker->finish();
+            const std::vector<Checker::Problem> &found = scan.checker->problems();
+            scan.problem_list.insert(scan.problem_list.end(), found.begin(), found.end());
+        } catch (std::exception &e) {
+            scan.failed = true;
+        }
+    }
+
+    // Jobs finish in any order; put things back in a stable one.
+    std::sort(scan.records.begin(), scan.records.end(),
+              [](const Hasher::Record &a, const Hasher::Record &b) { return a.path < b.path; });
+    std::stable_sort(scan.problem_list.begin(), scan.problem_list.end(),
+                     [](const Checker::Problem &a, const Checker::Problem &b) {
+                         return a.inum < b.inum;
+                     });
+
+    scan.problems = scan.problem_list.size();
+    scan.seconds = now() - scan.started;
+
+    scan.checker.reset();
+    scan.loader.reset();
+    scan.source.reset();
+    std::unordered_set<uint32_t>().swap(scan.seen);
+}
+
+const void Batch::write_hashes(const std::string &db) const
+{
+    for (size_t i = 0; i < scans_.size(); i++) {
+        const Scan &scan = *scans_[i];
+
+        if (scan.failed) {
+            continue;
+        }
+
+        // Databases name images absolutely, so runs from anywhere agree.
+        char *path = realpath(scan.image.path.c_str(), NULL);
+        HashDb::append(db, path != NULL ? path : scan.image.path, scan.image.partition,
+                       scan.records);
+        free(path);
+    }
+}
+
+const void Batch::print_report(std::ostream &out) const
+{
+    uint64_t files = 0, dirs = 0, bytes = 0, problems = 0, failed = 0;
+
+    out << "IMAGE                             PART     FILES    DIRS         BYTES   BLOCKS     FREE  PROBLEMS  SECONDS\n";
+
+    for (size_t i = 0; i < scans_.size(); i++) {
+        const Scan &scan = *scans_[i];
+
+        out << std::left << std::setw(32) << scan.image.path << std::right << " ";
+        out << std::setw(5);
+
+        if (scan.image.partition >= 0) {
+            out << scan.image.partition;
+        } else {
+            out << "-";
+        }
+
+        if (scan.failed) {
+            out << "  failed\n";
+            failed++;
+            continue;
+        }
+
+        out << " " << std::setw(9) << scan.files;
+        out << " " << std::setw(7) << scan.dirs;
+        out << " " << std::setw(13) << scan.bytes;
+        out << " " << std::setw(8) << scan.fsize;
+        out << " " << std::setw(8) << scan.tfree;
+        out << " " << std::setw(9) << scan.problems;
+        out << " " << std::setw(8) << std::fixed << std::setprecision(3) << scan.seconds;
+        out << "\n";
+
+        files += scan.files;
+        dirs += scan.dirs;
+        bytes += scan.bytes;
+        problems += scan.problems;
+    }
+
+    for (size_t i = 0; i < scans_.size(); i++) {
+        const Scan &scan = *scans_[i];
+
+        for (size_t j = 0; j < scan.problem_list.size(); j++) {
+            const Checker::Problem &p = scan.problem_list[j];
+
+            out << scan.image.path;
+            if (scan.image.partition >= 0) {
+                out << ":" << scan.image.partition;
+            }
+            out << ": ";
+            if (p.inum != 0) {
+                out << "Inode " << p.inum << ": ";
+            }
+            out << p.what << "\n";
+        }
+    }
+
+    out << "\n";
+    out << "BATCH" << "\n";
+    out << "-----" << "\n";
+    out << "  Images: " << scans_.size() << "\n";
+    out << "  Failed to load: " << failed << "\n";
+    out << "  Files: " << files << "\n";
+    out << "  Directories: " << dirs << "\n";
+    out << "  Bytes: " << bytes << "\n";
+    out << "  Problems: " << problems << "\n";
+    out << "  Elapsed seconds: " << std::fixed << std::setprecision(3) << seconds_ << "\n";
+    out << std::flush;
+}
+
+const void Batch::print_stats() const
+{
+    scheduler_.print_stats();
+}
+
+double Batch::now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}; // namespace
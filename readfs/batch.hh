@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "imgread.hh"
+#include "fsck.hh"
+#include "hasher.hh"
+#include "scheduler.hh"
+
+namespace loomcom {
+
+//
+// Survey many images in one process.
+//
+// Each image is loaded, checked and walked, and optionally has every
+// file hashed, as a stream of small jobs on one work-stealing
+// scheduler: a job to load it, one to decode its i-list, one per
+// range of inodes to check, one per directory to walk and one per
+// file to hash. A handful of huge images are then spread across every
+// core instead of each holding one while the small ones finish.
+// Whatever is found goes into a single report, in manifest order.
+//
+class Batch {
+public:
+    struct Image {
+        std::string path;
+        int partition;          // VTOC partition, or -1
+    };
+
+    // Read a manifest: one image per line, optionally followed by the
+    // number of a VTOC partition. Blank lines and lines starting with
+    // '#' are skipped. Throws if the manifest can't be read.
+    static std::vector<Image> read_manifest(const std::string &file_name);
+
+    // Images are opened with `options`. Files are hashed only if
+    // `hash` is true.
+    Batch(const FileLoader::Options &options, unsigned threads, bool hash);
+    ~Batch();
+
+    // Returns the number of images that failed to load or that have
+    // problems.
+    const int run(const std::vector<Image> &images);
+
+    // Append the hash of every file to a hash database.
+    const void write_hashes(const std::string &db) const;
+
+    const void print_report(std::ostream &out) const;
+    const void print_stats() const;
+
+private:
+    // Everything known about one image. The loader and checker are
+    // dropped as soon as its last job is done.
+    struct Scan {
+        Scan() : pending(0), failed(false), files(0), dirs(0), bytes(0),
+                 block_size(0), fsize(0), tfree(0), problems(0),
+                 started(0), seconds(0) {}
+
+        Image image;
+        ImageSource::Ptr source;
+        std::unique_ptr<FileLoader> loader;
+        std::unique_ptr<Checker> checker;
+
+        std::atomic<uint64_t> pending;  // Jobs queued or running
+        std::atomic<bool> failed;
+
+        // Inodes already walked, so that links aren't counted twice
+        // and directory loops end
+        std::mutex lock;
+        std::unordered_set<uint32_t> seen;
+        std::vector<Hasher::Record> records;
+
+        std::atomic<uint64_t> files;
+        std::atomic<uint64_t> dirs;
+        std::atomic<uint64_t> bytes;
+
+        uint32_t block_size;
+        uint32_t fsize;
+        uint32_t tfree;
+        uint64_t problems;
+        std::vector<Checker::Problem> problem_list;
+        double started;
+        double seconds;
+    };
+
+    void spawn(Scan &scan, const Scheduler::Job &job);
+    void load(Scan &scan);
+    void start_check(Scan &scan);
+    void walk_dir(Scan &scan, FileEntry::Ptr dir, const std::string &path);
+    void hash_file(Scan &scan, FileEntry::Ptr file, const std::string &path);
+    void finish(Scan &scan);
+
+    static double now();
+
+    const FileLoader::Options options_;
+    const bool hash_;
+
+    Scheduler scheduler_;
+
+    // One READ_CHUNK buffer per worker, for hashing
+    std::vector<std::unique_ptr<uint8_t[]> > buffers_;
+
+    std::vector<std::unique_ptr<Scan> > scans_;
+    double seconds_;
+};
+
+}; // namespace
@@ -0,0 +1,320 @@
+//
+// Benchmarks of the readfs hot paths, built on Google Benchmark.
+//
+// Every run works on one image: either one named on the command line,
+// or a synthetic one generated for the run and deleted afterwards.
+// Benchmarks that take an argument run once reading the image through
+// mmap(2) (1) and once through pread(2) (0). Each iteration starts
+// from a fresh FileLoader, so the block cache and the directory tree
+// are always cold, but the image itself stays open and in the page
+// cache.
+//
+// Throughput is reported as inodes/s for the metadata paths and as
+// bytes/s for the ones that move file data.
+//
+
+#include "imgread.hh"
+#include "extract.hh"
+#include "synth.hh"
+
+#include <benchmark/benchmark.h>
+
+#include <ftw.h>
+
+using namespace loomcom;
+
+static std::string image_name;
+static ImageSource::Ptr images[2];     // [0] pread, [1] mmap
+
+static FileLoader::Options loader_options()
+{
+    FileLoader::Options options;
+    options.use_index = false;
+    return options;
+}
+
+static FileLoader *new_loader(const benchmark::State &state)
+{
+    FileLoader *loader = new FileLoader(images[state.range(0) != 0 ? 1 : 0], loader_options());
+    loader->load();
+    return loader;
+}
+
+static void set_rate(benchmark::State &state, const char *name, uint64_t count)
+{
+    state.counters[name] = benchmark::Counter((double) count, benchmark::Counter::kIsRate);
+}
+
+// The superblock, the root inode and nothing else
+static void BM_Superblock(benchmark::State &state)
+{
+    for (auto _ : state) {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        benchmark::DoNotOptimize(loader->superblock().s_fsize);
+    }
+
+    set_rate(state, "loads/s", state.iterations());
+}
+BENCHMARK(BM_Superblock)->Arg(1)->Arg(0);
+
+// The whole i-list, decoded into an InodeTable
+static void BM_InodeTable(benchmark::State &state)
+{
+    uint64_t inodes = 0;
+
+    for (auto _ : state) {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        inodes += loader->load_inode_table().count;
+    }
+
+    set_rate(state, "inodes/s", inodes);
+}
+BENCHMARK(BM_InodeTable)->Arg(1)->Arg(0);
+
+// Every directory read and every inode in the tree read one at a time
+static void BM_Walk(benchmark::State &state)
+{
+    uint64_t inodes = 0;
+
+    for (auto _ : state) {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        loader->walk([&inodes](const std::string &path, const FileEntry::Ptr &entry) {
+            inodes++;
+        });
+    }
+
+    set_rate(state, "inodes/s", inodes);
+}
+BENCHMARK(BM_Walk)->Arg(1)->Arg(0);
+
+// Path lookups against a loader whose directories are already read
+static void BM_Lookup(benchmark::State &state)
+{
+    std::unique_ptr<FileLoader> loader(new_loader(state));
+    std::vector<std::string> paths;
+
+    loader->walk([&paths](const std::string &path, const FileEntry::Ptr &entry) {
+        paths.push_back(path);
+    });
+
+    // Every other path misses in the last component.
+    size_t n = paths.size();
+    for (size_t i = 0; i < n; i += 2) {
+        paths.push_back(paths[i] + "~");
+    }
+
+    uint64_t lookups = 0;
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            benchmark::DoNotOptimize(loader->lookup(paths[i]));
+        }
+        lookups += paths.size();
+    }
+
+    set_rate(state, "lookups/s", lookups);
+}
+BENCHMARK(BM_Lookup)->Arg(1)->Arg(0);
+
+// All file data, read extent by extent through read_data()
+static void BM_ReadData(benchmark::State &state)
+{
+    std::vector<uint8_t> buf(Extractor::WRITE_CHUNK);
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+
+    for (auto _ : state) {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        loader->walk([&](const std::string &path, const FileEntry::Ptr &entry) {
+            if (entry->file_type != FileEntry::FT_REG) {
+                return;
+            }
+
+            std::vector<Extent> extents = loader->extents(*entry);
+            uint64_t offset = 0;
+            size_t n;
+
+            while ((n = loader->read_data(entry->inode, extents, offset,
+                                          buf.data(), buf.size())) > 0) {
+                offset += n;
+            }
+
+            bytes += offset;
+            files++;
+        });
+    }
+
+    state.SetBytesProcessed(bytes);
+    set_rate(state, "inodes/s", files);
+}
+BENCHMARK(BM_ReadData)->Arg(1)->Arg(0);
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+// The whole tree extracted to a scratch directory, with 1 and 4 workers
+static void BM_Extract(benchmark::State &state)
+{
+    char dir[] = "/tmp/imgbench.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        state.SkipWithError("Unable to make a scratch directory");
+        return;
+    }
+
+    std::string out = std::string(dir) + "/tree";
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+
+    {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        loader->walk([&](const std::string &path, const FileEntry::Ptr &entry) {
+            if (entry->file_type == FileEntry::FT_REG) {
+                bytes += entry->inode.di_size;
+                files++;
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        std::unique_ptr<FileLoader> loader(new_loader(state));
+        Extractor extractor(*loader, out, (unsigned) state.range(1));
+        extractor.run();
+
+        state.PauseTiming();
+        nftw(out.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        state.ResumeTiming();
+    }
+
+    rmdir(dir);
+
+    state.SetBytesProcessed(bytes * state.iterations());
+    set_rate(state, "inodes/s", files * state.iterations());
+}
+BENCHMARK(BM_Extract)->Args({1, 1})->Args({1, 4})->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+static void usage()
+{
+    std::cerr << "Usage: imgbench [benchmark options] [options] [<file>]" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Without a file, a synthetic image is generated for the run." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -t type      Filesystem type: 1 (512-byte blocks) or 2 (1K, default)" << std::endl;
+    std::cerr << "  -n files     Regular files (default 2000)" << std::endl;
+    std::cerr << "  -F fanout    Subdirectories per directory (default 8)" << std::endl;
+    std::cerr << "  -d depth     Levels of directories (default 2)" << std::endl;
+    std::cerr << "  -s min:max   File size range in bytes (default 0:65536)" << std::endl;
+    std::cerr << "  -D dist      File size distribution: log (default) or uniform" << std::endl;
+    std::cerr << "  -S seed      Random seed (default 1)" << std::endl;
+    std::cerr << "  -o file      Keep the synthetic image in `file'" << std::endl;
+    std::cerr << "  -g           Only generate the image; don't run benchmarks" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+
+    SyntheticImage::Spec spec;
+    std::string out;
+    bool generate_only = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:F:d:s:D:S:o:g")) != -1) {
+        switch (c) {
+        case 't':
+            spec.type = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            spec.files = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            spec.fanout = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            spec.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 's': {
+            char *end;
+            spec.min_size = strtoull(optarg, &end, 0);
+            spec.max_size = *end == ':' ? strtoull(end + 1, NULL, 0) : spec.min_size;
+            break;
+        }
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                spec.distribution = SyntheticImage::SIZE_UNIFORM;
+            } else if (strcmp(optarg, "log") == 0) {
+                spec.distribution = SyntheticImage::SIZE_LOG;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'S':
+            spec.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'g':
+            generate_only = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind > 1 || (generate_only && out.empty())) {
+        usage();
+        return 1;
+    }
+
+    bool generated = argc == optind;
+
+    try {
+        if (generated) {
+            if (out.empty()) {
+                char tmp[] = "/tmp/imgbench.XXXXXX";
+                int fd = mkstemp(tmp);
+
+                if (fd < 0) {
+                    std::cerr << "Unable to make a scratch image" << std::endl;
+                    return 1;
+                }
+
+                close(fd);
+                image_name = tmp;
+            } else {
+                image_name = out;
+            }
+
+            SyntheticImage::Stats stats = SyntheticImage::write(image_name, spec);
+            SyntheticImage::print_stats(spec, stats);
+            std::cout << std::endl;
+        } else {
+            image_name = argv[optind];
+        }
+
+        if (generate_only) {
+            return 0;
+        }
+
+        images[0] = ImageSource::open(image_name, false);
+        images[1] = ImageSource::open(image_name, true);
+    } catch (std::exception &e) {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    if (generated && out.empty()) {
+        unlink(image_name.c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "bitmap.hh"
+
+namespace loomcom {
+
+// The bits of a word at or above bit `i` of it.
+static uint64_t mask_from(size_t i)
+{
+    return ~(uint64_t) 0 << (i % 64);
+}
+
+void Bitmap::set_range(size_t begin, size_t end)
+{
+    if (end > bits_) {
+        end = bits_;
+    }
+
+    for (size_t i = begin; i < end; ) {
+        if (i % 64 == 0 && end - i >= 64) {
+            words_[i / 64] = ~(uint64_t) 0;
+            i += 64;
+        } else {
+            set(i++);
+        }
+    }
+}
+
+void Bitmap::merge(const Bitmap &other, Bitmap &both)
+{
+    for (size_t w = 0; w < words_.size(); w++) {
+        both.words_[w] |= words_[w] & other.words_[w];
+        words_[w] |= other.words_[w];
+    }
+}
+
+size_t Bitmap::count() const
+{
+    size_t n = 0;
+
+    for (size_t w = 0; w < words_.size(); w++) {
+        n += __builtin_popcountll(words_[w]);
+    }
+
+    return n;
+}
+
+size_t Bitmap::count(size_t begin, size_t end) const
+{
+    if (end > bits_) {
+        end = bits_;
+    }
+
+    if (begin >= end) {
+        return 0;
+    }
+
+    size_t first = begin / 64, last = (end - 1) / 64;
+    uint64_t tail = (end % 64) ? ~mask_from(end) : ~(uint64_t) 0;
+
+    if (first == last) {
+        return __builtin_popcountll(words_[first] & mask_from(begin) & tail);
+    }
+
+    size_t n = __builtin_popcountll(words_[first] & mask_from(begin));
+
+    for (size_t w = first + 1; w < last; w++) {
+        n += __builtin_popcountll(words_[w]);
+    }
+
+    return n + __builtin_popcountll(words_[last] & tail);
+}
+
+size_t Bitmap::find_set(size_t from) const
+{
+    if (from >= bits_) {
+        return NPOS;
+    }
+
+    size_t w = from / 64;
+    uint64_t word = words_[w] & mask_from(from);
+
+    while (word == 0) {
+        if (++w == words_.size()) {
+            return NPOS;
+        }
+        word = words_[w];
+    }
+
+    return w * 64 + __builtin_ctzll(word);
+}
+
+size_t Bitmap::find_clear(size_t from) const
+{
+    if (from >= bits_) {
+        return NPOS;
+    }
+
+    size_t w = from / 64;
+    uint64_t word = ~words_[w] & mask_from(from);
+
+    while (word == 0) {
+        if (++w == words_.size()) {
+            return NPOS;
+        }
+        word = ~words_[w];
+    }
+
+    size_t i = w * 64 + __builtin_ctzll(word);
+
+    // The padding past the end reads as clear.
+    return i < bits_ ? i : NPOS;
+}
+
+}; // namespace
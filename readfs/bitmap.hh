@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// A fixed-size set of bits, packed 64 to a word. Bits past the end of
+// the last word are always clear, so whole-word operations can ignore
+// them.
+//
+class Bitmap {
+public:
+    // Returned by the find functions when there is no such bit.
+    const static size_t NPOS = (size_t) -1;
+
+    explicit Bitmap(size_t bits = 0) : bits_(bits), words_((bits + 63) / 64, 0) {}
+
+    size_t size() const { return bits_; }
+
+    bool test(size_t i) const { return (words_[i / 64] >> (i % 64)) & 1; }
+    void set(size_t i) { words_[i / 64] |= (uint64_t) 1 << (i % 64); }
+    void clear(size_t i) { words_[i / 64] &= ~((uint64_t) 1 << (i % 64)); }
+
+    // Set every bit in [begin, end).
+    void set_range(size_t begin, size_t end);
+
+    // Set every bit that is set in `other`, which must be the same
+    // size. Bits that were already set here too are also set in `both`.
+    void merge(const Bitmap &other, Bitmap &both);
+
+    // The number of set bits, overall or in [begin, end).
+    size_t count() const;
+    size_t count(size_t begin, size_t end) const;
+
+    // The first set (or clear) bit at or after `from`, or NPOS.
+    size_t find_set(size_t from) const;
+    size_t find_clear(size_t from) const;
+
+    const std::vector<uint64_t> &words() const { return words_; }
+
+private:
+    size_t bits_;
+    std::vector<uint64_t> words_;
+};
+
+}; // namespace
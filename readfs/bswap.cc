@@ -0,0 +1,32 @@
+#include "bswap.hh"
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace loomcom {
+
+void be24_unpack(const uint8_t *src, uint32_t *dst, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__SSSE3__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Four 3-byte addresses per 12 input bytes, widened and swapped
+    // into four host-order words. 0x80 lanes come out as zero.
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, (char) 0x80,
+                                       5, 4, 3, (char) 0x80,
+                                       8, 7, 6, (char) 0x80,
+                                       11, 10, 9, (char) 0x80);
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_shuffle_epi8(v, mask));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = be24(src + i * 3);
+    }
+}
+
+}; // namespace
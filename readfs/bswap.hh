@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// Byte order helpers. Everything on a 3B2 disk is big-endian.
+//
+
+inline uint16_t bswap16(uint16_t val)
+{
+    return __builtin_bswap16(val);
+}
+
+inline uint32_t bswap32(uint32_t val)
+{
+    return __builtin_bswap32(val);
+}
+
+inline uint16_t be16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+inline uint32_t be32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+            (uint32_t) p[2] << 8 | (uint32_t) p[3]);
+}
+
+// A 3-byte disk block address, as packed into di_addr.
+inline uint32_t be24(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | (uint32_t) p[2]);
+}
+
+// Unpack `count` 3-byte addresses from `src` into `dst`, with an SSSE3
+// shuffle when the compiler is allowed to use one. `src` must be
+// readable for at least 4 bytes past the last address.
+void be24_unpack(const uint8_t *src, uint32_t *dst, size_t count);
+
+}; // namespace
@@ -0,0 +1,311 @@
+#include "build.hh"
+
+#include <chrono>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+
+namespace loomcom {
+
+// Inode numbers must fit a directory entry, with some to spare.
+static const uint64_t MAX_INODES = 65000;
+
+Builder::Builder(const std::string &source, const std::string &image, const Options &options) :
+    source_(source),
+    image_(image),
+    options_(options),
+    dirs_(0),
+    files_(0),
+    links_(0),
+    skipped_(0),
+    bytes_(0),
+    blocks_(0),
+    free_blocks_(0),
+    free_inodes_(0),
+    writes_(0),
+    bytes_written_(0),
+    seconds_(0)
+{
+}
+
+const int Builder::run()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    Node root;
+    root.path = source_;
+    root.parent = 0;
+    root.inum = 0;
+
+    if (stat(source_.c_str(), &root.st) < 0 || !S_ISDIR(root.st.st_mode)) {
+        std::cerr << source_ << ": Not a directory" << std::endl;
+        throw std::exception();
+    }
+
+    nodes_.push_back(root);
+
+    // Breadth first, which is also the order the directories are made in.
+    std::vector<uint32_t> dirs(1, 0);
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+        scan(dirs[i]);
+
+        const std::vector<uint32_t> &children = nodes_[dirs[i]].children;
+        for (size_t j = 0; j < children.size(); j++) {
+            if (S_ISDIR(nodes_[children[j]].st.st_mode)) {
+                dirs.push_back(children[j]);
+            }
+        }
+    }
+
+    // Size the filesystem. Hard links take up an inode and blocks once.
+    uint32_t block_size = options_.type == 1 ? 512 : 1024;
+    std::map<std::pair<dev_t, ino_t>, uint32_t> seen;
+    uint64_t inodes = FileLoader::ROOT_INODE;
+    uint64_t blocks = 0;
+
+    for (size_t i = 0; i < nodes_.size(); i++) {
+        const Node &n = nodes_[i];
+
+        if (S_ISDIR(n.st.st_mode)) {
+            uint64_t size = (uint64_t) (n.children.size() + 2) * FileLoader::DIRENTRY_SIZE;
+            blocks += ImageWriter::blocks_for(size, block_size);
+            inodes++;
+        } else if (seen.insert(std::make_pair(std::make_pair(n.st.st_dev, n.st.st_ino),
+                                              0)).second) {
+            blocks += ImageWriter::blocks_for(n.st.st_size, block_size);
+            inodes++;
+        }
+    }
+
+    if (inodes > MAX_INODES) {
+        std::cerr << source_ << ": " << inodes <<
+            " files are more than a SysV filesystem can hold" << std::endl;
+        throw std::exception();
+    }
+
+    ImageWriter::Options options;
+    options.type = options_.type;
+    options.inodes = (uint32_t) (inodes + inodes / 16 + 16);
+    options.time = options_.time != 0 ? options_.time : (uint32_t) ::time(NULL);
+    options.fname = options_.fname;
+    options.fpack = options_.fpack;
+
+    uint32_t per_block = block_size / FileLoader::INODE_SIZE;
+    blocks += 2 + (options.inodes + per_block - 1) / per_block;
+
+    // Leave some room to grow, and for the free list to have a chain.
+    blocks += blocks / 16 + 256;
+
+    if (blocks > UINT32_MAX) {
+        std::cerr << source_ << ": Too big for a SysV filesystem" << std::endl;
+        throw std::exception();
+    }
+
+    options.blocks = (uint32_t) blocks;
+
+    ImageWriter writer(image_, options);
+
+    nodes_[0].inum = writer.root();
+
+    for (size_t i = 1; i < dirs.size(); i++) {
+        Node &n = nodes_[dirs[i]];
+
+        // A parent always comes before its children in `dirs`.
+        n.inum = writer.mkdir(nodes_[n.parent].inum, n.name, attr_of(n.st));
+        dirs_++;
+    }
+
+    // File data, a directory at a time.
+    std::map<std::pair<dev_t, ino_t>, uint32_t> made;
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+        const Node &dir = nodes_[dirs[i]];
+
+        for (size_t j = 0; j < dir.children.size(); j++) {
+            Node &n = nodes_[dir.children[j]];
+
+            if (S_ISDIR(n.st.st_mode)) {
+                continue;
+            }
+
+            std::pair<dev_t, ino_t> key = std::make_pair(n.st.st_dev, n.st.st_ino);
+            std::map<std::pair<dev_t, ino_t>, uint32_t>::const_iterator it = made.find(key);
+
+            if (it != made.end()) {
+                writer.link(dir.inum, n.name, it->second);
+                links_++;
+                continue;
+            }
+
+            add_file(writer, dir.inum, n);
+
+            if (n.inum != 0) {
+                made[key] = n.inum;
+            }
+        }
+    }
+
+    writer.finish();
+
+    blocks_ = writer.blocks();
+    free_blocks_ = writer.free_blocks();
+    free_inodes_ = writer.free_inodes();
+    writes_ = writer.writes();
+    bytes_written_ = writer.bytes_written();
+    seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return (int) skipped_;
+}
+
+//
+// Read the entries of directory nodes_[dir] into nodes_, sorted by name.
+//
+void Builder::scan(uint32_t dir)
+{
+    std::string path = nodes_[dir].path;
+    DIR *d = opendir(path.c_str());
+
+    if (d == NULL) {
+        skip(path, strerror(errno));
+        return;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *e;
+
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+            names.push_back(e->d_name);
+        }
+    }
+
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        Node n;
+        n.path = path + "/" + names[i];
+        n.name = names[i];
+        n.parent = dir;
+        n.inum = 0;
+
+        if (lstat(n.path.c_str(), &n.st) < 0) {
+            skip(n.path, strerror(errno));
+            continue;
+        }
+
+        if (n.name.size() > DentryView::NAME_LEN) {
+            skip(n.path, "name is longer than 14 characters");
+            continue;
+        }
+
+        if (!S_ISDIR(n.st.st_mode) && !S_ISREG(n.st.st_mode)) {
+            skip(n.path, "not a regular file or directory");
+            continue;
+        }
+
+        if (S_ISREG(n.st.st_mode) && (uint64_t) n.st.st_size > UINT32_MAX) {
+            skip(n.path, "too big for a SysV filesystem");
+            continue;
+        }
+
+        nodes_[dir].children.push_back((uint32_t) nodes_.size());
+        nodes_.push_back(n);
+    }
+}
+
+void Builder::skip(const std::string &path, const char *why)
+{
+    std::cerr << path << ": " << why << "; skipped" << std::endl;
+    skipped_++;
+}
+
+//
+// Copy one host file in. Its data is mapped rather than read, so that
+// large files go from the page cache to the image in one write.
+//
+const void Builder::add_file(ImageWriter &writer, uint32_t parent, Node &node)
+{
+    int fd = open(node.path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        skip(node.path, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || st.st_size != node.st.st_size) {
+        close(fd);
+        skip(node.path, "changed while building");
+        return;
+    }
+
+    const uint8_t *data = NULL;
+    void *map = MAP_FAILED;
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            close(fd);
+            skip(node.path, strerror(errno));
+            return;
+        }
+
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const uint8_t *>(map);
+    }
+
+    try {
+        node.inum = writer.add_file(parent, node.name, attr_of(node.st), data, st.st_size);
+    } catch (std::exception &e) {
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        close(fd);
+        throw;
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    close(fd);
+
+    files_++;
+    bytes_ += st.st_size;
+}
+
+ImageWriter::Attr Builder::attr_of(const struct stat &st)
+{
+    ImageWriter::Attr attr;
+    attr.mode = (uint16_t) (st.st_mode & 07777);
+    attr.uid = (uint16_t) st.st_uid;
+    attr.gid = (uint16_t) st.st_gid;
+    attr.atime = (uint32_t) st.st_atime;
+    attr.mtime = (uint32_t) st.st_mtime;
+    attr.ctime = (uint32_t) st.st_ctime;
+    return attr;
+}
+
+const void Builder::print_stats() const
+{
+    std::cout << "BUILD" << std::endl;
+    std::cout << "-----" << std::endl;
+    std::cout << "  Directories: " << std::dec << dirs_ << std::endl;
+    std::cout << "  Files: " << files_ << std::endl;
+    std::cout << "  Hard links: " << links_ << std::endl;
+    std::cout << "  Bytes of file data: " << bytes_ << std::endl;
+    std::cout << "  Skipped: " << skipped_ << std::endl;
+    std::cout << "  Size in blocks: " << blocks_ << std::endl;
+    std::cout << "  Free blocks: " << free_blocks_ << std::endl;
+    std::cout << "  Free inodes: " << free_inodes_ << std::endl;
+    std::cout << "  Writes: " << writes_ << " (" << bytes_written_ << " bytes)" << std::endl;
+    std::cout << "  Elapsed seconds: " << std::fixed << std::setprecision(3) << seconds_ << std::endl;
+}
+
+}; // namespace
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "writer.hh"
+
+namespace loomcom {
+
+//
+// Build a new SysV image from a directory tree on the host.
+//
+// The tree is scanned first, so that the filesystem can be made just
+// big enough for it, with some room to spare. Directories are then
+// made breadth first, so the inodes of each level sit together, and
+// file data goes down directory by directory in name order. Each file
+// is one contiguous run of blocks, and since the runs follow on from
+// one another, ImageWriter writes them out as a few large sequential
+// writes rather than one per file.
+//
+// Regular files, directories and hard links are copied with their
+// permissions, owners and times. Anything else (symbolic links,
+// devices, sockets), names too long for a directory entry and files
+// that can't be read are reported and left out.
+//
+class Builder {
+public:
+    struct Options {
+        Options() : type(2), time(0) {}
+
+        uint32_t type;          // s_type: 1 for 512-byte blocks, 2 for 1K
+        uint32_t time;          // s_time; 0 for now
+        std::string fname;      // s_fname, up to 6 characters
+        std::string fpack;      // s_fpack, up to 6 characters
+    };
+
+    Builder(const std::string &source, const std::string &image,
+            const Options &options = Options());
+
+    // Returns the number of host files left out.
+    const int run();
+
+    const void print_stats() const;
+
+private:
+    struct Node {
+        std::string path;               // On the host
+        std::string name;
+        struct stat st;
+        uint32_t parent;                // Index into nodes_
+        std::vector<uint32_t> children; // Indexes into nodes_, by name
+        uint32_t inum;                  // Once made
+    };
+
+    void scan(uint32_t dir);
+    void skip(const std::string &path, const char *why);
+    const void add_file(ImageWriter &writer, uint32_t parent, Node &node);
+    static ImageWriter::Attr attr_of(const struct stat &st);
+
+    const std::string source_;
+    const std::string image_;
+    const Options options_;
+
+    // The tree; nodes_[0] is the root
+    std::vector<Node> nodes_;
+
+    uint32_t dirs_;
+    uint32_t files_;
+    uint32_t links_;
+    uint32_t skipped_;
+    uint64_t bytes_;
+
+    uint32_t blocks_;
+    uint32_t free_blocks_;
+    uint32_t free_inodes_;
+    uint64_t writes_;
+    uint64_t bytes_written_;
+    double seconds_;
+};
+
+}; // namespace
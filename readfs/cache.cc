@@ -0,0 +1,262 @@
+#include "cache.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <exception>
+
+#include <string.h>
+
+namespace loomcom {
+
+BlockCache::BlockCache(ImageSource::Ptr image, uint64_t base,
+                       uint32_t block_size, size_t capacity,
+                       unsigned readahead, unsigned io_depth, bool io_uring) :
+    image_(image),
+    base_(base),
+    block_size_(block_size),
+    capacity_(capacity > 0 ? capacity : 1),
+    readahead_(readahead),
+    io_depth_(io_depth),
+    io_uring_(io_uring),
+    last_miss_(0xffffffff),
+    direct_(0)
+{
+}
+
+BlockCache::Block BlockCache::get(uint32_t blkno)
+{
+    uint64_t offset = base_ + (uint64_t) blkno * block_size_;
+
+    if (image_->mapped()) {
+        ByteView v = image_->view(offset, block_size_);
+        direct_.fetch_add(1, std::memory_order_relaxed);
+        Trace::count(Trace::CACHE_DIRECT);
+        // The block lives as long as the mapping, so the image is the owner.
+        return Block(image_, v.data());
+    }
+
+    // Read this block, plus the following ones if we seem to be
+    // walking forward through the image.
+    uint64_t count = 1;
+
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        std::unordered_map<uint32_t, Entry>::iterator it = blocks_.find(blkno);
+
+        if (it != blocks_.end()) {
+            stats_.hits++;
+            Trace::count(Trace::CACHE_HITS);
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return Block(it->second.buf, it->second.buf->data());
+        }
+
+        stats_.misses++;
+        Trace::count(Trace::CACHE_MISSES);
+
+        if (readahead_ > 0 && blkno == last_miss_ + 1) {
+            count += readahead_;
+        }
+
+        last_miss_ = blkno;
+    }
+
+    uint64_t avail = (image_->size() > offset) ?
+        (image_->size() - offset) / block_size_ : 0;
+
+    if (count > avail) {
+        count = avail > 0 ? avail : 1;
+    }
+
+    // Read without holding the lock, so other threads can carry on
+    // with blocks that are already here. Two threads missing on the
+    // same block both read it, and the first to get back keeps it.
+    std::vector<uint8_t> run(count * block_size_);
+    image_->read(offset, run.data(), run.size());
+
+    std::lock_guard<std::mutex> guard(lock_);
+
+    Buffer result;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t n = blkno + (uint32_t) i;
+        std::unordered_map<uint32_t, Entry>::iterator it = blocks_.find(n);
+
+        if (it != blocks_.end()) {
+            if (i == 0) {
+                result = it->second.buf;
+                lru_.splice(lru_.begin(), lru_, it->second.lru);
+            }
+            continue;
+        }
+
+        Buffer buf = std::make_shared<std::vector<uint8_t> >(
+            run.begin() + i * block_size_,
+            run.begin() + (i + 1) * block_size_);
+
+        insert(n, buf);
+
+        if (i == 0) {
+            result = buf;
+        } else {
+            stats_.readahead++;
+            last_miss_ = n;
+        }
+    }
+
+    return Block(result, result->data());
+}
+
+void BlockCache::prefetch(const std::vector<uint32_t> &blknos)
+{
+    std::vector<uint32_t> wanted;
+    uint64_t avail = image_->size() > base_ ? (image_->size() - base_) / block_size_ : 0;
+
+    for (size_t i = 0; i < blknos.size(); i++) {
+        if (blknos[i] != 0 && blknos[i] < avail) {
+            wanted.push_back(blknos[i]);
+        }
+    }
+
+    std::sort(wanted.begin(), wanted.end());
+    wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+    bool mapped = image_->mapped();
+
+    if (!mapped) {
+        if (io_depth_ == 0 || image_->raw_fd() < 0) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(lock_);
+        std::vector<uint32_t>::iterator out = wanted.begin();
+
+        for (std::vector<uint32_t>::iterator it = wanted.begin(); it != wanted.end(); it++) {
+            if (blocks_.find(*it) == blocks_.end()) {
+                *out++ = *it;
+            }
+        }
+
+        wanted.erase(out, wanted.end());
+
+        // Don't let a prefetch evict what it has only just brought in.
+        if (wanted.size() > capacity_ / 2) {
+            wanted.resize(capacity_ / 2);
+        }
+    }
+
+    // Turn the blocks into runs of neighbours, one read each.
+    std::vector<std::pair<uint32_t, uint32_t> > runs;
+
+    for (size_t i = 0; i < wanted.size(); i++) {
+        if (!runs.empty() && wanted[i] == runs.back().first + runs.back().second &&
+            runs.back().second < MAX_PREFETCH_RUN) {
+            runs.back().second++;
+        } else {
+            runs.push_back(std::make_pair(wanted[i], 1));
+        }
+    }
+
+    if (mapped) {
+        // Let the kernel start paging the runs in; get() needs no copy.
+        for (size_t i = 0; i < runs.size(); i++) {
+            image_->will_need(base_ + (uint64_t) runs[i].first * block_size_,
+                              (size_t) runs[i].second * block_size_);
+        }
+        return;
+    }
+
+    // A lone block is no quicker to fetch ahead of time.
+    if (wanted.size() < 2) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> io(prefetch_lock_);
+
+    if (!reader_) {
+        reader_ = AsyncReader::open(image_->raw_fd(), io_depth_, io_uring_);
+    }
+
+    std::vector<std::vector<uint8_t> > bufs(runs.size());
+    std::vector<AsyncReader::Request> reqs(runs.size());
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        bufs[i].resize((size_t) runs[i].second * block_size_);
+        reqs[i].offset = base_ + (uint64_t) runs[i].first * block_size_;
+        reqs[i].buf = bufs[i].data();
+        reqs[i].len = bufs[i].size();
+    }
+
+    try {
+        reader_->read_all(reqs, [&](size_t i) {
+            std::lock_guard<std::mutex> guard(lock_);
+
+            stats_.prefetch_reads++;
+
+            for (uint32_t j = 0; j < runs[i].second; j++) {
+                uint32_t n = runs[i].first + j;
+
+                if (blocks_.find(n) != blocks_.end()) {
+                    continue;
+                }
+
+                insert(n, std::make_shared<std::vector<uint8_t> >(
+                           bufs[i].begin() + (size_t) j * block_size_,
+                           bufs[i].begin() + (size_t) (j + 1) * block_size_));
+                stats_.prefetched++;
+            }
+        });
+    } catch (std::exception &e) {
+        // Whatever did arrive is cached; get() reports the rest.
+    }
+}
+
+void BlockCache::insert(uint32_t blkno, const Buffer &buf)
+{
+    while (blocks_.size() >= capacity_) {
+        uint32_t victim = lru_.back();
+        lru_.pop_back();
+        blocks_.erase(victim);
+        stats_.evictions++;
+    }
+
+    lru_.push_front(blkno);
+
+    Entry e;
+    e.buf = buf;
+    e.lru = lru_.begin();
+    blocks_[blkno] = e;
+}
+
+BlockCache::Stats BlockCache::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    Stats s = stats_;
+    s.direct = direct_.load(std::memory_order_relaxed);
+    return s;
+}
+
+void BlockCache::print_stats() const
+{
+    Stats s = stats();
+
+    std::cout << "BLOCK CACHE" << std::endl;
+    std::cout << "-----------" << std::endl;
+    std::cout << "  Capacity in blocks: " << std::dec << capacity_ << std::endl;
+    std::cout << "  Block size: " << block_size_ << std::endl;
+    std::cout << "  Hits: " << s.hits << std::endl;
+    std::cout << "  Misses: " << s.misses << std::endl;
+    std::cout << "  Read-ahead blocks: " << s.readahead << std::endl;
+    std::cout << "  Evictions: " << s.evictions << std::endl;
+    std::cout << "  Mapped (uncached) reads: " << s.direct << std::endl;
+    std::cout << "  Prefetched blocks: " << s.prefetched << std::endl;
+    std::cout << "  Prefetch reads: " << s.prefetch_reads;
+
+    if (reader_) {
+        std::cout << " (" << reader_->name() << ", queue depth " << reader_->depth() << ")";
+    }
+
+    std::cout << std::endl;
+}
+
+}; // namespace
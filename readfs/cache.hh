@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "aio.hh"
+#include "image.hh"
+#include "trace.hh"
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// A cache of filesystem blocks over an ImageSource.
+//
+// Blocks are numbered the same way as on-disk block addresses, i.e.
+// from `base`, the byte offset of the start of the filesystem in the
+// image. Least recently used blocks are evicted once more than
+// `capacity` blocks are held. A miss on the block that follows the
+// previous miss is treated as a sequential scan, and the next
+// `readahead` blocks are fetched in the same read.
+//
+// Mapped images don't need a second copy of their data, so blocks of
+// a mapped image are handed out directly and only counted.
+//
+// Callers that know which blocks they are about to want can prefetch
+// them, and up to `io_depth` reads for them go out at once.
+//
+class BlockCache {
+public:
+    // A cached block. Holding one keeps its bytes alive even if the
+    // cache evicts it.
+    typedef std::shared_ptr<const uint8_t> Block;
+
+    struct Stats {
+        Stats() : hits(0), misses(0), readahead(0), evictions(0), direct(0),
+                  prefetched(0), prefetch_reads(0) {}
+
+        uint64_t hits;       // Requests served from the cache
+        uint64_t misses;     // Requests that went to the image
+        uint64_t readahead;  // Blocks brought in by read-ahead
+        uint64_t evictions;  // Blocks dropped to stay under capacity
+        uint64_t direct;     // Requests served straight from a mapping
+        uint64_t prefetched; // Blocks brought in by prefetch()
+        uint64_t prefetch_reads; // Asynchronous reads that brought them
+    };
+
+    // Longest run of blocks one prefetch read will cover
+    const static size_t MAX_PREFETCH_RUN = 64;
+
+    BlockCache(ImageSource::Ptr image, uint64_t base, uint32_t block_size,
+               size_t capacity, unsigned readahead,
+               unsigned io_depth = 0, bool io_uring = true);
+
+    // Return block `blkno`. Throws if it lies past the end of the image.
+    Block get(uint32_t blkno);
+
+    // Bring in the listed blocks that aren't already cached, keeping
+    // many reads in flight, and return once they have all arrived.
+    // Block zero is taken to be a hole and skipped. Only a hint: if
+    // the reads fail, get() will find out again and say so.
+    void prefetch(const std::vector<uint32_t> &blknos);
+
+    uint32_t block_size() const { return block_size_; }
+    size_t capacity() const { return capacity_; }
+
+    Stats stats() const;
+    void print_stats() const;
+
+private:
+    typedef std::shared_ptr<std::vector<uint8_t> > Buffer;
+
+    struct Entry {
+        Buffer buf;
+        std::list<uint32_t>::iterator lru;
+    };
+
+    void insert(uint32_t blkno, const Buffer &buf);
+
+    const ImageSource::Ptr image_;
+    const uint64_t base_;
+    const uint32_t block_size_;
+    const size_t capacity_;
+    const unsigned readahead_;
+    const unsigned io_depth_;
+    const bool io_uring_;
+
+    // One prefetch at a time drives the reader, made on first use.
+    std::mutex prefetch_lock_;
+    AsyncReader::Ptr reader_;
+
+    mutable std::mutex lock_;
+    std::unordered_map<uint32_t, Entry> blocks_;
+    std::list<uint32_t> lru_;    // Most recently used at the front
+    uint32_t last_miss_;
+    Stats stats_;
+
+    // Mapped blocks never touch the cache proper, so they are counted
+    // without taking the lock.
+    std::atomic<uint64_t> direct_;
+};
+
+}; // namespace
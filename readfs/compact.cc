@@ -0,0 +1,131 @@
+#include "compact.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+
+namespace loomcom {
+
+Compactor::Compactor(FileLoader &loader, const std::string &out_path) :
+    loader_(loader),
+    out_path_(out_path),
+    bytes_written_(0),
+    bytes_skipped_(0),
+    runs_(0)
+{
+}
+
+const void Compactor::run()
+{
+    const AllocationMap &map = loader_.load_allocation_map();
+    const ImageSource::Ptr &image = loader_.image();
+    uint64_t image_size = image->size();
+    uint64_t block_size = loader_.block_size();
+
+    int fd = open(out_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        std::cerr << "Unable to create " << out_path_ << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    std::vector<uint8_t> buf;
+
+    // Everything ahead of the filesystem is copied as is.
+    copy_range(fd, 0, std::min<uint64_t>(loader_.base(), image_size), buf);
+
+    // Then each run of allocated blocks.
+    size_t start = map.blocks.find_set(0);
+
+    while (start != Bitmap::NPOS) {
+        size_t end = map.blocks.find_clear(start);
+
+        if (end == Bitmap::NPOS) {
+            end = map.blocks.size();
+        }
+
+        uint64_t offset = loader_.base() + start * block_size;
+        uint64_t len = (end - start) * block_size;
+
+        if (offset < image_size) {
+            copy_range(fd, offset, std::min(len, image_size - offset), buf);
+            runs_++;
+        }
+
+        start = map.blocks.find_set(end);
+    }
+
+    // The free list has to survive for the copy to stay mountable.
+    for (size_t i = 0; i < map.chain.size(); i++) {
+        copy_range(fd, loader_.base() + map.chain[i] * block_size, block_size, buf);
+    }
+
+    // And anything past the end of the filesystem, such as other
+    // partitions.
+    uint64_t fs_end = loader_.base() + map.blocks.size() * block_size;
+
+    if (fs_end < image_size) {
+        copy_range(fd, fs_end, image_size - fs_end, buf);
+    }
+
+    // Trailing free blocks still have to count towards the length.
+    if (ftruncate(fd, (off_t) image_size) < 0 || close(fd) < 0) {
+        std::cerr << "Unable to write " << out_path_ << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    bytes_skipped_ = image_size - bytes_written_;
+}
+
+void Compactor::copy_range(int fd, uint64_t offset, uint64_t len, std::vector<uint8_t> &buf)
+{
+    const ImageSource::Ptr &image = loader_.image();
+    const uint64_t chunk = COPY_CHUNK;
+
+    while (len > 0) {
+        size_t n = (size_t) std::min(len, chunk);
+        const uint8_t *data;
+
+        if (image->mapped()) {
+            data = image->view(offset, n).data();
+        } else {
+            buf.resize(COPY_CHUNK);
+            image->read(offset, buf.data(), n);
+            data = buf.data();
+        }
+
+        // The output is written at the same offsets, so whatever was
+        // skipped in between is left as a hole.
+        size_t done = 0;
+
+        while (done < n) {
+            ssize_t w = pwrite(fd, data + done, n - done, (off_t) (offset + done));
+
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Unable to write " << out_path_ << ": " <<
+                    strerror(errno) << std::endl;
+                close(fd);
+                throw std::exception();
+            }
+
+            done += (size_t) w;
+        }
+
+        bytes_written_ += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+const void Compactor::print_stats() const
+{
+    std::cout << "COMPACTION" << std::endl;
+    std::cout << "----------" << std::endl;
+    std::cout << "  Runs of allocated blocks: " << std::dec << runs_ << std::endl;
+    std::cout << "  Bytes written: " << bytes_written_ << std::endl;
+    std::cout << "  Bytes left as holes: " << bytes_skipped_ << std::endl;
+}
+
+}; // namespace
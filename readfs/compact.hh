@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "imgread.hh"
+
+namespace loomcom {
+
+//
+// Write a sparse copy of a filesystem image.
+//
+// Only blocks the allocation map says are in use are written, along
+// with the blocks holding the free list and everything in the image
+// outside the filesystem itself. Other free blocks are seeked over and
+// left as holes, so the copy takes only as much room on the host as
+// the filesystem has data, and reads back as the original with every
+// free block zeroed.
+//
+// The free list is trusted as is. A block that is on the free list but
+// still belongs to a file is dropped; check the filesystem first if
+// that matters.
+//
+class Compactor {
+public:
+    // Largest single read or write
+    const static size_t COPY_CHUNK = 1024 * 1024;
+
+    Compactor(FileLoader &loader, const std::string &out_path);
+
+    const void run();
+
+    const void print_stats() const;
+
+private:
+    void copy_range(int fd, uint64_t offset, uint64_t len, std::vector<uint8_t> &buf);
+
+    FileLoader &loader_;
+    const std::string out_path_;
+
+    uint64_t bytes_written_;
+    uint64_t bytes_skipped_;
+    uint64_t runs_;
+};
+
+}; // namespace
@@ -0,0 +1,546 @@
+#include "compressed.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <exception>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lzma.h>
+#include <zlib.h>
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// ChunkedImageSource
+//
+
+ChunkedImageSource::ChunkedImageSource(const std::string &file_name, int fd, uint64_t size,
+                                       const std::vector<uint64_t> &chunk_starts) :
+    ImageSource(file_name, fd, size),
+    starts_(chunk_starts),
+    decoded_(0)
+{
+}
+
+bool ChunkedImageSource::mapped() const
+{
+    return false;
+}
+
+int ChunkedImageSource::raw_fd() const
+{
+    // The file holds compressed bytes, not the image's.
+    return -1;
+}
+
+uint64_t ChunkedImageSource::chunk_size(size_t n) const
+{
+    return (n + 1 < starts_.size() ? starts_[n + 1] : size_) - starts_[n];
+}
+
+void ChunkedImageSource::read(uint64_t offset, void *buf, size_t len) const
+{
+    check_range(offset, len);
+
+    uint8_t *p = static_cast<uint8_t *>(buf);
+
+    while (len > 0) {
+        // The last chunk starting at or before `offset`
+        size_t n = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+        uint64_t skip = offset - starts_[n];
+        size_t count = (size_t) std::min<uint64_t>(len, chunk_size(n) - skip);
+
+        Buffer data = chunk(n);
+        memcpy(p, data->data() + skip, count);
+        Trace::count(Trace::BYTES_READ, count);
+
+        p += count;
+        offset += count;
+        len -= count;
+    }
+}
+
+ChunkedImageSource::Buffer ChunkedImageSource::chunk(size_t n) const
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        std::unordered_map<size_t, Buffer>::iterator it = chunks_.find(n);
+
+        if (it != chunks_.end()) {
+            lru_.remove(n);
+            lru_.push_front(n);
+            return it->second;
+        }
+    }
+
+    // Decompress without holding the lock, so other threads can carry
+    // on with chunks that are already here. Two threads missing on the
+    // same chunk both decode it, which is harmless.
+    Buffer buf(new std::vector<uint8_t>((size_t) chunk_size(n)));
+    decode_chunk(n, buf->data(), buf->size());
+
+    std::lock_guard<std::mutex> guard(lock_);
+
+    decoded_++;
+
+    if (chunks_.find(n) == chunks_.end()) {
+        chunks_[n] = buf;
+        lru_.push_front(n);
+
+        while (chunks_.size() > CHUNK_CACHE) {
+            chunks_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+
+    return buf;
+}
+
+void ChunkedImageSource::read_raw(uint64_t offset, void *buf, size_t len) const
+{
+    uint8_t *p = static_cast<uint8_t *>(buf);
+
+    while (len > 0) {
+        ssize_t n = pread(fd_, p, len, (off_t) offset);
+        Trace::count(Trace::IO_CALLS);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            std::cerr << "Failed to read " << file_name_ << " at offset " <<
+                offset << std::endl;
+            throw std::exception();
+        }
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+void ChunkedImageSource::print_stats() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+
+    std::cout << "DECOMPRESSION" << std::endl;
+    std::cout << "-------------" << std::endl;
+    std::cout << "  Chunks: " << std::dec << starts_.size() << std::endl;
+    std::cout << "  Chunks decompressed: " << decoded_ << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////
+// GzipImageSource
+//
+
+static const char GZI_MAGIC[8] = "3B2RGZI";
+static const uint32_t GZI_VERSION = 1;
+
+struct GziHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;             // Access points
+    uint64_t compressed_size;   // Of the image, when the index was made
+    int64_t mtime;
+    uint64_t size;              // Uncompressed size
+};
+
+// Size of each read while scanning
+static const size_t GZ_INPUT = 64 * 1024;
+
+std::string GzipImageSource::index_path(const std::string &file_name)
+{
+    return file_name + ".gzi";
+}
+
+//
+// Load a saved access point table, if there is one and it was made
+// from this version of the image.
+//
+static bool load_gzi(const std::string &path, const struct stat &image, uint64_t &size,
+                     std::vector<GzipImageSource::Point> &points,
+                     std::vector<uint8_t> &windows)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    GziHeader h;
+    bool ok = fread(&h, sizeof(h), 1, fp) == 1 &&
+        memcmp(h.magic, GZI_MAGIC, sizeof(h.magic)) == 0 &&
+        h.version == GZI_VERSION &&
+        h.compressed_size == (uint64_t) image.st_size &&
+        h.mtime == (int64_t) image.st_mtime &&
+        h.count > 0;
+
+    if (ok) {
+        points.resize(h.count);
+        windows.resize((size_t) h.count * GzipImageSource::WINDOW_SIZE);
+        ok = fread(points.data(), sizeof(GzipImageSource::Point), h.count, fp) == h.count &&
+            fread(windows.data(), 1, windows.size(), fp) == windows.size() &&
+            points[0].out == 0;
+        size = h.size;
+    }
+
+    fclose(fp);
+
+    return ok;
+}
+
+// Saving the table is only an optimization; failing to is not an error.
+static void save_gzi(const std::string &path, const struct stat &image, uint64_t size,
+                     const std::vector<GzipImageSource::Point> &points,
+                     const std::vector<uint8_t> &windows)
+{
+    GziHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GZI_MAGIC, sizeof(h.magic));
+    h.version = GZI_VERSION;
+    h.count = (uint32_t) points.size();
+    h.compressed_size = (uint64_t) image.st_size;
+    h.mtime = (int64_t) image.st_mtime;
+    h.size = size;
+
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+
+    if (fp == NULL) {
+        return;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+        fwrite(points.data(), sizeof(GzipImageSource::Point), points.size(), fp) == points.size() &&
+        fwrite(windows.data(), 1, windows.size(), fp) == windows.size();
+
+    if (fclose(fp) != 0 || !ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+//
+// Decompress the whole file once, noting an access point at the first
+// deflate block boundary after every SPAN bytes of output. This is the
+// approach of zlib's examples/zran.c.
+//
+static void scan_gzip(const std::string &file_name, int fd, uint64_t compressed_size,
+                      uint64_t &size,
+                      std::vector<GzipImageSource::Point> &points,
+                      std::vector<uint8_t> &windows)
+{
+    const size_t WINDOW = GzipImageSource::WINDOW_SIZE;
+    std::vector<uint8_t> input(GZ_INPUT);
+    std::vector<uint8_t> window(WINDOW);
+    uint64_t total_in = 0, total_out = 0, last = 0;
+    uint64_t file_offset = 0;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // 47 = 15-bit window, gzip header expected
+    if (inflateInit2(&strm, 47) != Z_OK) {
+        std::cerr << "Unable to start decompressing " << file_name << std::endl;
+        throw std::exception();
+    }
+
+    int ret = Z_OK;
+
+    do {
+        ssize_t n = pread(fd, input.data(), input.size(), (off_t) file_offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            inflateEnd(&strm);
+            std::cerr << file_name << " is truncated or unreadable" << std::endl;
+            throw std::exception();
+        }
+
+        file_offset += n;
+        strm.avail_in = (uInt) n;
+        strm.next_in = input.data();
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = (uInt) WINDOW;
+                strm.next_out = window.data();
+            }
+
+            total_in += strm.avail_in;
+            total_out += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            total_in -= strm.avail_in;
+            total_out -= strm.avail_out;
+
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                inflateEnd(&strm);
+                std::cerr << file_name << " is not valid gzip data" << std::endl;
+                throw std::exception();
+            }
+
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+
+            // At the end of a deflate block header, not the last one,
+            // and far enough on from the previous point.
+            if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+                (total_out == 0 || total_out - last > GzipImageSource::SPAN)) {
+                GzipImageSource::Point p;
+                p.out = total_out;
+                p.in = total_in;
+                p.bits = strm.data_type & 7;
+                p.reserved = 0;
+                points.push_back(p);
+
+                // Unroll the circular window so it ends at `total_out`.
+                size_t left = strm.avail_out;
+                size_t at = windows.size();
+                windows.resize(at + WINDOW);
+
+                if (left > 0) {
+                    memcpy(windows.data() + at, window.data() + WINDOW - left, left);
+                }
+                if (left < WINDOW) {
+                    memcpy(windows.data() + at + left, window.data(), WINDOW - left);
+                }
+
+                last = total_out;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret != Z_STREAM_END);
+
+    inflateEnd(&strm);
+
+    // A second gzip member would need a fresh header parse mid-file.
+    if (strm.avail_in > 0 || file_offset < compressed_size) {
+        std::cerr << file_name << " has more than one gzip member; recompress it as one" <<
+            std::endl;
+        throw std::exception();
+    }
+
+    size = total_out;
+}
+
+ImageSource::Ptr GzipImageSource::open(const std::string &file_name, int fd,
+                                       uint64_t compressed_size)
+{
+    std::vector<Point> points;
+    std::vector<uint8_t> windows;
+    uint64_t size = 0;
+    struct stat s;
+
+    fstat(fd, &s);
+
+    if (!load_gzi(index_path(file_name), s, size, points, windows)) {
+        points.clear();
+        windows.clear();
+
+        try {
+            scan_gzip(file_name, fd, compressed_size, size, points, windows);
+        } catch (std::exception &e) {
+            ::close(fd);
+            throw;
+        }
+
+        save_gzi(index_path(file_name), s, size, points, windows);
+    }
+
+    std::vector<uint64_t> starts;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        starts.push_back(points[i].out);
+    }
+
+    return Ptr(new GzipImageSource(file_name, fd, size, starts, points, windows));
+}
+
+GzipImageSource::GzipImageSource(const std::string &file_name, int fd, uint64_t size,
+                                 const std::vector<uint64_t> &starts,
+                                 std::vector<Point> &points, std::vector<uint8_t> &windows) :
+    ChunkedImageSource(file_name, fd, size, starts)
+{
+    points_.swap(points);
+    windows_.swap(windows);
+}
+
+void GzipImageSource::decode_chunk(size_t n, uint8_t *out, size_t len) const
+{
+    const Point &p = points_[n];
+    std::vector<uint8_t> input(GZ_INPUT);
+    uint64_t in = p.in;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // Raw deflate from here on; the gzip header is long gone.
+    if (inflateInit2(&strm, -15) != Z_OK) {
+        throw std::exception();
+    }
+
+    if (p.bits > 0) {
+        uint8_t c;
+        read_raw(p.in - 1, &c, 1);
+        inflatePrime(&strm, p.bits, c >> (8 - p.bits));
+    }
+
+    inflateSetDictionary(&strm, windows_.data() + n * WINDOW_SIZE, WINDOW_SIZE);
+
+    strm.next_out = out;
+    strm.avail_out = (uInt) len;
+
+    int ret = Z_OK;
+
+    while (strm.avail_out > 0 && ret != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            ssize_t r = pread(fd_, input.data(), input.size(), (off_t) in);
+
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (r <= 0) {
+                break;
+            }
+
+            in += r;
+            strm.next_in = input.data();
+            strm.avail_in = (uInt) r;
+        }
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+        }
+    }
+
+    inflateEnd(&strm);
+
+    if (strm.avail_out != 0) {
+        std::cerr << "Failed to decompress " << file_name_ << " at offset " <<
+            p.out << std::endl;
+        throw std::exception();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// XzImageSource
+//
+
+ImageSource::Ptr XzImageSource::open(const std::string &file_name, int fd,
+                                     uint64_t compressed_size)
+{
+    uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags flags;
+    bool ok = compressed_size >= 2 * LZMA_STREAM_HEADER_SIZE &&
+        pread(fd, footer, sizeof(footer), (off_t) (compressed_size - sizeof(footer))) ==
+            (ssize_t) sizeof(footer) &&
+        lzma_stream_footer_decode(&flags, footer) == LZMA_OK;
+
+    lzma_index *index = NULL;
+
+    if (ok) {
+        std::vector<uint8_t> raw((size_t) flags.backward_size);
+        uint64_t index_offset = compressed_size - sizeof(footer) - flags.backward_size;
+        uint64_t memlimit = UINT64_MAX;
+        size_t pos = 0;
+
+        ok = flags.backward_size <= compressed_size - 2 * LZMA_STREAM_HEADER_SIZE &&
+            pread(fd, raw.data(), raw.size(), (off_t) index_offset) == (ssize_t) raw.size() &&
+            lzma_index_buffer_decode(&index, &memlimit, NULL, raw.data(), &pos,
+                                     raw.size()) == LZMA_OK;
+
+        // Only a lone stream has its index at the very end of the file.
+        ok = ok && lzma_index_stream_size(index) == compressed_size;
+    }
+
+    if (!ok) {
+        if (index != NULL) {
+            lzma_index_end(index, NULL);
+        }
+        ::close(fd);
+        std::cerr << file_name << " is not a single-stream xz file" << std::endl;
+        throw std::exception();
+    }
+
+    std::vector<uint64_t> starts;
+    std::vector<Block> blocks;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        Block b;
+        b.offset = iter.block.compressed_file_offset;
+        b.total_size = iter.block.total_size;
+        blocks.push_back(b);
+        starts.push_back(iter.block.uncompressed_file_offset);
+    }
+
+    uint64_t size = lzma_index_uncompressed_size(index);
+    lzma_index_end(index, NULL);
+
+    if (blocks.empty()) {
+        ::close(fd);
+        std::cerr << file_name << " is empty" << std::endl;
+        throw std::exception();
+    }
+
+    return Ptr(new XzImageSource(file_name, fd, size, starts, blocks, flags.check));
+}
+
+XzImageSource::XzImageSource(const std::string &file_name, int fd, uint64_t size,
+                             const std::vector<uint64_t> &starts, std::vector<Block> &blocks,
+                             uint32_t check) :
+    ChunkedImageSource(file_name, fd, size, starts),
+    check_(check)
+{
+    blocks_.swap(blocks);
+}
+
+void XzImageSource::decode_chunk(size_t n, uint8_t *out, size_t len) const
+{
+    const Block &b = blocks_[n];
+    std::vector<uint8_t> raw((size_t) b.total_size);
+
+    read_raw(b.offset, raw.data(), raw.size());
+
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    memset(&block, 0, sizeof(block));
+    block.version = 1;
+    block.check = (lzma_check) check_;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(raw[0]);
+
+    if (block.header_size > raw.size() ||
+        lzma_block_header_decode(&block, NULL, raw.data()) != LZMA_OK) {
+        std::cerr << "Bad xz block header in " << file_name_ << std::endl;
+        throw std::exception();
+    }
+
+    size_t in_pos = block.header_size;
+    size_t out_pos = 0;
+    lzma_ret ret = lzma_block_buffer_decode(&block, NULL, raw.data(), &in_pos, raw.size(),
+                                            out, &out_pos, len);
+
+    lzma_filters_free(filters, NULL);
+
+    if (ret != LZMA_OK || out_pos != len) {
+        std::cerr << "Failed to decompress " << file_name_ << " at offset " <<
+            b.offset << std::endl;
+        throw std::exception();
+    }
+}
+
+}; // namespace
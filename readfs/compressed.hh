@@ -0,0 +1,119 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "image.hh"
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// An image stored compressed, read through an index of independently
+// decodable chunks. Only the chunks a read touches are decompressed,
+// and recently used ones are kept around, so scattered block reads
+// don't keep decompressing the same data.
+//
+class ChunkedImageSource : public ImageSource {
+public:
+    // Decompressed chunks kept in memory
+    const static size_t CHUNK_CACHE = 16;
+
+    bool mapped() const;
+    void read(uint64_t offset, void *buf, size_t len) const;
+    int raw_fd() const;
+    void print_stats() const;
+
+protected:
+    ChunkedImageSource(const std::string &file_name, int fd, uint64_t size,
+                       const std::vector<uint64_t> &chunk_starts);
+
+    // Decompress chunk `n`, which must come out exactly chunk_size(n)
+    // bytes long.
+    virtual void decode_chunk(size_t n, uint8_t *out, size_t len) const = 0;
+
+    uint64_t chunk_size(size_t n) const;
+
+    // Read raw compressed bytes. Throws on a short read.
+    void read_raw(uint64_t offset, void *buf, size_t len) const;
+
+private:
+    typedef std::shared_ptr<std::vector<uint8_t> > Buffer;
+
+    Buffer chunk(size_t n) const;
+
+    // Uncompressed offset of the start of each chunk; the first is 0.
+    const std::vector<uint64_t> starts_;
+
+    mutable std::mutex lock_;
+    mutable std::unordered_map<size_t, Buffer> chunks_;
+    mutable std::list<size_t> lru_;     // Most recently used at the front
+    mutable uint64_t decoded_;
+};
+
+//
+// A gzip file, made seekable with a table of access points taken every
+// SPAN bytes of output on a deflate block boundary, each with the 32K
+// window needed to restart decompression there. The table costs one
+// pass over the whole file to build, so it is saved next to the image
+// as "<image>.gzi" and reused while the image is unchanged.
+//
+class GzipImageSource : public ChunkedImageSource {
+public:
+    const static uint64_t SPAN = 1024 * 1024;
+    const static size_t WINDOW_SIZE = 32768;
+
+    struct Point {
+        uint64_t out;           // Uncompressed offset
+        uint64_t in;            // Compressed offset of the first full byte
+        uint32_t bits;          // Bits of the byte before `in` to use, 0-7
+        uint32_t reserved;
+    };
+
+    static Ptr open(const std::string &file_name, int fd, uint64_t compressed_size);
+
+    static std::string index_path(const std::string &file_name);
+
+private:
+    GzipImageSource(const std::string &file_name, int fd, uint64_t size,
+                    const std::vector<uint64_t> &starts,
+                    std::vector<Point> &points, std::vector<uint8_t> &windows);
+
+    void decode_chunk(size_t n, uint8_t *out, size_t len) const;
+
+    std::vector<Point> points_;
+    std::vector<uint8_t> windows_;      // WINDOW_SIZE per point
+};
+
+//
+// An xz file, read a block at a time through the stream's own index.
+// Only multi-block files (made with e.g. "xz -T0" or "--block-size")
+// can be read randomly; a single-block file has to be decompressed
+// from the start for every chunk the cache doesn't hold.
+//
+class XzImageSource : public ChunkedImageSource {
+public:
+    struct Block {
+        uint64_t offset;        // Compressed offset of the block header
+        uint64_t total_size;    // Compressed size, header and padding included
+    };
+
+    static Ptr open(const std::string &file_name, int fd, uint64_t compressed_size);
+
+private:
+    XzImageSource(const std::string &file_name, int fd, uint64_t size,
+                  const std::vector<uint64_t> &starts, std::vector<Block> &blocks,
+                  uint32_t check);
+
+    void decode_chunk(size_t n, uint8_t *out, size_t len) const;
+
+    std::vector<Block> blocks_;
+    const uint32_t check_;      // The stream's lzma_check
+};
+
+}; // namespace
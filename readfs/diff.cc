@@ -0,0 +1,265 @@
+#include "diff.hh"
+
+namespace loomcom {
+
+Differ::Differ(FileLoader &a, FileLoader &b) :
+    a_(a),
+    b_(b),
+    table_a_(nullptr),
+    table_b_(nullptr),
+    out_(nullptr),
+    inodes_compared_(0),
+    inodes_changed_(0),
+    dirs_compared_(0),
+    blocks_compared_(0),
+    differences_(0)
+{
+}
+
+const uint64_t Differ::run(std::ostream &out)
+{
+    // Blocks and block addresses are only comparable at the same size.
+    if (a_.block_size() != b_.block_size()) {
+        std::cerr << "Unable to compare filesystems of " << a_.block_size() <<
+            "- and " << b_.block_size() << "-byte blocks" << std::endl;
+        throw std::exception();
+    }
+
+    out_ = &out;
+    table_a_ = &a_.load_inode_table();
+    table_b_ = &b_.load_inode_table();
+
+    uint32_t count = std::max(table_a_->count, table_b_->count);
+
+    for (uint32_t i = 1; i <= count; i++) {
+        if (!same_inode(i, i)) {
+            inodes_changed_++;
+        }
+    }
+
+    inodes_compared_ = count;
+
+    // With every inode the same, there is nothing to walk into.
+    if (inodes_changed_ > 0) {
+        diff_entry("", *a_.root(), FileLoader::ROOT_INODE, b_.root());
+    }
+
+    return differences_;
+}
+
+//
+// True if inode `inum_a` of the first image and `inum_b` of the second
+// match in everything but their access times. An inode past the end of
+// an i-list compares as an unused one.
+//
+const bool Differ::same_inode(uint32_t inum_a, uint32_t inum_b) const
+{
+    const InodeTable &ta = *table_a_;
+    const InodeTable &tb = *table_b_;
+    bool in_a = inum_a <= ta.count;
+    bool in_b = inum_b <= tb.count;
+
+    if (!in_a || !in_b) {
+        return (!in_a || ta.mode[inum_a] == 0) && (!in_b || tb.mode[inum_b] == 0);
+    }
+
+    return ta.mode[inum_a] == tb.mode[inum_b] &&
+        ta.nlink[inum_a] == tb.nlink[inum_b] &&
+        ta.uid[inum_a] == tb.uid[inum_b] &&
+        ta.gid[inum_a] == tb.gid[inum_b] &&
+        ta.size[inum_a] == tb.size[inum_b] &&
+        ta.mtime[inum_a] == tb.mtime[inum_b] &&
+        ta.ctime[inum_a] == tb.ctime[inum_b] &&
+        memcmp(ta.addrs(inum_a), tb.addrs(inum_b),
+               InodeTable::ADDRS_PER_INODE * sizeof(uint32_t)) == 0;
+}
+
+const int Differ::file_type_b(uint32_t inum) const
+{
+    return inum <= table_b_->count ? (0xf000 & table_b_->mode[inum]) >> 12 : 0;
+}
+
+//
+// Compare the data of two regular files block by block, reading only
+// until the first difference.
+//
+const bool Differ::data_differs(uint32_t inum_a, uint32_t inum_b)
+{
+    uint32_t size = table_a_->size[inum_a];
+
+    if (size != table_b_->size[inum_b]) {
+        return true;
+    }
+
+    std::vector<uint32_t> blocks_a = a_.block_list(table_a_->addrs(inum_a), size);
+    std::vector<uint32_t> blocks_b = b_.block_list(table_b_->addrs(inum_b), size);
+    uint32_t block_size = a_.block_size();
+    std::vector<uint8_t> zero(block_size, 0);
+
+    for (size_t i = 0; i < blocks_a.size(); i++) {
+        uint32_t len = std::min<uint64_t>(block_size, size - (uint64_t) i * block_size);
+
+        blocks_compared_++;
+
+        // Holes read as zeroes.
+        BlockCache::Block block_a;
+        BlockCache::Block block_b;
+        const uint8_t *pa = zero.data();
+        const uint8_t *pb = zero.data();
+
+        if (blocks_a[i] != 0) {
+            block_a = a_.block(blocks_a[i]);
+            pa = block_a.get();
+        }
+
+        if (blocks_b[i] != 0) {
+            block_b = b_.block(blocks_b[i]);
+            pb = block_b.get();
+        }
+
+        if (memcmp(pa, pb, len) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Compare two directories with the same path. If `dir_b` is null, the
+// directory's inode is the same in both images, so its entries are
+// too, and only the first image's copy is read.
+//
+const void Differ::diff_dir(const std::string &path, const FileEntry &dir_a,
+                            const FileEntry *dir_b)
+{
+    dirs_compared_++;
+
+    const FileEntry::List &entries_a = dir_a.dir_entries();
+
+    if (dir_b == nullptr) {
+        for (size_t i = 0; i < entries_a.size(); i++) {
+            const FileEntry &a = *entries_a[i];
+            diff_entry(path + "/" + std::string(a.name), a, a.inode_num, nullptr);
+        }
+
+        return;
+    }
+
+    const FileEntry::List &entries_b = dir_b->dir_entries();
+    std::unordered_map<std::string_view, FileEntry::Ptr> by_name;
+
+    for (size_t i = 0; i < entries_b.size(); i++) {
+        by_name[entries_b[i]->name] = entries_b[i];
+    }
+
+    for (size_t i = 0; i < entries_a.size(); i++) {
+        const FileEntry &a = *entries_a[i];
+        std::string child = path + "/" + std::string(a.name);
+        std::unordered_map<std::string_view, FileEntry::Ptr>::iterator it = by_name.find(a.name);
+
+        if (it == by_name.end()) {
+            report('D', child);
+            continue;
+        }
+
+        diff_entry(child, a, it->second->inode_num, it->second);
+        by_name.erase(it);
+    }
+
+    // Whatever is left is only in the second image. Report it in the
+    // directory's own order.
+    for (size_t i = 0; i < entries_b.size(); i++) {
+        if (by_name.count(entries_b[i]->name) > 0) {
+            report('A', path + "/" + std::string(entries_b[i]->name));
+        }
+    }
+}
+
+//
+// Compare file `a` of the first image with inode `inum_b` of the
+// second, found under the same path. `b` is its entry, if the caller
+// has it to hand.
+//
+const void Differ::diff_entry(const std::string &path, const FileEntry &a, uint32_t inum_b,
+                              const FileEntry *b)
+{
+    if (a.inode_num == inum_b && same_inode(inum_b, inum_b)) {
+        if (a.is_dir) {
+            diff_dir(path, a, nullptr);
+        }
+        return;
+    }
+
+    if (a.file_type != file_type_b(inum_b)) {
+        report('T', path);
+        return;
+    }
+
+    if (!a.is_dir) {
+        diff_file(path, a.inode_num, inum_b);
+        return;
+    }
+
+    // Only the path to a changed directory is read in the second image.
+    if (b == nullptr) {
+        b = b_.lookup(path);
+    }
+
+    if (b == nullptr || !b->is_dir) {
+        report('T', path);
+        return;
+    }
+
+    diff_dir(path, a, b);
+}
+
+const void Differ::diff_file(const std::string &path, uint32_t inum_a, uint32_t inum_b)
+{
+    uint64_t key = (uint64_t) inum_a << 32 | inum_b;
+    std::unordered_map<uint64_t, bool>::iterator it = compared_.find(key);
+    bool differs;
+
+    if (it != compared_.end()) {
+        differs = it->second;
+    } else if (FileEntry::FT_REG == file_type_b(inum_b)) {
+        try {
+            differs = data_differs(inum_a, inum_b);
+        } catch (std::exception &e) {
+            // Already reported; a file that can't be read has changed.
+            differs = true;
+        }
+        compared_[key] = differs;
+    } else {
+        // Devices keep their numbers in di_addr, and FIFOs hold nothing.
+        differs = table_a_->size[inum_a] != table_b_->size[inum_b] ||
+            memcmp(table_a_->addrs(inum_a), table_b_->addrs(inum_b),
+                   InodeTable::ADDRS_PER_INODE * sizeof(uint32_t)) != 0;
+        compared_[key] = differs;
+    }
+
+    if (differs) {
+        report('M', path);
+    } else if (!same_inode(inum_a, inum_b)) {
+        report('m', path);
+    }
+}
+
+const void Differ::report(char code, const std::string &path)
+{
+    *out_ << code << " " << (path.empty() ? "/" : path) << "\n";
+    differences_++;
+}
+
+const void Differ::print_stats() const
+{
+    std::cout << "DIFFERENCES" << std::endl;
+    std::cout << "-----------" << std::endl;
+    std::cout << "  Inodes compared: " << std::dec << inodes_compared_ << std::endl;
+    std::cout << "  Inodes changed: " << inodes_changed_ << std::endl;
+    std::cout << "  Directories compared: " << dirs_compared_ << std::endl;
+    std::cout << "  File blocks compared: " << blocks_compared_ << std::endl;
+    std::cout << "  Differences: " << differences_ << std::endl;
+}
+
+}; // namespace
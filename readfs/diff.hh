@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include "imgread.hh"
+
+namespace loomcom {
+
+//
+// What changed between two filesystems, typically two snapshots of the
+// same disk.
+//
+// The i-lists are compared first, inode by inode. Only where an inode
+// differs does any more work happen: a changed directory has its
+// entries matched up by name, and a changed regular file has its
+// blocks compared. Directories whose inodes are the same in both are
+// taken to hold the same entries, so the second image's tree is only
+// read along paths that lead to a change. Access times are ignored,
+// since merely reading a file changes them.
+//
+// Each difference is printed as one line, as a code and a path:
+//
+//   A  added                 D  deleted
+//   M  contents changed      m  only the inode's metadata changed
+//   T  replaced by a different type of file
+//
+// An added or deleted directory is one difference, not one per file
+// inside it.
+//
+class Differ {
+public:
+    Differ(FileLoader &a, FileLoader &b);
+
+    // Returns the number of differences printed. Both filesystems must
+    // have the same block size; throws if they don't.
+    const uint64_t run(std::ostream &out);
+
+    const void print_stats() const;
+
+private:
+    const bool same_inode(uint32_t inum_a, uint32_t inum_b) const;
+    const int file_type_b(uint32_t inum) const;
+    const bool data_differs(uint32_t inum_a, uint32_t inum_b);
+    const void diff_dir(const std::string &path, const FileEntry &dir_a,
+                        const FileEntry *dir_b);
+    const void diff_entry(const std::string &path, const FileEntry &a, uint32_t inum_b,
+                          const FileEntry *b);
+    const void diff_file(const std::string &path, uint32_t inum_a, uint32_t inum_b);
+    const void report(char code, const std::string &path);
+
+    FileLoader &a_;
+    FileLoader &b_;
+    const InodeTable *table_a_;
+    const InodeTable *table_b_;
+    std::ostream *out_;
+
+    // Files already compared, as inode number in a and in b, so hard
+    // links are only compared once
+    std::unordered_map<uint64_t, bool> compared_;
+
+    uint64_t inodes_compared_;
+    uint64_t inodes_changed_;
+    uint64_t dirs_compared_;
+    uint64_t blocks_compared_;
+    uint64_t differences_;
+};
+
+}; // namespace
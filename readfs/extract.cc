@@ -0,0 +1,471 @@
+#include "extract.hh"
+
+#include <iterator>
+#include <map>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+namespace loomcom {
+
+Extractor::Extractor(FileLoader &loader, const std::string &out_dir, unsigned threads) :
+    loader_(loader),
+    out_dir_(out_dir),
+    threads_(threads > 0 ? threads : 1),
+    files_(0),
+    bytes_(0),
+    extents_(0),
+    failures_(0),
+    skipped_(0),
+    reads_(nullptr)
+{
+}
+
+const int Extractor::run()
+{
+    if (mkdir(out_dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+        std::cerr << "Unable to create " << out_dir_ << ": " <<
+            strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 0; i < threads_; i++) {
+        workers.push_back(std::thread(&Extractor::worker, this));
+    }
+
+    // First name seen for each inode with more than one link
+    std::map<uint32_t, std::string> linked;
+
+    // The workers are already running, so however the walk ends, they
+    // have to be told it's over and waited for.
+    try {
+        failures_ += loader_.walk([&](const std::string &path, const FileEntry::Ptr &f) {
+            std::string out_path = out_dir_ + path;
+
+            if (f->is_dir) {
+                if (mkdir(out_path.c_str(), 0755) < 0 && errno != EEXIST) {
+                    std::cerr << "Unable to create " << out_path << ": " <<
+                        strerror(errno) << std::endl;
+                    failures_++;
+                }
+                dirs_.push_back(std::make_pair(out_path, f));
+                return;
+            }
+
+            if (f->file_type != FileEntry::FT_REG) {
+                // Device nodes and FIFOs aren't recreated.
+                skipped_++;
+                return;
+            }
+
+            if (f->inode.di_nlink > 1) {
+                std::map<uint32_t, std::string>::iterator it = linked.find(f->inode_num);
+
+                if (it != linked.end()) {
+                    links_.push_back(std::make_pair(out_path, it->second));
+                    return;
+                }
+
+                linked[f->inode_num] = out_path;
+            }
+
+            Item item;
+            item.entry = f;
+            item.path = out_path;
+            queue_.push(item);
+        });
+    } catch (std::exception &e) {
+        std::cerr << "Unable to finish walking the filesystem" << std::endl;
+        failures_++;
+    }
+
+    queue_.close();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    for (size_t i = 0; i < links_.size(); i++) {
+        if (link(links_[i].second.c_str(), links_[i].first.c_str()) < 0) {
+            std::cerr << "Unable to link " << links_[i].first << ": " <<
+                strerror(errno) << std::endl;
+            failures_++;
+        }
+    }
+
+    // Deepest directories come last in walk order. Finish those first,
+    // so setting a parent's times isn't undone by work on a child.
+    for (size_t i = dirs_.size(); i > 0; i--) {
+        const std::string &path = dirs_[i - 1].first;
+        const FileEntry::Ptr &f = dirs_[i - 1].second;
+
+        chmod(path.c_str(), f->mode & 0777);
+        set_times(path, f->inode);
+    }
+
+    return (int) failures_;
+}
+
+void Extractor::worker()
+{
+    std::vector<uint8_t> buf(WRITE_CHUNK);
+    const FileLoader::Options &options = loader_.options();
+    int fd = loader_.image()->raw_fd();
+
+    if (options.io_depth > 0 && fd >= 0) {
+        // Declared ahead of the reader, so that no read can still be
+        // landing in it once it's freed.
+        std::vector<uint8_t> space((size_t) options.io_depth * READ_CHUNK);
+        AsyncReader::Ptr reader = AsyncReader::open(fd, options.io_depth, options.io_uring);
+
+        reads_ = reader->name();
+
+        try {
+            async_worker(*reader, space);
+            return;
+        } catch (std::exception &e) {
+            std::cerr << "Asynchronous reads failed; carrying on without them." << std::endl;
+        }
+    }
+
+    Item item;
+
+    while (queue_.pop(item)) {
+        try {
+            copy_file(item, buf);
+        } catch (std::exception &e) {
+            std::cerr << "Failed to extract " << item.path << std::endl;
+            failures_++;
+        }
+    }
+}
+
+//
+// Copy files with `reader`, one READ_CHUNK piece of `space` per read.
+// Reads for the next file go out while the last ones for the file
+// before are still arriving, so small files don't drain the queue.
+//
+void Extractor::async_worker(AsyncReader &reader, std::vector<uint8_t> &space)
+{
+    struct Chunk {
+        TransferRef t;
+        uint64_t pos;           // Where the data goes in the file
+        size_t len;
+    };
+
+    std::vector<Chunk> chunks(reader.depth());
+    std::vector<unsigned> free_chunks;
+    std::vector<AsyncReader::Completion> done;
+    std::list<Transfer> transfers;
+    TransferRef current = transfers.end();
+    bool drained = false;
+
+    for (unsigned i = reader.depth(); i > 0; i--) {
+        free_chunks.push_back(i - 1);
+    }
+
+    try {
+        for (;;) {
+            while (!free_chunks.empty() && !drained) {
+                if (current == transfers.end()) {
+                    Item item;
+
+                    // Only wait for more work when there's nothing to reap.
+                    if (reader.in_flight() > 0) {
+                        if (!queue_.try_pop(item)) {
+                            break;
+                        }
+                    } else if (!queue_.pop(item)) {
+                        drained = true;
+                        break;
+                    }
+
+                    current = transfers.insert(transfers.end(), Transfer());
+
+                    if (!start_transfer(item, *current)) {
+                        transfers.erase(current);
+                        current = transfers.end();
+                    }
+                    continue;
+                }
+
+                uint64_t pos, offset;
+                size_t len;
+
+                if (!next_read(*current, pos, offset, len)) {
+                    // Everything has been asked for.
+                    if (current->outstanding == 0) {
+                        finish_transfer(*current);
+                        transfers.erase(current);
+                    }
+                    current = transfers.end();
+                    continue;
+                }
+
+                unsigned c = free_chunks.back();
+                free_chunks.pop_back();
+
+                chunks[c].t = current;
+                chunks[c].pos = pos;
+                chunks[c].len = len;
+
+                AsyncReader::Request req = { offset, space.data() + (size_t) c * READ_CHUNK, len, c };
+                reader.submit(req);
+                current->outstanding++;
+            }
+
+            if (reader.in_flight() == 0) {
+                if (drained) {
+                    break;
+                }
+                continue;
+            }
+
+            done.clear();
+            reader.reap(done);
+
+            for (size_t i = 0; i < done.size(); i++) {
+                unsigned c = (unsigned) done[i].tag;
+                Chunk &chunk = chunks[c];
+                Transfer &t = *chunk.t;
+                const uint8_t *p = space.data() + (size_t) c * READ_CHUNK;
+
+                if (done[i].result < 0 && !t.failed) {
+                    std::cerr << "Failed to extract " << t.item.path << ": " <<
+                        strerror((int) -done[i].result) << std::endl;
+                    t.failed = true;
+                }
+
+                for (size_t off = 0; !t.failed && off < chunk.len; ) {
+                    ssize_t w = pwrite(t.fd, p + off, chunk.len - off, (off_t) (chunk.pos + off));
+
+                    if (w < 0 && errno == EINTR) {
+                        continue;
+                    }
+
+                    if (w < 0) {
+                        std::cerr << "Write to " << t.item.path << " failed: " <<
+                            strerror(errno) << std::endl;
+                        t.failed = true;
+                        break;
+                    }
+
+                    off += w;
+                }
+
+                t.outstanding--;
+                free_chunks.push_back(c);
+
+                if (t.outstanding == 0 && chunk.t != current) {
+                    finish_transfer(t);
+                    transfers.erase(chunk.t);
+                }
+            }
+        }
+    } catch (std::exception &e) {
+        // The reader's destructor waits out whatever is in flight.
+        for (TransferRef it = transfers.begin(); it != transfers.end(); it++) {
+            it->failed = true;
+            finish_transfer(*it);
+        }
+        throw;
+    }
+}
+
+bool Extractor::start_transfer(const Item &item, Transfer &t)
+{
+    t.item = item;
+    t.extent = 0;
+    t.pos = 0;
+    t.outstanding = 0;
+    t.failed = false;
+
+    t.fd = open(item.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (t.fd < 0) {
+        std::cerr << "Unable to create " << item.path << ": " <<
+            strerror(errno) << std::endl;
+        failures_++;
+        return false;
+    }
+
+    try {
+        t.extents = loader_.extents(*item.entry);
+    } catch (std::exception &e) {
+        std::cerr << "Failed to extract " << item.path << std::endl;
+        close(t.fd);
+        failures_++;
+        return false;
+    }
+
+    return true;
+}
+
+//
+// The next piece of a file to read: where it goes in the file, where
+// it comes from in the image, and how long it is. Holes are skipped;
+// they come out of the ftruncate() in finish_transfer() as zeroes.
+//
+bool Extractor::next_read(Transfer &t, uint64_t &pos, uint64_t &offset, size_t &len)
+{
+    uint32_t block_size = loader_.block_size();
+    uint64_t size = t.item.entry->inode.di_size;
+
+    while (!t.failed && t.extent < t.extents.size()) {
+        const Extent &e = t.extents[t.extent];
+        uint64_t start = (uint64_t) e.file_block * block_size;
+        uint64_t end = std::min<uint64_t>(start + (uint64_t) e.count * block_size, size);
+
+        if (t.pos < start) {
+            t.pos = start;
+        }
+
+        if (e.addr == 0 || t.pos >= end) {
+            t.extent++;
+            continue;
+        }
+
+        pos = t.pos;
+        offset = loader_.base() + (uint64_t) e.addr * block_size + (t.pos - start);
+        len = (size_t) std::min<uint64_t>((uint64_t) READ_CHUNK, end - t.pos);
+
+        t.pos += len;
+        return true;
+    }
+
+    return false;
+}
+
+void Extractor::finish_transfer(Transfer &t)
+{
+    const struct dinode &inode = t.item.entry->inode;
+
+    if (!t.failed && ftruncate(t.fd, inode.di_size) < 0) {
+        std::cerr << "Unable to size " << t.item.path << ": " <<
+            strerror(errno) << std::endl;
+        t.failed = true;
+    }
+
+    if (t.failed) {
+        close(t.fd);
+        failures_++;
+        return;
+    }
+
+    fchmod(t.fd, t.item.entry->mode & 0777);
+    close(t.fd);
+
+    set_times(t.item.path, inode);
+
+    files_++;
+    bytes_ += inode.di_size;
+    extents_ += t.extents.size();
+}
+
+void Extractor::copy_file(const Item &item, std::vector<uint8_t> &buf)
+{
+    const struct dinode &inode = item.entry->inode;
+
+    int fd = open(item.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0) {
+        std::cerr << "Unable to create " << item.path << ": " <<
+            strerror(errno) << std::endl;
+        failures_++;
+        return;
+    }
+
+    std::vector<Extent> extents;
+    uint64_t offset = 0;
+
+    try {
+        extents = loader_.extents(*item.entry);
+    } catch (std::exception &e) {
+        close(fd);
+        throw;
+    }
+
+    while (offset < inode.di_size) {
+        size_t n;
+
+        try {
+            n = loader_.read_data(inode, extents, offset, buf.data(), buf.size());
+        } catch (std::exception &e) {
+            close(fd);
+            throw;
+        }
+
+        const uint8_t *p = buf.data();
+        size_t left = n;
+
+        while (left > 0) {
+            ssize_t w = write(fd, p, left);
+
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (w < 0) {
+                std::cerr << "Write to " << item.path << " failed: " <<
+                    strerror(errno) << std::endl;
+                close(fd);
+                failures_++;
+                return;
+            }
+
+            p += w;
+            left -= w;
+        }
+
+        offset += n;
+    }
+
+    fchmod(fd, item.entry->mode & 0777);
+    close(fd);
+
+    set_times(item.path, inode);
+
+    files_++;
+    bytes_ += inode.di_size;
+    extents_ += extents.size();
+}
+
+void Extractor::set_times(const std::string &path, const struct dinode &inode)
+{
+    struct timeval times[2];
+
+    times[0].tv_sec = inode.di_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = inode.di_mtime;
+    times[1].tv_usec = 0;
+
+    utimes(path.c_str(), times);
+}
+
+const void Extractor::print_stats() const
+{
+    std::cout << "EXTRACTION" << std::endl;
+    std::cout << "----------" << std::endl;
+    std::cout << "  Worker threads: " << std::dec << threads_ << std::endl;
+    std::cout << "  Reads: ";
+
+    if (reads_ != nullptr) {
+        std::cout << reads_.load() << ", queue depth " << loader_.options().io_depth << std::endl;
+    } else {
+        std::cout << "synchronous" << std::endl;
+    }
+
+    std::cout << "  Directories: " << dirs_.size() << std::endl;
+    std::cout << "  Files: " << files_ << std::endl;
+    std::cout << "  Extra links: " << links_.size() << std::endl;
+    std::cout << "  Bytes: " << bytes_ << std::endl;
+    std::cout << "  Extents: " << extents_ << std::endl;
+    std::cout << "  Skipped (devices/FIFOs): " << skipped_ << std::endl;
+    std::cout << "  Failures: " << failures_ << std::endl;
+}
+
+}; // namespace
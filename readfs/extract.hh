@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aio.hh"
+#include "imgread.hh"
+#include "workqueue.hh"
+
+namespace loomcom {
+
+//
+// Rebuild the tree of a SysV filesystem under a host directory.
+//
+// The directory walk runs on the calling thread, creating directories
+// as it goes and queueing every regular file. A pool of worker threads
+// drains the queue, copying file data out through large writes.
+//
+// Where the image can be read directly, each worker instead keeps up
+// to the loader's io_depth reads of file extents in flight, across as
+// many files as it takes, and writes each piece out as it arrives.
+//
+class Extractor {
+public:
+    // Size of the buffer each worker fills before writing it out
+    const static size_t WRITE_CHUNK = 1024 * 1024;
+
+    // Size of each asynchronous read
+    const static size_t READ_CHUNK = 256 * 1024;
+
+    Extractor(FileLoader &loader, const std::string &out_dir, unsigned threads);
+
+    // Returns the number of files that could not be extracted.
+    const int run();
+
+    const void print_stats() const;
+
+private:
+    struct Item {
+        FileEntry::Ptr entry;
+        std::string path;
+    };
+
+    // A file being copied by the asynchronous worker
+    struct Transfer {
+        Item item;
+        int fd;
+        std::vector<Extent> extents;
+        size_t extent;          // Extent the next read comes from
+        uint64_t pos;           // File offset of the next read
+        unsigned outstanding;   // Reads in flight
+        bool failed;
+    };
+
+    typedef std::list<Transfer>::iterator TransferRef;
+
+    void worker();
+    void async_worker(AsyncReader &reader, std::vector<uint8_t> &space);
+    void copy_file(const Item &item, std::vector<uint8_t> &buf);
+    bool start_transfer(const Item &item, Transfer &t);
+    bool next_read(Transfer &t, uint64_t &pos, uint64_t &offset, size_t &len);
+    void finish_transfer(Transfer &t);
+    void set_times(const std::string &path, const struct dinode &inode);
+
+    FileLoader &loader_;
+    const std::string out_dir_;
+    const unsigned threads_;
+
+    WorkQueue<Item> queue_;
+
+    // Directories, in the order they were created, so their modes and
+    // times can be set once their contents are in place.
+    std::vector<std::pair<std::string, FileEntry::Ptr> > dirs_;
+    // Extra names for multiply-linked files, as (new path, first path)
+    std::vector<std::pair<std::string, std::string> > links_;
+
+    std::atomic<uint64_t> files_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> extents_;
+    std::atomic<uint64_t> failures_;
+    uint64_t skipped_;
+
+    // How the workers read, for print_stats()
+    std::atomic<const char *> reads_;
+};
+
+}; // namespace
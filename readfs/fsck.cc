@@ -0,0 +1,435 @@
+#include "fsck.hh"
+
+#include <map>
+#include <sstream>
+#include <thread>
+
+namespace loomcom {
+
+static void add_problem(std::vector<Checker::Problem> &problems, uint32_t inum,
+                        const std::string &what)
+{
+    Checker::Problem p;
+    p.inum = inum;
+    p.what = what;
+    problems.push_back(p);
+}
+
+Checker::Checker(FileLoader &loader, unsigned threads) :
+    loader_(loader),
+    threads_(threads > 0 ? threads : 1),
+    table_(nullptr),
+    isize_(0),
+    fsize_(0),
+    next_inode_(1),
+    inodes_checked_(0),
+    blocks_claimed_(0),
+    dir_entries_(0),
+    free_claimed_(0),
+    lost_blocks_(0)
+{
+}
+
+const uint64_t Checker::run()
+{
+    start(threads_);
+
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 0; i < threads_; i++) {
+        workers.push_back(std::thread(&Checker::worker, this, i));
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    uint64_t problems = finish();
+    print_problems();
+
+    return problems;
+}
+
+const void Checker::start(unsigned slots)
+{
+    loader_.load_allocation_map();
+    table_ = &loader_.load_inode_table();
+    isize_ = loader_.superblock().s_isize;
+    fsize_ = loader_.superblock().s_fsize;
+
+    parts_.clear();
+    parts_.resize(slots > 0 ? slots : 1);
+}
+
+const uint64_t Checker::finish()
+{
+    const AllocationMap &map = loader_.load_allocation_map();
+
+    // Merge what the workers found. A block owned by two workers is
+    // shared just as much as one claimed twice by the same worker.
+    Bitmap owned(fsize_), shared(fsize_), scratch(fsize_);
+    std::vector<uint32_t> refs(table_->count + 1, 0);
+
+    for (size_t i = 0; i < parts_.size(); i++) {
+        if (!parts_[i]) {
+            continue;
+        }
+
+        Partial &part = *parts_[i];
+
+        owned.merge(part.owned, shared);
+        shared.merge(part.shared, scratch);
+
+        for (size_t j = 0; j < refs.size(); j++) {
+            refs[j] += part.refs[j];
+        }
+
+        problems_.insert(problems_.end(), part.problems.begin(), part.problems.end());
+        inodes_checked_ += part.inodes;
+        dir_entries_ += part.entries;
+    }
+
+    parts_.clear();
+
+    blocks_claimed_ = owned.count();
+
+    // Link counts
+    for (uint32_t i = 1; i <= table_->count; i++) {
+        std::ostringstream what;
+
+        if (table_->mode[i] == 0) {
+            if (refs[i] > 0) {
+                what << "free inode named by " << refs[i] << " directory entries";
+                add_problem(problems_, i, what.str());
+            }
+        } else if (refs[i] != table_->nlink[i] && i >= FileLoader::ROOT_INODE) {
+            what << "link count " << table_->nlink[i] << ", but " << refs[i] <<
+                " directory entries";
+            add_problem(problems_, i, what.str());
+        }
+    }
+
+    // Blocks against the free list
+    for (size_t b = owned.find_set(0); b != Bitmap::NPOS; b = owned.find_set(b + 1)) {
+        if (!map.blocks.test(b)) {
+            std::ostringstream what;
+            what << "block " << b << " is in use and on the free list";
+            add_problem(problems_, 0, what.str());
+            free_claimed_++;
+        }
+    }
+
+    for (size_t b = isize_; b < fsize_; b++) {
+        if (map.blocks.test(b) && !owned.test(b)) {
+            lost_blocks_++;
+        }
+    }
+
+    if (lost_blocks_ > 0) {
+        std::ostringstream what;
+        what << lost_blocks_ << " blocks are neither in use nor free";
+        add_problem(problems_, 0, what.str());
+    }
+
+    if (shared.count() > 0) {
+        find_shared_owners(shared);
+    }
+
+    // The free list itself, and the superblock's totals
+    if (map.bad_free > 0 || map.duplicate_free > 0 || map.chain_truncated) {
+        std::ostringstream what;
+        what << "free list is damaged: " << map.bad_free << " bad and " <<
+            map.duplicate_free << " duplicate entries" <<
+            (map.chain_truncated ? ", chain cut short" : "");
+        add_problem(problems_, 0, what.str());
+    }
+
+    if (map.free_blocks != loader_.superblock().s_tfree) {
+        std::ostringstream what;
+        what << "superblock says " << loader_.superblock().s_tfree <<
+            " free blocks, free list has " << map.free_blocks;
+        add_problem(problems_, 0, what.str());
+    }
+
+    if (map.free_inodes != loader_.superblock().s_tinode) {
+        std::ostringstream what;
+        what << "superblock says " << loader_.superblock().s_tinode <<
+            " free inodes, i-list has " << map.free_inodes;
+        add_problem(problems_, 0, what.str());
+    }
+
+    std::stable_sort(problems_.begin(), problems_.end(),
+                     [](const Problem &a, const Problem &b) { return a.inum < b.inum; });
+
+    return problems_.size();
+}
+
+const void Checker::print_problems() const
+{
+    for (size_t i = 0; i < problems_.size(); i++) {
+        if (problems_[i].inum != 0) {
+            std::cout << "  Inode " << std::dec << problems_[i].inum << ": ";
+        } else {
+            std::cout << "  ";
+        }
+        std::cout << problems_[i].what << "\n";
+    }
+}
+
+void Checker::worker(unsigned slot)
+{
+    for (;;) {
+        uint32_t first = next_inode_.fetch_add(INODE_RANGE);
+
+        if (first > table_->count) {
+            break;
+        }
+
+        check_range(first, slot);
+    }
+}
+
+const void Checker::check_range(uint32_t first, unsigned slot)
+{
+    if (!parts_[slot]) {
+        parts_[slot].reset(new Partial(fsize_, table_->count + 1));
+    }
+
+    Partial &part = *parts_[slot];
+    uint32_t end = std::min<uint64_t>((uint64_t) first + INODE_RANGE,
+                                      (uint64_t) table_->count + 1);
+
+    for (uint32_t i = first; i < end; i++) {
+        try {
+            check_inode(i, part);
+        } catch (std::exception &e) {
+            add_problem(part.problems, i, "block list is unreadable");
+        }
+    }
+}
+
+void Checker::check_inode(uint32_t inum, Partial &part)
+{
+    uint16_t mode = table_->mode[inum];
+
+    if (mode == 0) {
+        return;
+    }
+
+    part.inodes++;
+
+    int type = (mode & 0xf000) >> 12;
+
+    switch (type) {
+    case FileEntry::FT_CHR:
+    case FileEntry::FT_BLK:
+        // The addresses of a device hold its device number.
+        return;
+    case FileEntry::FT_FIFO:
+    case FileEntry::FT_DIR:
+    case FileEntry::FT_REG:
+        break;
+    default:
+        std::ostringstream what;
+        what << "unknown file type " << type;
+        add_problem(part.problems, inum, what.str());
+        return;
+    }
+
+    const uint32_t *addrs = table_->addrs(inum);
+    uint32_t size = table_->size[inum];
+    uint64_t per_block = loader_.block_size() / 4;
+    uint64_t needed = ((uint64_t) size + loader_.block_size() - 1) / loader_.block_size();
+
+    // Blocks past di_size. An indirect block is needed only if the
+    // file reaches past everything before it.
+    uint64_t reach = FileLoader::NADDR_DIRECT;
+    uint64_t span = 1;
+
+    for (int i = 0; i < FileLoader::NADDR; i++) {
+        uint64_t first = i < FileLoader::NADDR_DIRECT ? i : reach;
+
+        if (i >= FileLoader::NADDR_DIRECT) {
+            span *= per_block;
+            reach += span;
+        }
+
+        if (addrs[i] != 0 && first >= needed) {
+            std::ostringstream what;
+            what << "address " << i << " is set past di_size " << size;
+            add_problem(part.problems, inum, what.str());
+        }
+    }
+
+    if (needed > reach) {
+        std::ostringstream what;
+        what << "di_size " << size << " is larger than a file can be";
+        add_problem(part.problems, inum, what.str());
+        return;
+    }
+
+    // Don't follow indirect blocks that aren't there.
+    for (int i = FileLoader::NADDR_DIRECT; i < FileLoader::NADDR; i++) {
+        if (addrs[i] != 0 && (addrs[i] < isize_ || addrs[i] >= fsize_)) {
+            std::ostringstream what;
+            what << "indirect block " << addrs[i] << " is out of range";
+            add_problem(part.problems, inum, what.str());
+            return;
+        }
+    }
+
+    std::vector<uint32_t> indirect;
+    std::vector<uint32_t> blocks = loader_.block_list(addrs, size, &indirect);
+    uint32_t bad = 0, first_bad = 0;
+
+    for (size_t i = 0; i < indirect.size(); i++) {
+        if (!claim(indirect[i], part) && bad++ == 0) {
+            first_bad = indirect[i];
+        }
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i] != 0 && !claim(blocks[i], part) && bad++ == 0) {
+            first_bad = blocks[i];
+        }
+    }
+
+    if (bad > 0) {
+        std::ostringstream what;
+        what << bad << " bad block address(es), first " << first_bad;
+        add_problem(part.problems, inum, what.str());
+    }
+
+    if (type == FileEntry::FT_DIR) {
+        if (size % FileLoader::DIRENTRY_SIZE != 0) {
+            std::ostringstream what;
+            what << "directory size " << size << " is not a whole number of entries";
+            add_problem(part.problems, inum, what.str());
+        }
+
+        check_dir(inum, blocks, part);
+    }
+}
+
+void Checker::check_dir(uint32_t inum, const std::vector<uint32_t> &blocks, Partial &part)
+{
+    uint32_t block_size = loader_.block_size();
+    uint32_t entry_count = table_->size[inum] / FileLoader::DIRENTRY_SIZE;
+    uint32_t entries_per_block = block_size / FileLoader::DIRENTRY_SIZE;
+    uint32_t n = 0;
+
+    for (size_t b = 0; b < blocks.size() && n < entry_count; b++) {
+        uint32_t entries_this_block = std::min(entry_count - n, entries_per_block);
+
+        if (blocks[b] < isize_ || blocks[b] >= fsize_) {
+            n += entries_this_block;
+            continue;
+        }
+
+        BlockCache::Block block = loader_.block(blocks[b]);
+
+        for (uint32_t i = 0; i < entries_this_block; i++, n++) {
+            DentryView entry(block.get() + (i * DentryView::SIZE));
+            uint16_t d_inum = entry.inum();
+            std::string name(entry.name());
+
+            if (n == 0 && (name != "." || d_inum != inum)) {
+                add_problem(part.problems, inum, "first entry is not \".\"");
+            }
+
+            if (d_inum == 0) {
+                continue;
+            }
+
+            part.entries++;
+
+            if (d_inum > table_->count) {
+                std::ostringstream what;
+                what << "entry \"" << name << "\" names inode " << d_inum <<
+                    ", past the end of the i-list";
+                add_problem(part.problems, inum, what.str());
+                continue;
+            }
+
+            part.refs[d_inum]++;
+        }
+    }
+}
+
+//
+// Record that a block is in use. Returns false if the address can't be
+// a data block.
+//
+const bool Checker::claim(uint32_t addr, Partial &part)
+{
+    if (addr < isize_ || addr >= fsize_) {
+        return false;
+    }
+
+    if (part.owned.test(addr)) {
+        part.shared.set(addr);
+    } else {
+        part.owned.set(addr);
+    }
+
+    return true;
+}
+
+//
+// Blocks claimed more than once are rare, so rather than have every
+// worker remember who owns what, go back over the i-list to find out.
+//
+void Checker::find_shared_owners(const Bitmap &shared)
+{
+    std::map<uint32_t, std::vector<uint32_t> > owners;
+
+    for (uint32_t i = 1; i <= table_->count; i++) {
+        int type = (table_->mode[i] & 0xf000) >> 12;
+
+        if (table_->mode[i] == 0 || type == FileEntry::FT_CHR || type == FileEntry::FT_BLK) {
+            continue;
+        }
+
+        try {
+            std::vector<uint32_t> indirect;
+            std::vector<uint32_t> blocks = loader_.block_list(table_->addrs(i), table_->size[i],
+                                                              &indirect);
+            blocks.insert(blocks.end(), indirect.begin(), indirect.end());
+
+            for (size_t j = 0; j < blocks.size(); j++) {
+                if (blocks[j] < fsize_ && shared.test(blocks[j])) {
+                    owners[blocks[j]].push_back(i);
+                }
+            }
+        } catch (std::exception &e) {
+            // Already reported
+        }
+    }
+
+    for (std::map<uint32_t, std::vector<uint32_t> >::iterator it = owners.begin();
+         it != owners.end(); ++it) {
+        std::ostringstream what;
+        what << "block " << it->first << " is claimed by inodes";
+
+        for (size_t j = 0; j < it->second.size(); j++) {
+            what << " " << it->second[j];
+        }
+
+        add_problem(problems_, 0, what.str());
+    }
+}
+
+const void Checker::print_stats() const
+{
+    std::cout << "CHECK" << std::endl;
+    std::cout << "-----" << std::endl;
+    std::cout << "  Worker threads: " << std::dec << threads_ << std::endl;
+    std::cout << "  Inodes checked: " << inodes_checked_ << std::endl;
+    std::cout << "  Blocks in use: " << blocks_claimed_ << std::endl;
+    std::cout << "  Directory entries: " << dir_entries_ << std::endl;
+    std::cout << "  Blocks in use but free: " << free_claimed_ << std::endl;
+    std::cout << "  Blocks lost: " << lost_blocks_ << std::endl;
+    std::cout << "  Problems: " << problems_.size() << std::endl;
+}
+
+}; // namespace
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "imgread.hh"
+
+namespace loomcom {
+
+//
+// An fsck-style consistency check of a SysV filesystem. Nothing is
+// repaired; problems are only reported.
+//
+// The i-list is handed out to worker threads a range at a time. Each
+// worker walks the block lists of its inodes into a private ownership
+// bitmap, and counts the directory references it finds in its
+// directories. The bitmaps and counts are merged once every worker is
+// done, and checked against the link counts and the free list.
+//
+class Checker {
+public:
+    // Inodes per unit of work
+    const static uint32_t INODE_RANGE = 256;
+
+    Checker(FileLoader &loader, unsigned threads);
+
+    // Returns the number of problems found, after printing them.
+    const uint64_t run();
+
+    // run() in pieces, for callers with threads of their own: start()
+    // with the number of threads, then check_range() every INODE_RANGE
+    // inodes from 1 to inode_count() in any order, with no two calls
+    // for the same `slot` at a time, then finish(), which returns the
+    // number of problems without printing them.
+    const void start(unsigned slots);
+    const void check_range(uint32_t first, unsigned slot);
+    const uint64_t finish();
+
+    uint32_t inode_count() const { return table_->count; }
+
+    struct Problem {
+        uint32_t inum;          // 0 for problems that aren't about one inode
+        std::string what;
+    };
+
+    // Ordered by inode number
+    const std::vector<Problem> &problems() const { return problems_; }
+
+    const void print_problems() const;
+    const void print_stats() const;
+
+private:
+    // What one worker has found so far
+    struct Partial {
+        Partial(size_t blocks, size_t inodes) :
+            owned(blocks), shared(blocks), refs(inodes, 0), inodes(0), entries(0) {}
+
+        Bitmap owned;           // Blocks claimed by an inode
+        Bitmap shared;          // Blocks claimed more than once
+        std::vector<uint32_t> refs;     // Directory entries naming each inode
+        std::vector<Problem> problems;
+        uint64_t inodes;        // Allocated inodes checked
+        uint64_t entries;       // Directory entries read
+    };
+
+    void worker(unsigned slot);
+    void check_inode(uint32_t inum, Partial &part);
+    void check_dir(uint32_t inum, const std::vector<uint32_t> &blocks, Partial &part);
+    const bool claim(uint32_t addr, Partial &part);
+    void find_shared_owners(const Bitmap &shared);
+
+    FileLoader &loader_;
+    const unsigned threads_;
+
+    const InodeTable *table_;
+    uint32_t isize_;
+    uint32_t fsize_;
+
+    std::atomic<uint32_t> next_inode_;
+
+    // What each slot has found, made on its first range
+    std::vector<std::unique_ptr<Partial> > parts_;
+
+    std::vector<Problem> problems_;
+
+    uint64_t inodes_checked_;
+    uint64_t blocks_claimed_;
+    uint64_t dir_entries_;
+    uint64_t free_claimed_;     // Blocks both in use and on the free list
+    uint64_t lost_blocks_;      // Blocks neither in use nor free
+};
+
+}; // namespace
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace loomcom {
+
+//
+// The layout of a filesystem with BS-byte blocks. A SysV filesystem
+// has either 512-byte (s_type 1) or 1024-byte blocks, and FileLoader's
+// decode paths are compiled once for each, so that the block and
+// offset arithmetic here folds down to constant shifts and masks.
+//
+template <int BS>
+struct Geometry {
+    static_assert(BS == 512 || BS == 1024, "SysV blocks are 512 or 1024 bytes");
+
+    constexpr static uint32_t BLOCK_SIZE = BS;
+    constexpr static int SHIFT = BS == 512 ? 9 : 10;
+    constexpr static uint32_t MASK = BS - 1;
+
+    constexpr static uint32_t DIRENTRY_SIZE = 16;
+    constexpr static uint32_t INODE_SIZE = 64;
+
+    // The i-list follows the boot block and the superblock.
+    constexpr static uint32_t ILIST_BLOCK = 2;
+
+    constexpr static uint32_t DIRENTS_PER_BLOCK = BS / DIRENTRY_SIZE;
+    constexpr static uint32_t INODES_PER_BLOCK = BS / INODE_SIZE;
+    constexpr static uint32_t ADDRS_PER_BLOCK = BS / 4;
+
+    // Blocks needed to hold `bytes`.
+    static uint32_t blocks_for(uint64_t bytes)
+    {
+        return (uint32_t) ((bytes + MASK) >> SHIFT);
+    }
+
+    // Byte offset of block `blkno`, and the block holding `offset`.
+    static uint64_t offset_of(uint32_t blkno) { return (uint64_t) blkno << SHIFT; }
+    static uint32_t block_of(uint64_t offset) { return (uint32_t) (offset >> SHIFT); }
+
+    // The i-list block holding inode `inum`, and where in that block
+    // it starts. Inodes never straddle a block.
+    static uint32_t inode_block(uint32_t inum)
+    {
+        return ILIST_BLOCK + (inum - 1) / INODES_PER_BLOCK;
+    }
+
+    static uint32_t inode_offset(uint32_t inum)
+    {
+        return ((inum - 1) % INODES_PER_BLOCK) * INODE_SIZE;
+    }
+
+    // Data blocks reachable through an indirect block of `level`: 1
+    // for single, 2 for double and 3 for triple indirect.
+    static uint64_t indirect_span(int level)
+    {
+        uint64_t span = ADDRS_PER_BLOCK;
+        for (int i = 1; i < level; i++) {
+            span *= ADDRS_PER_BLOCK;
+        }
+        return span;
+    }
+};
+
+}; // namespace
@@ -0,0 +1,300 @@
+#include "hasher.hh"
+#include "xxh64.hh"
+
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+namespace loomcom {
+
+Hasher::Hasher(FileLoader &loader, unsigned threads) :
+    loader_(loader),
+    threads_(threads > 0 ? threads : 1),
+    next_(0),
+    bytes_(0),
+    failures_(0)
+{
+}
+
+const int Hasher::run()
+{
+    std::unordered_set<uint32_t> seen;
+
+    failures_ += loader_.walk([&](const std::string &path, const FileEntry::Ptr &f) {
+        if (f->file_type != FileEntry::FT_REG || !seen.insert(f->inode_num).second) {
+            return;
+        }
+
+        Record r;
+        r.hash = 0;
+        r.size = f->inode.di_size;
+        r.inum = f->inode_num;
+        r.path = path;
+        r.ok = false;
+
+        entries_.push_back(f);
+        records_.push_back(r);
+    });
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < threads_; i++) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+        Worker &w = *workers.back();
+
+        for (int j = 0; j < BUFFERS_PER_WORKER; j++) {
+            w.buffers.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[READ_CHUNK]));
+            w.empty.push(w.buffers.back().get());
+        }
+
+        threads.push_back(std::thread(&Hasher::reader, this, std::ref(w)));
+        threads.push_back(std::thread(&Hasher::hasher, this, std::ref(w)));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    return (int) failures_;
+}
+
+void Hasher::reader(Worker &w)
+{
+    size_t item;
+
+    while ((item = next_.fetch_add(1)) < entries_.size()) {
+        const FileEntry &f = *entries_[item];
+        uint64_t size = f.inode.di_size;
+        uint64_t offset = 0;
+
+        try {
+            std::vector<Extent> extents = loader_.extents(f);
+
+            do {
+                Chunk c;
+                c.item = item;
+                c.data = nullptr;
+                c.len = 0;
+                c.failed = false;
+
+                if (offset < size) {
+                    w.empty.pop(c.data);
+                    try {
+                        c.len = loader_.read_data(f.inode, extents, offset, c.data, READ_CHUNK);
+                    } catch (std::exception &e) {
+                        w.empty.push(c.data);
+                        throw;
+                    }
+                }
+
+                offset += c.len;
+                c.last = offset >= size;
+                w.full.push(c);
+            } while (offset < size);
+        } catch (std::exception &e) {
+            Chunk c;
+            c.item = item;
+            c.data = nullptr;
+            c.len = 0;
+            c.last = true;
+            c.failed = true;
+            w.full.push(c);
+        }
+    }
+
+    w.full.close();
+}
+
+void Hasher::hasher(Worker &w)
+{
+    XXH64 state;
+    Chunk c;
+
+    while (w.full.pop(c)) {
+        if (c.data != nullptr) {
+            state.update(c.data, c.len);
+            w.empty.push(c.data);
+        }
+
+        if (!c.last) {
+            continue;
+        }
+
+        Record &r = records_[c.item];
+
+        if (c.failed) {
+            std::cerr << "Failed to read " << r.path << std::endl;
+            failures_++;
+        } else {
+            r.hash = state.digest();
+            r.ok = true;
+            bytes_ += r.size;
+        }
+
+        state.reset();
+    }
+}
+
+const uint64_t Hasher::hash_file(FileLoader &loader, const FileEntry &f, uint8_t *buf)
+{
+    std::vector<Extent> extents = loader.extents(f);
+    XXH64 state;
+    uint64_t offset = 0;
+
+    while (offset < f.inode.di_size) {
+        size_t n = loader.read_data(f.inode, extents, offset, buf, READ_CHUNK);
+        state.update(buf, n);
+        offset += n;
+    }
+
+    return state.digest();
+}
+
+const void Hasher::print_stats() const
+{
+    std::cout << "HASHING" << std::endl;
+    std::cout << "-------" << std::endl;
+    std::cout << "  Worker pairs: " << std::dec << threads_ << std::endl;
+    std::cout << "  Files: " << records_.size() << std::endl;
+    std::cout << "  Bytes: " << bytes_ << std::endl;
+    std::cout << "  Failures: " << failures_ << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////
+// HashDb
+//
+
+void HashDb::print_record(std::ostream &out, const std::string &image, int partition,
+                          const Hasher::Record &r)
+{
+    out << std::hex << std::setw(16) << std::setfill('0') << r.hash <<
+        std::setfill(' ') << std::dec << "\t" << r.size << "\t" << image << "\t" <<
+        partition << "\t" << r.inum << "\t" << r.path << "\n";
+}
+
+void HashDb::append(const std::string &db, const std::string &image, int partition,
+                    const std::vector<Hasher::Record> &records)
+{
+    std::ostringstream out;
+
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].ok) {
+            print_record(out, image, partition, records[i]);
+        }
+    }
+
+    std::string data = out.str();
+    int fd = open(db.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+        std::cerr << "Unable to open " << db << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    // Keep one image's lines together when several runs share a
+    // database.
+    flock(fd, LOCK_EX);
+
+    const char *p = data.data();
+    size_t left = data.size();
+
+    while (left > 0) {
+        ssize_t w = write(fd, p, left);
+
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (w < 0) {
+            std::cerr << "Write to " << db << " failed: " << strerror(errno) << std::endl;
+            close(fd);
+            throw std::exception();
+        }
+
+        p += w;
+        left -= w;
+    }
+
+    close(fd);
+}
+
+size_t HashDb::print_duplicates(const std::string &db)
+{
+    std::ifstream in(db);
+
+    if (!in) {
+        std::cerr << "Unable to open " << db << std::endl;
+        throw std::exception();
+    }
+
+    // (hash, size) -> distinct "image[:partition] path" locations
+    typedef std::pair<uint64_t, uint64_t> Key;
+    typedef std::map<Key, std::set<std::string> > FileMap;
+    typedef std::pair<Key, const std::set<std::string> *> Dup;
+
+    FileMap files;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        std::string fields[6];
+        size_t pos = 0;
+        int n;
+
+        // The path is last, and takes the rest of the line.
+        for (n = 0; n < 6 && pos != std::string::npos; n++) {
+            size_t tab = n < 5 ? line.find('\t', pos) : std::string::npos;
+            fields[n] = line.substr(pos, tab == std::string::npos ? tab : tab - pos);
+            pos = tab == std::string::npos ? tab : tab + 1;
+        }
+
+        if (n < 6) {
+            continue;
+        }
+
+        std::string where = fields[2];
+
+        if (fields[3] != "-1") {
+            where += ":p" + fields[3];
+        }
+
+        Key key(strtoull(fields[0].c_str(), NULL, 16),
+                strtoull(fields[1].c_str(), NULL, 10));
+        files[key].insert(where + " " + fields[5]);
+    }
+
+    // Biggest savings first
+    std::vector<Dup> dups;
+
+    for (FileMap::const_iterator it = files.begin(); it != files.end(); ++it) {
+        if (it->second.size() > 1) {
+            dups.push_back(std::make_pair(it->first, &it->second));
+        }
+    }
+
+    std::stable_sort(dups.begin(), dups.end(), [](const Dup &a, const Dup &b) {
+        return a.first.second * (a.second->size() - 1) > b.first.second * (b.second->size() - 1);
+    });
+
+    for (size_t i = 0; i < dups.size(); i++) {
+        std::cout << std::hex << std::setw(16) << std::setfill('0') << dups[i].first.first <<
+            std::setfill(' ') << std::dec << " " << dups[i].first.second << " bytes, " <<
+            dups[i].second->size() << " copies\n";
+
+        for (std::set<std::string>::const_iterator it = dups[i].second->begin();
+             it != dups[i].second->end(); ++it) {
+            std::cout << "    " << *it << "\n";
+        }
+    }
+
+    return dups.size();
+}
+
+}; // namespace
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "imgread.hh"
+#include "workqueue.hh"
+
+namespace loomcom {
+
+//
+// Hash the contents of every regular file in a filesystem.
+//
+// Files are hashed with XXH64. Each worker is a pair of threads: a
+// reader pulling file data out of the image into a small ring of
+// buffers, and a hasher consuming them, so hashing one chunk overlaps
+// with reading the next. Files are handed to reader threads one at a
+// time, and a pair's chunks stay in order, so every file's data
+// reaches its hasher sequentially.
+//
+class Hasher {
+public:
+    // Size of each read, and how many buffers each pair passes around
+    const static size_t READ_CHUNK = 1024 * 1024;
+    const static int BUFFERS_PER_WORKER = 4;
+
+    struct Record {
+        uint64_t hash;
+        uint32_t size;
+        uint32_t inum;
+        std::string path;
+        bool ok;                // False if the data couldn't be read
+    };
+
+    Hasher(FileLoader &loader, unsigned threads);
+
+    // Returns the number of files that could not be hashed.
+    const int run();
+
+    // One record per inode, in walk order. Extra links to a file
+    // aren't hashed again.
+    const std::vector<Record> &records() const { return records_; }
+
+    // Hash one file on the calling thread, reading it through `buf`,
+    // which must hold READ_CHUNK bytes. Throws if it can't be read.
+    static const uint64_t hash_file(FileLoader &loader, const FileEntry &f, uint8_t *buf);
+
+    const void print_stats() const;
+
+private:
+    struct Chunk {
+        size_t item;            // Index into records_
+        uint8_t *data;          // A ring buffer, or nullptr
+        size_t len;
+        bool last;              // The file's final chunk
+        bool failed;            // Reading the file failed
+    };
+
+    struct Worker {
+        WorkQueue<Chunk> full;
+        WorkQueue<uint8_t *> empty;
+        std::vector<std::unique_ptr<uint8_t[]> > buffers;
+    };
+
+    void reader(Worker &w);
+    void hasher(Worker &w);
+
+    FileLoader &loader_;
+    const unsigned threads_;
+
+    std::vector<FileEntry::Ptr> entries_;
+    std::vector<Record> records_;
+    std::atomic<size_t> next_;
+
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> failures_;
+};
+
+//
+// A corpus-wide database of file hashes: a text file with one line per
+// file,
+//
+//     <hash> <size> <image> <partition> <inode> <path>
+//
+// separated by tabs, with the hash as 16 hex digits. Any number of
+// imgread processes can add to the same database at once.
+//
+class HashDb {
+public:
+    // Append the records of one image.
+    static void append(const std::string &db, const std::string &image, int partition,
+                       const std::vector<Hasher::Record> &records);
+
+    // Print every set of identical files found in more than one place.
+    // Returns the number of sets.
+    static size_t print_duplicates(const std::string &db);
+
+    static void print_record(std::ostream &out, const std::string &image, int partition,
+                             const Hasher::Record &r);
+};
+
+}; // namespace
@@ -0,0 +1,211 @@
+#include "image.hh"
+#include "compressed.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <exception>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// ByteView
+//
+
+ByteView ByteView::subview(size_t offset, size_t len) const
+{
+    if (offset > size_ || len > size_ - offset) {
+        std::cerr << "View range out of bounds." << std::endl;
+        throw std::exception();
+    }
+
+    return ByteView(data_ + offset, len);
+}
+
+//////////////////////////////////////////////////////////////////////
+// ImageSource
+//
+
+ImageSource::Ptr ImageSource::open(const std::string &file_name, bool use_mmap)
+{
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        int error = errno;
+        std::cerr << "Unable to open " << file_name << ": " <<
+            strerror(error) << std::endl;
+        throw OpenError(error);
+    }
+
+    struct stat s;
+
+    if (fstat(fd, &s) < 0) {
+        int error = errno;
+        std::cerr << "Unable to stat " << file_name << ": " <<
+            strerror(error) << std::endl;
+        ::close(fd);
+        throw OpenError(error);
+    }
+
+    uint64_t size = (uint64_t) s.st_size;
+    uint8_t magic[6];
+
+    if (pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)) {
+        if (magic[0] == 0x1f && magic[1] == 0x8b) {
+            return GzipImageSource::open(file_name, fd, size);
+        }
+
+        if (memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+            return XzImageSource::open(file_name, fd, size);
+        }
+    }
+
+    if (use_mmap && size > 0) {
+        void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (base != MAP_FAILED) {
+            return Ptr(new MmapImageSource(file_name, fd, size,
+                                           static_cast<const uint8_t *>(base)));
+        }
+    }
+
+    return Ptr(new PreadImageSource(file_name, fd, size));
+}
+
+ImageSource::ImageSource(const std::string &file_name, int fd, uint64_t size) :
+    file_name_(file_name), fd_(fd), size_(size)
+{
+}
+
+ImageSource::~ImageSource()
+{
+    ::close(fd_);
+}
+
+ByteView ImageSource::view(uint64_t offset, size_t len) const
+{
+    return ByteView();
+}
+
+int ImageSource::raw_fd() const
+{
+    return fd_;
+}
+
+void ImageSource::will_need(uint64_t offset, size_t len) const
+{
+}
+
+void ImageSource::print_stats() const
+{
+}
+
+void ImageSource::check_range(uint64_t offset, size_t len) const
+{
+    if (offset > size_ || len > size_ - offset) {
+        std::cerr << "Read of " << len << " bytes at offset " << offset <<
+            " is past the end of " << file_name_ << std::endl;
+        throw std::exception();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// MmapImageSource
+//
+
+MmapImageSource::MmapImageSource(const std::string &file_name, int fd,
+                                 uint64_t size, const uint8_t *base) :
+    ImageSource(file_name, fd, size), base_(base)
+{
+}
+
+MmapImageSource::~MmapImageSource()
+{
+    munmap(const_cast<uint8_t *>(base_), size_);
+}
+
+bool MmapImageSource::mapped() const
+{
+    return true;
+}
+
+void MmapImageSource::read(uint64_t offset, void *buf, size_t len) const
+{
+    check_range(offset, len);
+    memcpy(buf, base_ + offset, len);
+    Trace::count(Trace::BYTES_READ, len);
+}
+
+ByteView MmapImageSource::view(uint64_t offset, size_t len) const
+{
+    check_range(offset, len);
+    Trace::count(Trace::BYTES_READ, len);
+    return ByteView(base_ + offset, len);
+}
+
+void MmapImageSource::will_need(uint64_t offset, size_t len) const
+{
+    if (offset >= size_) {
+        return;
+    }
+
+    len = (size_t) std::min<uint64_t>(len, size_ - offset);
+
+    // madvise wants a page-aligned start.
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+
+    madvise(const_cast<uint8_t *>(base_) + start, len + (offset - start), MADV_WILLNEED);
+}
+
+//////////////////////////////////////////////////////////////////////
+// PreadImageSource
+//
+
+PreadImageSource::PreadImageSource(const std::string &file_name, int fd,
+                                   uint64_t size) :
+    ImageSource(file_name, fd, size)
+{
+}
+
+bool PreadImageSource::mapped() const
+{
+    return false;
+}
+
+void PreadImageSource::read(uint64_t offset, void *buf, size_t len) const
+{
+    check_range(offset, len);
+
+    uint8_t *p = static_cast<uint8_t *>(buf);
+
+    while (len > 0) {
+        ssize_t n = pread(fd_, p, len, (off_t) offset);
+        Trace::count(Trace::IO_CALLS);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            std::cerr << "Failed to read " << file_name_ << " at offset " <<
+                offset << std::endl;
+            throw std::exception();
+        }
+
+        Trace::count(Trace::BYTES_READ, n);
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+}; // namespace
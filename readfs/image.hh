@@ -0,0 +1,128 @@
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// A read-only window onto a run of image bytes. Views handed out by a
+// mapped ImageSource point straight into the mapping and stay valid
+// for as long as the source itself is alive.
+//
+class ByteView {
+public:
+    ByteView() : data_(nullptr), size_(0) {}
+    ByteView(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const uint8_t *begin() const { return data_; }
+    const uint8_t *end() const { return data_ + size_; }
+
+    const uint8_t &operator[](size_t i) const { return data_[i]; }
+
+    // A narrower view. Throws if the range falls outside this view.
+    ByteView subview(size_t offset, size_t len) const;
+
+private:
+    const uint8_t *data_;
+    size_t size_;
+};
+
+//
+// Thrown by ImageSource::open() when the file itself can't be opened,
+// with the errno value saying why. Anything else wrong with an image
+// is a plain std::exception.
+//
+class OpenError : public std::exception {
+public:
+    explicit OpenError(int error) : error_(error) {}
+
+    int error() const { return error_; }
+
+private:
+    int error_;
+};
+
+//
+// Random access to the bytes of a disk image. The file is opened once,
+// and every read after that is a single pread(2) or, for the mmap
+// backend, plain pointer arithmetic.
+//
+class ImageSource {
+public:
+    typedef std::shared_ptr<ImageSource> Ptr;
+
+    // Open an image, preferring mmap and falling back to pread if the
+    // file can't be mapped. gzip and xz compressed images are
+    // recognized by their magic numbers and decompressed on the fly.
+    static Ptr open(const std::string &file_name, bool use_mmap = true);
+
+    virtual ~ImageSource();
+
+    const std::string &file_name() const { return file_name_; }
+    uint64_t size() const { return size_; }
+
+    // True if view() hands out zero-copy views.
+    virtual bool mapped() const = 0;
+
+    // Copy `len` bytes starting at `offset` into `buf`. Throws if the
+    // range can't be read in full.
+    virtual void read(uint64_t offset, void *buf, size_t len) const = 0;
+
+    // A zero-copy view of `len` bytes at `offset`, or an empty view if
+    // this backend can't provide one.
+    virtual ByteView view(uint64_t offset, size_t len) const;
+
+    // A descriptor the image's bytes can be read from directly, at the
+    // same offsets, for asynchronous I/O. -1 if there isn't one, as for
+    // a compressed image.
+    virtual int raw_fd() const;
+
+    // Hint that the range will be read soon. Only mappings act on it.
+    virtual void will_need(uint64_t offset, size_t len) const;
+
+    // Print anything the backend counts.
+    virtual void print_stats() const;
+
+protected:
+    ImageSource(const std::string &file_name, int fd, uint64_t size);
+
+    void check_range(uint64_t offset, size_t len) const;
+
+    const std::string file_name_;
+    const int fd_;
+    const uint64_t size_;
+};
+
+class MmapImageSource : public ImageSource {
+public:
+    MmapImageSource(const std::string &file_name, int fd, uint64_t size,
+                    const uint8_t *base);
+    ~MmapImageSource();
+
+    bool mapped() const;
+    void read(uint64_t offset, void *buf, size_t len) const;
+    ByteView view(uint64_t offset, size_t len) const;
+    void will_need(uint64_t offset, size_t len) const;
+
+private:
+    const uint8_t *base_;
+};
+
+class PreadImageSource : public ImageSource {
+public:
+    PreadImageSource(const std::string &file_name, int fd, uint64_t size);
+
+    bool mapped() const;
+    void read(uint64_t offset, void *buf, size_t len) const;
+};
+
+}; // namespace
@@ -0,0 +1,288 @@
+//
+// A read-only FUSE mount of a SysV filesystem image.
+//
+// Every request is served by one FileLoader, so all of them share its
+// block cache, interned names and lazily loaded directories. libfuse
+// runs requests on several threads unless given -s; FileLoader is safe
+// to use that way.
+//
+// Because the image never changes under the mount, the kernel is told
+// to keep file data and attributes cached, and to read ahead in large
+// chunks.
+//
+
+#define FUSE_USE_VERSION 31
+
+#include "imgread.hh"
+#include "vtoc.hh"
+
+#include <fuse.h>
+
+#include <errno.h>
+#include <fcntl.h>
+
+using namespace loomcom;
+
+// What an open file needs to serve reads without another lookup
+struct OpenFile {
+    FileEntry::Ptr entry;
+    std::vector<Extent> extents;
+};
+
+static FileLoader *loader()
+{
+    return static_cast<FileLoader *>(fuse_get_context()->private_data);
+}
+
+static void fill_stat(const FileEntry &f, uint32_t block_size, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    // SysV and the host agree on the mode bits.
+    st->st_mode = f.inode.di_mode;
+    st->st_ino = f.inode_num;
+    st->st_nlink = f.inode.di_nlink;
+    st->st_uid = f.inode.di_uid;
+    st->st_gid = f.inode.di_gid;
+    st->st_size = f.inode.di_size;
+    st->st_blksize = block_size;
+    st->st_blocks = ((uint64_t) f.inode.di_size + 511) / 512;
+    st->st_atime = f.inode.di_atime;
+    st->st_mtime = f.inode.di_mtime;
+    st->st_ctime = f.inode.di_ctime;
+}
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    cfg->use_ino = 1;
+    cfg->kernel_cache = 1;
+
+    // Nothing changes, so nothing needs to be looked up twice.
+    cfg->entry_timeout = 3600;
+    cfg->attr_timeout = 3600;
+    cfg->negative_timeout = 3600;
+
+    conn->max_readahead = 1024 * 1024;
+
+    return fuse_get_context()->private_data;
+}
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    FileEntry::Ptr f;
+
+    if (fi != NULL && fi->fh != 0) {
+        f = reinterpret_cast<OpenFile *>(fi->fh)->entry;
+    } else {
+        // Directories are read as they're reached, and may be damaged.
+        try {
+            f = loader()->lookup(path);
+        } catch (std::exception &e) {
+            return -EIO;
+        }
+    }
+
+    if (f == nullptr) {
+        return -ENOENT;
+    }
+
+    fill_stat(*f, loader()->block_size(), st);
+
+    return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    try {
+        FileEntry::Ptr dir = loader()->lookup(path);
+
+        if (dir == nullptr) {
+            return -ENOENT;
+        }
+
+        if (!dir->is_dir) {
+            return -ENOTDIR;
+        }
+
+        const FileEntry::List &entries = dir->dir_entries();
+        struct stat st;
+
+        fill_stat(*dir, loader()->block_size(), &st);
+        filler(buf, ".", &st, 0, (enum fuse_fill_dir_flags) 0);
+        filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags) 0);
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            std::string name(entries[i]->name);
+
+            fill_stat(*entries[i], loader()->block_size(), &st);
+
+            if (filler(buf, name.c_str(), &st, 0, (enum fuse_fill_dir_flags) 0) != 0) {
+                break;
+            }
+        }
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+
+    FileEntry::Ptr f;
+
+    try {
+        f = loader()->lookup(path);
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+
+    if (f == nullptr) {
+        return -ENOENT;
+    }
+
+    if (f->file_type != FileEntry::FT_REG) {
+        return -EACCES;
+    }
+
+    OpenFile *file = new OpenFile();
+    file->entry = f;
+
+    try {
+        file->extents = loader()->extents(*f);
+    } catch (std::exception &e) {
+        delete file;
+        return -EIO;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(file);
+    fi->keep_cache = 1;
+
+    return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    OpenFile *file = reinterpret_cast<OpenFile *>(fi->fh);
+
+    try {
+        return (int) loader()->read_data(file->entry->inode, file->extents, offset,
+                                         reinterpret_cast<uint8_t *>(buf), size);
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    delete reinterpret_cast<OpenFile *>(fi->fh);
+    return 0;
+}
+
+static int fs_statfs(const char *path, struct statvfs *st)
+{
+    const superblock &sb = loader()->superblock();
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = loader()->block_size();
+    st->f_frsize = loader()->block_size();
+    st->f_blocks = sb.s_fsize;
+    st->f_bfree = sb.s_tfree;
+    st->f_bavail = sb.s_tfree;
+    st->f_files = (sb.s_isize - 2) * (loader()->block_size() / FileLoader::INODE_SIZE);
+    st->f_ffree = sb.s_tinode;
+    st->f_namemax = 14;
+    st->f_flag = ST_RDONLY;
+
+    return 0;
+}
+
+static void usage()
+{
+    std::cerr << "Usage: imgfuse [options] <file> <mountpoint> [FUSE options]" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -p         Read the image with pread(2) instead of mmap(2)" << std::endl;
+    std::cerr << "  -c blocks  Block cache capacity (default 1024)" << std::endl;
+    std::cerr << "  -x         Ignore any sidecar index" << std::endl;
+    std::cerr << "  -P part    Mount partition `part' of the disk's VTOC" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    FileLoader::Options options;
+    int partition = -1;
+    int c;
+
+    while ((c = getopt(argc, argv, "+pc:xP:")) != -1) {
+        switch (c) {
+        case 'p':
+            options.use_mmap = false;
+            break;
+        case 'c':
+            options.cache_blocks = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            options.use_index = false;
+            break;
+        case 'P':
+            partition = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    const char *name = argv[optind++];
+
+    std::unique_ptr<FileLoader> loader;
+
+    try {
+        ImageSource::Ptr image = ImageSource::open(name, options.use_mmap);
+
+        if (!Vtoc::select(*image, partition, options)) {
+            return 1;
+        }
+
+        loader.reset(new FileLoader(image, options));
+        loader->load();
+    } catch (std::exception &e) {
+        return 1;
+    }
+
+    struct fuse_operations ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.init = fs_init;
+    ops.getattr = fs_getattr;
+    ops.readdir = fs_readdir;
+    ops.open = fs_open;
+    ops.read = fs_read;
+    ops.release = fs_release;
+    ops.statfs = fs_statfs;
+
+    // Hand FUSE the mount point and its own options, always read-only.
+    std::vector<char *> fuse_argv;
+    std::string ro = "-oro";
+    fuse_argv.push_back(argv[0]);
+    fuse_argv.push_back(&ro[0]);
+
+    for (int i = optind; i < argc; i++) {
+        fuse_argv.push_back(argv[i]);
+    }
+
+    fuse_argv.push_back(NULL);
+
+    return fuse_main((int) fuse_argv.size() - 1, fuse_argv.data(), &ops, loader.get());
+}
@@ -1,4 +1,5 @@
 #include "imgread.hh"
+#include "geometry.hh"
 
 namespace loomcom {
 
@@ -7,27 +8,86 @@ namespace loomcom {
 // FileEntry
 //
 
-FileEntry::FileEntry(const std::string name, uint32_t inode_num) :
-    name(name), inode_num(inode_num)
+FileEntry::FileEntry(FileLoader *loader, std::string_view name, uint32_t inode_num) :
+    is_dir(false), name(name), file_type(0), mode(0), inode_num(inode_num),
+    index_entry(Index::NONE), loader_(loader)
 {
+    memset(&inode, 0, sizeof(inode));
 }
 
-FileEntry::~FileEntry()
+const FileEntry::List &FileEntry::dir_entries() const
 {
+    if (is_dir) {
+        std::call_once(dir_loaded_, [this]() {
+            dir_entries_ = loader_->read_dir(*this);
+        });
+    }
+
+    return dir_entries_;
 }
 
-const std::vector<dentry> &FileEntry::dir_entries() const
+const FileEntry::Ptr FileEntry::find(std::string_view name) const
 {
-    return dir_entries_;
+    // No entry can hold a longer name.
+    if (name.size() > NameKey::MAX_NAME) {
+        return nullptr;
+    }
+
+    return find(NameKey(name));
+}
+
+const FileEntry::Ptr FileEntry::find(const NameKey &key) const
+{
+    const List &entries = dir_entries();
+
+    if (entries.size() <= DirHash::SMALL_DIR) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (NameKey(entries[i]->name) == key) {
+                return entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    std::call_once(hash_built_, [this, &entries]() {
+        loader_->hash_dir(entries, hash_);
+    });
+
+    return hash_.find(key);
 }
 
 //////////////////////////////////////////////////////////////////////
 // FileLoader
 //
 
-FileLoader::FileLoader(const std::string file_name) :
+//
+// True if `name` can be a component of a path: not empty, not "." or
+// "..", and without a '/'. A damaged or hostile image can put anything
+// in a directory, and a path built from such a name could climb out of
+// wherever it's made, e.g. by extract.
+//
+static bool usable_name(std::string_view name)
+{
+    return !name.empty() && name != "." && name != ".." &&
+        name.find('/') == std::string_view::npos;
+}
+
+FileLoader::FileLoader(const std::string file_name, const Options &options) :
     file_name_(file_name),
-    root_("/", 1)
+    options_(options),
+    decode_(nullptr),
+    names_(arena_),
+    root_(nullptr)
+{
+}
+
+FileLoader::FileLoader(ImageSource::Ptr image, const Options &options) :
+    file_name_(image->file_name()),
+    options_(options),
+    image_(image),
+    decode_(nullptr),
+    names_(arena_),
+    root_(nullptr)
 {
 }
 
@@ -37,55 +97,87 @@ FileLoader::~FileLoader()
 
 const void FileLoader::load()
 {
-    std::cout << "Loading file " << file_name_ << std::endl;
+    Trace::Scope scope(Trace::LOAD);
+
+    // The image stays open for the life of the loader.
+    if (!image_) {
+        image_ = ImageSource::open(file_name_, options_.use_mmap);
+    }
 
     // The first thing we do is read the superblock.
     read_superblock();
-    print_superblock();
+
+    // If a sidecar index still matches the image, the tree comes from
+    // there and no inodes or directories need to be read.
+    if (options_.use_index) {
+        index_ = Index::open(Index::path_for(file_name_, options_.partition), image_->size(),
+                             superblock_hash_, block_size_);
+    }
 
     // Now read the root file entry
     read_root();
 }
 
+const void FileLoader::write_index()
+{
+    Trace::Scope scope(Trace::WRITE_INDEX);
+    Index::write(*this, Index::path_for(file_name_, options_.partition));
+}
+
 const void FileLoader::read_superblock()
 {
-    std::fstream file;
-    file.open(file_name_.c_str(), std::ifstream::in | std::ifstream::binary);
-    file.seekg(SUPERBLOCK_OFFSET, file.beg);
+    Trace::Scope scope(Trace::READ_SUPERBLOCK);
 
-    if ((file.rdstate() & std::ifstream::eofbit) != 0) {
+    if (image_->size() < options_.base + SUPERBLOCK_OFFSET + SuperblockView::SIZE) {
         std::cerr << "Failed to read superblock." << std::endl;
         throw std::exception();
     }
 
-    file.read(reinterpret_cast<char *>(&superblock_), sizeof(struct superblock));
+    uint8_t raw[SuperblockView::SIZE];
+    const uint8_t *sb_data = raw;
+
+    if (image_->mapped()) {
+        sb_data = image_->view(options_.base + SUPERBLOCK_OFFSET, SuperblockView::SIZE).data();
+    } else {
+        image_->read(options_.base + SUPERBLOCK_OFFSET, raw, SuperblockView::SIZE);
+    }
 
-    file.close();
+    superblock_hash_ = Index::superblock_hash(sb_data, SuperblockView::SIZE, image_->size());
 
-    superblock_.s_isize  = eswap16(superblock_.s_isize);
-    superblock_.s_fsize  = eswap32(superblock_.s_fsize);
-    superblock_.s_nfree  = eswap16(superblock_.s_nfree);
-    superblock_.s_ninode = eswap16(superblock_.s_ninode);
-    superblock_.s_time   = eswap32(superblock_.s_time);
-    superblock_.s_tfree  = eswap32(superblock_.s_tfree);
-    superblock_.s_tinode = eswap16(superblock_.s_tinode);
-    superblock_.s_state  = eswap32(superblock_.s_state);
-    superblock_.s_magic  = eswap32(superblock_.s_magic);
-    superblock_.s_type   = eswap32(superblock_.s_type);
+    SuperblockView sb(sb_data);
+
+    memset(&superblock_, 0, sizeof(superblock_));
+    superblock_.s_isize  = sb.isize();
+    superblock_.s_fsize  = sb.fsize();
+    superblock_.s_nfree  = sb.nfree();
+    superblock_.s_ninode = sb.ninode();
+    superblock_.s_flock  = sb.flock();
+    superblock_.s_ilock  = sb.ilock();
+    superblock_.s_fmod   = sb.fmod();
+    superblock_.s_ronly  = sb.ronly();
+    superblock_.s_time   = sb.time();
+    superblock_.s_tfree  = sb.tfree();
+    superblock_.s_tinode = sb.tinode();
+    superblock_.s_state  = sb.state();
+    superblock_.s_magic  = sb.magic();
+    superblock_.s_type   = sb.type();
+
+    memcpy(superblock_.s_fname, sb_data + SuperblockView::S_FNAME, sizeof(superblock_.s_fname));
+    memcpy(superblock_.s_fpack, sb_data + SuperblockView::S_FPACK, sizeof(superblock_.s_fpack));
 
     switch (superblock_.s_type) {
     case 1:
         block_size_ = 512;
-        inode_offset_ = 512 * 20;
+        decode_ = &decoders<512>();
         break;
     case 2:
-        block_size_ = 1024;
-        inode_offset_ = 512 * 22;
-        break;
     default:
         block_size_ = 1024;
-        inode_offset_ = 512 * 22;
+        decode_ = &decoders<1024>();
     }
+
+    // The i-list follows the boot block and the superblock.
+    inode_offset_ = options_.base + 2 * block_size_;
     
     // Check for MAGIC
     if (superblock_.s_magic != FS_MAGIC) {
@@ -93,144 +185,773 @@ const void FileLoader::read_superblock()
         throw std::exception();
     }
 
-    for (int i = 0; i < 50; i++) {
-        superblock_.s_free[i] = eswap32(superblock_.s_free[i]);
+    for (int i = 0; i < NICFREE; i++) {
+        superblock_.s_free[i] = sb.free(i);
     }
 
     for (int i = 0; i < 100; i++) {
-        superblock_.s_inode[i] = eswap16(superblock_.s_inode[i]);
+        superblock_.s_inode[i] = sb.inode(i);
     }
 
     for (int i = 0; i < 4; i++) {
-        superblock_.s_dinfo[i] = eswap16(superblock_.s_dinfo[i]);
+        superblock_.s_dinfo[i] = sb.dinfo(i);
     }
 
-    // Calculate the number of inode entries
-    num_inodes_ = (superblock_.s_isize * block_size_) / DIRENTRY_SIZE;
+    // Everything past the superblock is read a block at a time
+    // through the cache.
+    cache_.reset(new BlockCache(image_, options_.base, block_size_,
+                                options_.cache_blocks, options_.readahead,
+                                options_.io_depth, options_.io_uring));
+
+    // Calculate the number of inode entries. s_isize is really the
+    // address of the first data block; the i-list itself starts after
+    // the boot block and the superblock.
     inodes_per_block_ = block_size_ / INODE_SIZE;
+    num_inodes_ = superblock_.s_isize > 2 ?
+        (superblock_.s_isize - 2) * inodes_per_block_ : 0;
 
     time_t t = (time_t)superblock_.s_time;
     last_update_ = *localtime(&t);
 }
 
+//
+// The decode paths for BS-byte blocks. read_superblock() picks one set
+// for the filesystem and everything after goes through it.
+//
+template <int BS>
+const FileLoader::Decoders &FileLoader::decoders()
+{
+    const static Decoders d = {
+        &FileLoader::read_inode_as<BS>,
+        &FileLoader::read_dir_as<BS>,
+        &FileLoader::block_list_as<BS>,
+        &FileLoader::read_data_as<BS>,
+    };
+
+    return d;
+}
+
 const void FileLoader::read_inode(struct dinode &inode, const uint32_t inode_num)
 {
-    std::fstream file;
-    int offset = inode_offset_ + (inode_num * INODE_SIZE);
+    (this->*decode_->read_inode)(inode, inode_num);
+}
+
+template <int BS>
+const void FileLoader::read_inode_as(struct dinode &inode, const uint32_t inode_num)
+{
+    typedef Geometry<BS> G;
 
-    file.open(file_name_.c_str(), std::ifstream::in | std::ifstream::binary);
-    file.seekg(offset, file.beg);
-    
-    if ((file.rdstate() & std::ifstream::eofbit) != 0) {
+    // The i-list starts with inode 1.
+    uint32_t blkno = G::inode_block(inode_num);
+    uint32_t within = G::inode_offset(inode_num);
+
+    if (inode_num == 0 ||
+        options_.base + G::offset_of(blkno) + within + INODE_SIZE > image_->size()) {
         std::cerr << "Failed to read inode " << inode_num << std::endl;
         throw std::exception();
     }
 
-    file.read(reinterpret_cast<char *>(&inode), sizeof(struct dinode));
+    BlockCache::Block block = cache_->get(blkno);
+    DinodeView v(block.get() + within);
+
+    inode.di_mode  = v.mode();
+    inode.di_nlink = v.nlink();
+    inode.di_uid   = v.uid();
+    inode.di_gid   = v.gid();
+    inode.di_size  = v.size();
+    inode.di_atime = v.atime();
+    inode.di_mtime = v.mtime();
+    inode.di_ctime = v.ctime();
 
-    file.close();
+    // The addresses stay packed; disk_addr() unpacks them as needed.
+    memcpy(inode.di_addr, v.addr_bytes(), DinodeView::ADDR_BYTES);
 
-    // Correct endianness
-    inode.di_mode  = eswap16(inode.di_mode);
-    inode.di_nlink = eswap16(inode.di_nlink);
-    inode.di_uid   = eswap16(inode.di_uid);
-    inode.di_gid   = eswap16(inode.di_gid);
-    inode.di_size  = eswap32(inode.di_size);
-    inode.di_atime = eswap32(inode.di_atime);
-    inode.di_mtime = eswap32(inode.di_mtime);
-    inode.di_ctime = eswap32(inode.di_ctime);
+    Trace::count(Trace::INODES_DECODED);
 }
 
-const void FileLoader::read_root()
+//
+// Decode the entire i-list at once. The raw list is pulled in with a
+// single read (or not at all, if the image is mapped), and each field
+// is read through a DinodeView straight into its own column.
+//
+const InodeTable &FileLoader::load_inode_table()
 {
-    std::fstream file;
+    if (inode_table_) {
+        return *inode_table_;
+    }
 
-    read_inode(root_.inode, 1);
-    
-    // Set some file attributes on the root.
-    root_.file_type = (0xf000 & root_.inode.di_mode) >> 12;
-    root_.mode = 0xfff & root_.inode.di_mode;
+    Trace::Scope scope(Trace::READ_INODE_TABLE);
+
+    uint32_t count = num_inodes_;
+    uint64_t avail = image_->size() > inode_offset_ ?
+        (image_->size() - inode_offset_) / INODE_SIZE : 0;
+
+    if (count > avail) {
+        std::cerr << "Inode list is truncated; reading " << avail <<
+            " of " << count << " inodes." << std::endl;
+        count = (uint32_t) avail;
+    }
+
+    size_t len = (size_t) count * INODE_SIZE;
+    std::vector<uint8_t> raw;
+    const uint8_t *ilist;
+
+    if (image_->mapped()) {
+        ilist = image_->view(inode_offset_, len).data();
+    } else {
+        // Leave room for the 3-byte address unpacker to over-read.
+        raw.resize(len + 4);
+        image_->read(inode_offset_, raw.data(), len);
+        ilist = raw.data();
+    }
+
+    // Slot 0 is left empty so the table can be indexed by inode number.
+    uint32_t slots = count + 1;
+
+    std::unique_ptr<InodeTable> table(new InodeTable());
+    table->count = count;
+    table->mode.resize(slots);
+    table->nlink.resize(slots);
+    table->uid.resize(slots);
+    table->gid.resize(slots);
+    table->size.resize(slots);
+    table->atime.resize(slots);
+    table->mtime.resize(slots);
+    table->ctime.resize(slots);
+    table->addr.resize((size_t) slots * InodeTable::ADDRS_PER_INODE);
+
+    for (uint32_t i = 1; i < slots; i++) {
+        DinodeView v(ilist + (size_t) (i - 1) * DinodeView::SIZE);
+
+        table->mode[i] = v.mode();
+        table->nlink[i] = v.nlink();
+        table->uid[i] = v.uid();
+        table->gid[i] = v.gid();
+        table->size[i] = v.size();
+        table->atime[i] = v.atime();
+        table->mtime[i] = v.mtime();
+        table->ctime[i] = v.ctime();
+
+        be24_unpack(v.addr_bytes(),
+                    &table->addr[(size_t) i * InodeTable::ADDRS_PER_INODE],
+                    InodeTable::ADDRS_PER_INODE);
+    }
+
+    Trace::count(Trace::INODES_DECODED, count);
+
+    inode_table_ = std::move(table);
+
+    return *inode_table_;
+}
+
+//
+// Build the block and inode allocation maps. Every block starts out
+// allocated; walking the free list clears the bits of the blocks on it.
+//
+// The superblock holds the first group of the free list: s_free[0] is
+// the address of the next group's block (or 0 at the end of the list)
+// and s_free[1] onward are free blocks. Each later group is a block
+// laid out the same way, starting with its own count. The group blocks
+// are themselves free.
+//
+const AllocationMap &FileLoader::load_allocation_map()
+{
+    if (allocation_map_) {
+        return *allocation_map_;
+    }
+
+    Trace::Scope scope(Trace::READ_ALLOCATION_MAP);
+
+    std::unique_ptr<AllocationMap> map(new AllocationMap());
+    map->blocks = Bitmap(superblock_.s_fsize);
+    map->blocks.set_range(0, superblock_.s_fsize);
+
+    uint32_t nfree = superblock_.s_nfree;
+    std::vector<uint32_t> group(superblock_.s_free, superblock_.s_free + NICFREE);
+
+    while (nfree > 0) {
+        if (nfree > (uint32_t) NICFREE) {
+            map->chain_truncated = true;
+            break;
+        }
+
+        for (uint32_t i = 1; i < nfree; i++) {
+            if (mark_free(*map, group[i])) {
+                map->free_blocks++;
+            }
+        }
+
+        uint32_t link = group[0];
+
+        if (link == 0) {
+            break;
+        }
+
+        // A link back into the list would loop forever.
+        if (!mark_free(*map, link)) {
+            map->chain_truncated = true;
+            break;
+        }
+
+        map->free_blocks++;
+        map->chain.push_back(link);
+
+        BlockCache::Block block = cache_->get(link);
+        nfree = be32(block.get());
+
+        for (int i = 0; i < NICFREE; i++) {
+            group[i] = be32(block.get() + 4 + (i * 4));
+        }
+    }
+
+    const InodeTable &table = load_inode_table();
+    map->inodes = Bitmap(table.count + 1);
+
+    // Inodes below the root are reserved and never handed out, even
+    // when they look unused.
+    for (uint32_t i = 1; i <= table.count; i++) {
+        if (table.mode[i] != 0 || i < ROOT_INODE) {
+            map->inodes.set(i);
+        } else {
+            map->free_inodes++;
+        }
+    }
+
+    allocation_map_ = std::move(map);
+
+    return *allocation_map_;
+}
+
+//
+// Clear one block in the map. Returns false, and counts the damage, if
+// the address isn't a data block or is already free.
+//
+const bool FileLoader::mark_free(AllocationMap &map, uint32_t addr)
+{
+    if (addr < superblock_.s_isize || addr >= superblock_.s_fsize) {
+        map.bad_free++;
+        return false;
+    }
 
-    // Now load the root's directory entries.
-    int block_count = (int) ceil(root_.inode.di_size / (float) block_size_);
-    int entry_count =  root_.inode.di_size / DIRENTRY_SIZE;
-    int entries_per_block =  block_size_ / DIRENTRY_SIZE;
+    if (!map.blocks.test(addr)) {
+        map.duplicate_free++;
+        return false;
+    }
 
-    std::cout << " [DBG] Root contains " << std::dec << entry_count << " entries" << std::endl;
-    std::cout << " [DBG] Root is " << block_count << " block(s) long" << std::endl;
-    std::cout << " [DBG] Each block contains at most " << entries_per_block << " entries." << std::endl;
+    map.blocks.clear(addr);
 
-    // TODO: Support for root directories with more than 10 blocks.
-    if (block_count > 10) {
+    return true;
+}
+
+const void FileLoader::read_root()
+{
+    Trace::Scope scope(Trace::READ_ROOT);
+
+    if (index_) {
+        root_ = index_fileentry(0);
+    } else {
+        root_ = read_fileentry("/", ROOT_INODE);
+    }
+
+    if (!root_->is_dir) {
+        std::cerr << "Root inode is not a directory!" << std::endl;
         throw std::exception();
     }
-    
-    for (int block_num = 0; block_num < block_count; block_num++) {
-        int addr = disk_addr(root_.inode.di_addr + (block_num * 3));
-        int offset = 0x2400 + (addr * block_size_);
-        int entries_this_block = 0;
-
-        // How many entries are in _this_ block?
-        // We know the total number of entries in the root inode is
-        // "entry_count", and we know that each block can contain up
-        // to "entries_per_block" entries.
-        if (block_num == block_count - 1) {
-            entries_this_block = entry_count % entries_per_block;
+}
+
+const void FileLoader::print_root()
+{
+    const FileEntry::List &entries = root_->dir_entries();
+
+    std::cout << " [DBG] Root contains " << std::dec << entries.size() << " entries" << std::endl;
+
+    if (index_) {
+        std::cout << " [DBG] Root loaded from index" << std::endl;
+    } else {
+        std::vector<uint32_t> blocks = block_list(root_->inode);
+
+        std::cout << " [DBG] Root is " << blocks.size() << " block(s) long" << std::endl;
+
+        for (size_t block_num = 0; block_num < blocks.size(); block_num++) {
+            std::cout << " [DBG] Root block #" << block_num << " address is " <<
+                blocks[block_num] << std::endl;
+        }
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const FileEntry::Ptr &f = entries[i];
+
+        std::cout << std::setfill(' ');
+        std::cout << " [DBG]  ";
+        std::cout << std::setw(3) << std::dec << f->inode_num << " ";
+        std::cout << std::setw(14) << f->name << " ";
+        std::cout << std::setw(2) << f->file_type << " ";
+        std::cout << std::setw(4) << std::setfill('0') << std::oct << f->mode;
+        std::cout << std::endl;
+    }
+}
+
+const FileEntry::List FileLoader::read_dir(const FileEntry &dir)
+{
+    Trace::Scope scope(Trace::READ_DIR);
+    Trace::count(Trace::DIRS_READ);
+
+    std::vector<FileEntry::Ptr> entries;
+
+    if (index_ && dir.index_entry != Index::NONE) {
+        const Index::Entry &e = index_->entry(dir.index_entry);
+
+        if (e.first_child != Index::NONE) {
+            for (uint32_t i = 0; i < e.child_count; i++) {
+                FileEntry::Ptr f = index_fileentry(e.first_child + i);
+
+                if (usable_name(f->name)) {
+                    entries.push_back(f);
+                }
+            }
+        }
+
+        FileEntry::Ptr *list = arena_.make_array<FileEntry::Ptr>(entries.size());
+        std::copy(entries.begin(), entries.end(), list);
+
+        return FileEntry::List(list, entries.size());
+    }
+
+    return (this->*decode_->read_dir)(dir);
+}
+
+template <int BS>
+const FileEntry::List FileLoader::read_dir_as(const FileEntry &dir)
+{
+    typedef Geometry<BS> G;
+
+    std::vector<FileEntry::Ptr> entries;
+    std::vector<uint32_t> blocks = block_list(dir.inode);
+
+    // Ask for every block of the directory at once, rather than one
+    // at a time as the entries are reached.
+    cache_->prefetch(blocks);
+
+    uint32_t entry_count = dir.inode.di_size / DIRENTRY_SIZE;
+
+    // The names come first, so the inodes they point at can all be
+    // asked for together before any is decoded.
+    std::vector<std::pair<std::string_view, uint16_t> > names;
+    std::vector<uint32_t> inode_blocks;
+
+    for (size_t block_num = 0; block_num < blocks.size() && entry_count > 0; block_num++) {
+        uint32_t entries_this_block = std::min(entry_count, G::DIRENTS_PER_BLOCK);
+        entry_count -= entries_this_block;
+
+        // A hole in a directory reads as empty entries.
+        if (blocks[block_num] == 0) {
+            continue;
+        }
+
+        // The whole block comes in at once; each entry is then just
+        // an offset into it.
+        BlockCache::Block block = cache_->get(blocks[block_num]);
+
+        for (uint32_t i = 0; i < entries_this_block; i++) {
+            DentryView entry(block.get() + (i * DentryView::SIZE));
+            uint16_t d_inum = entry.inum();
+            std::string_view d_name = entry.name();
+
+            // Unused slots have an inode number of zero.
+            if (d_inum == 0 || d_name == "." || d_name == "..") {
+                continue;
+            }
+
+            if (!usable_name(d_name)) {
+                std::cerr << "Bad name \"" << d_name << "\" in directory inode " <<
+                    dir.inode_num << "; skipped" << std::endl;
+                continue;
+            }
+
+            names.push_back(std::make_pair(names_.intern(d_name), d_inum));
+            inode_blocks.push_back(G::inode_block(d_inum));
+        }
+    }
+
+    cache_->prefetch(inode_blocks);
+
+    for (size_t i = 0; i < names.size(); i++) {
+        entries.push_back(read_fileentry(names[i].first, names[i].second));
+    }
+
+    Trace::count(Trace::DIR_ENTRIES, entries.size());
+
+    // Move the list into the arena alongside the entries themselves.
+    FileEntry::Ptr *list = arena_.make_array<FileEntry::Ptr>(entries.size());
+    std::copy(entries.begin(), entries.end(), list);
+
+    return FileEntry::List(list, entries.size());
+}
+
+const std::vector<uint32_t> FileLoader::block_list(const struct dinode &inode)
+{
+    uint32_t addrs[NADDR];
+
+    for (int i = 0; i < NADDR; i++) {
+        addrs[i] = disk_addr(inode.di_addr + (i * 3));
+    }
+
+    return block_list(addrs, inode.di_size);
+}
+
+const std::vector<uint32_t> FileLoader::block_list(const uint32_t *addrs, uint32_t size,
+                                                   std::vector<uint32_t> *indirect)
+{
+    return (this->*decode_->block_list)(addrs, size, indirect);
+}
+
+template <int BS>
+const std::vector<uint32_t> FileLoader::block_list_as(const uint32_t *addrs, uint32_t size,
+                                                      std::vector<uint32_t> *indirect)
+{
+    std::vector<uint32_t> blocks;
+    uint32_t remaining = Geometry<BS>::blocks_for(size);
+
+    blocks.reserve(remaining);
+
+    for (int i = 0; i < NADDR_DIRECT && remaining > 0; i++, remaining--) {
+        blocks.push_back(addrs[i]);
+    }
+
+    for (int level = 1; level <= NADDR - NADDR_DIRECT && remaining > 0; level++) {
+        read_indirect<BS>(addrs[NADDR_DIRECT + level - 1], level, remaining, blocks, indirect);
+    }
+
+    return blocks;
+}
+
+//
+// Append the addresses found under an indirect block. `level` is 1 for
+// a single indirect block, 2 for double and 3 for triple indirect.
+//
+template <int BS>
+const void FileLoader::read_indirect(uint32_t addr, int level, uint32_t &remaining,
+                                     std::vector<uint32_t> &blocks,
+                                     std::vector<uint32_t> *indirect)
+{
+    typedef Geometry<BS> G;
+
+    if (addr == 0) {
+        // The whole range is a hole.
+        uint32_t n = (uint32_t) std::min<uint64_t>(G::indirect_span(level), remaining);
+        blocks.insert(blocks.end(), n, 0);
+        remaining -= n;
+        return;
+    }
+
+    if (indirect != nullptr) {
+        indirect->push_back(addr);
+    }
+
+    BlockCache::Block block = cache_->get(addr);
+
+    for (uint32_t i = 0; i < G::ADDRS_PER_BLOCK && remaining > 0; i++) {
+        uint32_t next = be32(block.get() + (i * 4));
+
+        if (level == 1) {
+            blocks.push_back(next);
+            remaining--;
         } else {
-            entries_this_block = entries_per_block;
+            read_indirect<BS>(next, level - 1, remaining, blocks, indirect);
         }
+    }
+}
 
-        std::cout << " [DBG] Root block #" << block_num << " address is " <<
-            addr << std::endl;
-        std::cout << " [DBG] Root block #" << block_num << " offset is 0x" <<
-            std::hex << offset << std::endl;
+const std::vector<Extent> FileLoader::extents(const struct dinode &inode)
+{
+    std::vector<uint32_t> blocks = block_list(inode);
+    std::vector<Extent> runs;
 
-        // Read in the file names!
-        for (int i =  0; i < entries_this_block; i++) {
-            // Read in the direntry.
-            struct dentry entry;
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+        if (!runs.empty()) {
+            Extent &last = runs.back();
+            bool hole = blocks[i] == 0;
 
-            file.open(file_name_.c_str(), std::ifstream::in | std::ifstream::binary);
-            file.seekg(offset + (i * sizeof(struct dentry)), file.beg);
-    
-            if ((file.rdstate() & std::ifstream::eofbit) != 0) {
-                std::cerr << "Failed to read directory entry." << std::endl;
-                throw std::exception();
+            // Holes merge with holes, and data with the block that
+            // physically follows the end of the run.
+            if ((hole && last.addr == 0) ||
+                (!hole && last.addr != 0 && blocks[i] == last.addr + last.count)) {
+                last.count++;
+                continue;
             }
-            
-            file.read(reinterpret_cast<char *>(&entry), sizeof(struct dentry));
-            file.close();
+        }
+
+        Extent e;
+        e.file_block = i;
+        e.addr = blocks[i];
+        e.count = 1;
+        runs.push_back(e);
+    }
+
+    return runs;
+}
+
+const std::vector<Extent> FileLoader::extents(const FileEntry &file)
+{
+    if (index_ && file.index_entry != Index::NONE) {
+        const Index::Inode &r = index_->inode(index_->entry(file.index_entry).inode);
+        const Index::Extent *x = index_->extents(r);
+        std::vector<Extent> runs(r.extent_count);
+
+        for (uint32_t i = 0; i < r.extent_count; i++) {
+            runs[i].file_block = x[i].file_block;
+            runs[i].addr = x[i].addr;
+            runs[i].count = x[i].count;
+        }
+
+        return runs;
+    }
+
+    return extents(file.inode);
+}
+
+const size_t FileLoader::read_data(const struct dinode &inode,
+                                   const std::vector<Extent> &extents,
+                                   uint64_t offset, uint8_t *buf, size_t len)
+{
+    Trace::Scope scope(Trace::READ_DATA);
+
+    return (this->*decode_->read_data)(inode, extents, offset, buf, len);
+}
+
+template <int BS>
+const size_t FileLoader::read_data_as(const struct dinode &inode,
+                                      const std::vector<Extent> &extents,
+                                      uint64_t offset, uint8_t *buf, size_t len)
+{
+    typedef Geometry<BS> G;
+
+    if (offset >= inode.di_size) {
+        return 0;
+    }
+
+    if (len > inode.di_size - offset) {
+        len = (size_t) (inode.di_size - offset);
+    }
+
+    // Find the extent holding `offset`.
+    uint32_t first_block = G::block_of(offset);
+    size_t lo = 0, hi = extents.size();
+
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (extents[mid].file_block <= first_block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t done = 0;
+
+    for (size_t i = lo; i < extents.size() && done < len; i++) {
+        const Extent &e = extents[i];
+        uint64_t start = G::offset_of(e.file_block);
+        uint64_t end = start + G::offset_of(e.count);
+        uint64_t pos = offset + done;
+
+        if (pos >= end) {
+            continue;
+        }
+
+        size_t n = (size_t) std::min<uint64_t>(end - pos, len - done);
+
+        if (e.addr == 0) {
+            // Holes read back as zeroes.
+            memset(buf + done, 0, n);
+        } else {
+            image_->read(options_.base + G::offset_of(e.addr) + (pos - start),
+                         buf + done, n);
+        }
+
+        done += n;
+    }
+
+    // A block list shorter than di_size leaves the tail unbacked.
+    if (done < len) {
+        memset(buf + done, 0, len - done);
+    }
+
+    return len;
+}
+
+const FileEntry::Ptr FileLoader::lookup(const std::string &path)
+{
+    std::call_once(dentries_made_, [this]() {
+        dentries_.reset(new DentryCache());
+    });
+
+    FileEntry::Ptr f = root_;
+    size_t pos = 0;
+
+    // Directory entries for ".." aren't kept, so going up needs the
+    // directories passed through on the way down. Only paths that
+    // might go up keep them.
+    bool may_go_up = path.find("..") != std::string::npos;
+    std::vector<FileEntry::Ptr> parents;
+
+    while (f != nullptr && pos < path.size()) {
+        size_t end = path.find('/', pos);
+
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+
+        std::string_view component(path.data() + pos, end - pos);
+        pos = end + 1;
 
-            // Create the FileEntry object
-            FileEntry::Ptr f = read_fileentry(entry.d_name, eswap16(entry.d_inum));
+        if (component.empty() || component == ".") {
+            continue;
+        }
 
-            std::cout << std::setfill(' ');
-            std::cout << " [DBG]  ";
-            std::cout << std::setw(3) << std::dec << f->inode_num << " ";
-            std::cout << std::setw(14) << f->name << " ";
-            std::cout << std::setw(2) << f->file_type << " ";
-            std::cout << std::setw(4) << std::setfill('0') << std::oct << f->mode;
+        if (!f->is_dir || component.size() > NameKey::MAX_NAME) {
+            return nullptr;
+        }
 
+        // The root is its own parent.
+        if (component == "..") {
+            if (!parents.empty()) {
+                f = parents.back();
+                parents.pop_back();
+            }
+            continue;
+        }
 
-            std::cout << std::endl;
+        if (may_go_up) {
+            parents.push_back(f);
         }
+
+        NameKey key(component);
+        FileEntry::Ptr next;
+
+        if (!dentries_->get(f->inode_num, key, next)) {
+            next = f->find(key);
+            dentries_->put(f->inode_num, key, next);
+        }
+
+        f = next;
     }
+
+    return f;
 }
 
+const void FileLoader::hash_dir(const FileEntry::List &entries, DirHash &hash)
+{
+    hash.build(arena_, entries.begin(), entries.size());
+}
+
+const uint32_t FileLoader::walk(const Visitor &visit)
+{
+    Trace::Scope scope(Trace::WALK);
+    std::vector<uint32_t> parents;
+    return walk_dir("", root_, parents, visit);
+}
+
+const uint32_t FileLoader::walk_dir(const std::string &path, const FileEntry::Ptr &dir,
+                                    std::vector<uint32_t> &parents, const Visitor &visit)
+{
+    // A damaged filesystem can link a directory into its own subtree.
+    if (std::find(parents.begin(), parents.end(), dir->inode_num) != parents.end()) {
+        std::cerr << "Directory loop at " << path << "; not descending." << std::endl;
+        return 0;
+    }
+
+    FileEntry::List entries;
+
+    try {
+        entries = dir->dir_entries();
+    } catch (std::exception &e) {
+        std::cerr << "Unable to read " << (path.empty() ? "/" : path) << std::endl;
+        return 1;
+    }
+
+    parents.push_back(dir->inode_num);
+
+    // Fetch the first blocks of every subdirectory together, ahead of
+    // descending into them one by one.
+    if (!index_) {
+        std::vector<uint32_t> blocks;
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!entries[i]->is_dir) {
+                continue;
+            }
+
+            const struct dinode &inode = entries[i]->inode;
+            uint32_t count = (uint32_t) ((inode.di_size + block_size_ - 1) / block_size_);
+
+            for (int j = 0; j < NADDR_DIRECT && (uint32_t) j < count; j++) {
+                blocks.push_back(disk_addr(inode.di_addr + (j * 3)));
+            }
+        }
+
+        cache_->prefetch(blocks);
+    }
+
+    uint32_t unreadable = 0;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::string child_path = path + "/";
+        child_path.append(entries[i]->name);
+
+        visit(child_path, entries[i]);
+
+        if (entries[i]->is_dir) {
+            unreadable += walk_dir(child_path, entries[i], parents, visit);
+        }
+    }
+
+    parents.pop_back();
+
+    return unreadable;
+}
 
-const FileEntry::Ptr FileLoader::read_fileentry(std::string name, uint32_t inode_num)
+const FileEntry::Ptr FileLoader::read_fileentry(std::string_view name, uint32_t inode_num)
 {
-    FileEntry::Ptr file_entry = std::make_shared<FileEntry>(name, inode_num);
+    FileEntry::Ptr file_entry = arena_.make<FileEntry>(this, name, inode_num);
 
     read_inode(file_entry->inode, inode_num);
 
     file_entry->file_type = (0xf000 & file_entry->inode.di_mode) >> 12;
     file_entry->mode = 0x0fff & file_entry->inode.di_mode;
-    file_entry->is_dir = file_entry->file_type == 8;
+    file_entry->is_dir = file_entry->file_type == FileEntry::FT_DIR;
     
     return file_entry;
 }
 
+//
+// Make a FileEntry from entry `entry_num` of the sidecar index. The
+// name points into the index itself.
+//
+const FileEntry::Ptr FileLoader::index_fileentry(uint32_t entry_num)
+{
+    const Index::Entry &e = index_->entry(entry_num);
+    const Index::Inode &r = index_->inode(e.inode);
+
+    FileEntry::Ptr file_entry = arena_.make<FileEntry>(this, index_->name(e), r.inum);
+
+    file_entry->index_entry = entry_num;
+    file_entry->inode.di_mode = r.mode;
+    file_entry->inode.di_nlink = r.nlink;
+    file_entry->inode.di_uid = r.uid;
+    file_entry->inode.di_gid = r.gid;
+    file_entry->inode.di_size = r.size;
+    file_entry->inode.di_atime = r.atime;
+    file_entry->inode.di_mtime = r.mtime;
+    file_entry->inode.di_ctime = r.ctime;
+
+    file_entry->file_type = (0xf000 & r.mode) >> 12;
+    file_entry->mode = 0x0fff & r.mode;
+    file_entry->is_dir = file_entry->file_type == FileEntry::FT_DIR;
+
+    return file_entry;
+}
+
 const void FileLoader::print_superblock() const
 {
     char time_str[100];
@@ -246,61 +967,133 @@ const void FileLoader::print_superblock() const
     std::cout << "  Free blocks: " << superblock_.s_nfree << std::endl;
     std::cout << "  File System Type: " << superblock_.s_type << std::endl;
     std::cout << "  File System State: " << std::hex << superblock_.s_state << std::endl;
-    std::cout << "  File System Name: " << superblock_.s_fname << std::endl;
+    std::cout << "  File System Name: " <<
+        std::string_view(superblock_.s_fname, strnlen(superblock_.s_fname, sizeof(superblock_.s_fname)))
+              << std::endl;
     std::cout << "  Last Superblock Update Time: " << time_str << std::endl;
 }
 
-const uint32_t FileLoader::eswap32(const uint32_t val) const
+const void FileLoader::print_inodes()
 {
-    return (((val & 0x000000ff) << 24) |
-            ((val & 0x0000ff00) << 8) |
-            ((val & 0x00ff0000) >> 8) |
-            ((val & 0xff000000) >> 24));
+    const InodeTable &table = load_inode_table();
+
+    std::cout << "INODES" << std::endl;
+    std::cout << "------" << std::endl;
+
+    for (uint32_t i = 1; i <= table.count; i++) {
+        if (table.mode[i] == 0) {
+            continue;
+        }
+
+        time_t t = (time_t) table.mtime[i];
+        char time_str[100];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
+
+        std::cout << std::setfill(' ') << std::dec;
+        std::cout << "  " << std::setw(5) << i << " ";
+        std::cout << std::setw(6) << std::setfill('0') << std::oct << table.mode[i];
+        std::cout << std::setfill(' ') << std::dec;
+        std::cout << " " << std::setw(3) << table.nlink[i];
+        std::cout << " " << std::setw(5) << table.uid[i];
+        std::cout << " " << std::setw(5) << table.gid[i];
+        std::cout << " " << std::setw(10) << table.size[i];
+        std::cout << " " << time_str << std::endl;
+    }
 }
 
-const uint16_t FileLoader::eswap16(const uint16_t val) const
+const void FileLoader::print_free_space()
 {
-    return (((val & 0x00ff) << 8) |
-            ((val & 0xff00) >> 8));
+    const AllocationMap &map = load_allocation_map();
+
+    std::cout << "FREE SPACE" << std::endl;
+    std::cout << "----------" << std::endl;
+    std::cout << "  Free blocks: " << std::dec << map.free_blocks <<
+        " (superblock says " << superblock_.s_tfree << ")" << std::endl;
+    std::cout << "  Free list blocks: " << map.chain.size() << std::endl;
+    std::cout << "  Used blocks: " << map.blocks.count() << " of " <<
+        superblock_.s_fsize << std::endl;
+    std::cout << "  Free inodes: " << map.free_inodes <<
+        " (superblock says " << superblock_.s_tinode << ")" << std::endl;
+    std::cout << "  Used inodes: " << map.inodes.count() << " of " <<
+        (map.inodes.size() - 1) << std::endl;
+
+    if (map.duplicate_free > 0) {
+        std::cout << "  Duplicate free list entries: " << map.duplicate_free << std::endl;
+    }
+
+    if (map.bad_free > 0) {
+        std::cout << "  Out of range free list entries: " << map.bad_free << std::endl;
+    }
+
+    if (map.chain_truncated) {
+        std::cout << "  Free list chain is damaged; stopped early" << std::endl;
+    }
 }
 
-const uint32_t FileLoader::disk_addr(uint8_t *buf) const
+const void FileLoader::print_tree()
 {
-    return buf[0] << 12 | buf[1] << 8 | buf[2];
+    std::cout << "FILES" << std::endl;
+    std::cout << "-----" << std::endl;
+
+    walk([](const std::string &path, const FileEntry::Ptr &f) {
+        std::cout << std::setfill(' ') << std::dec;
+        std::cout << "  " << std::setw(5) << f->inode_num << " ";
+        std::cout << std::setw(6) << std::setfill('0') << std::oct << f->inode.di_mode;
+        std::cout << std::setfill(' ') << std::dec;
+        std::cout << " " << std::setw(3) << f->inode.di_nlink;
+        std::cout << " " << std::setw(10) << f->inode.di_size;
+        std::cout << " " << path << std::endl;
+    });
 }
 
+const size_t FileLoader::memory_used() const
+{
+    size_t bytes = arena_.bytes_allocated();
 
+    if (image_->mapped()) {
+        bytes += image_->size();
+    } else {
+        bytes += cache_->capacity() * block_size_;
+    }
 
-}; // namespace
+    if (inode_table_) {
+        const InodeTable &t = *inode_table_;
+        bytes += (t.mode.capacity() + t.nlink.capacity() + t.uid.capacity() +
+                  t.gid.capacity()) * sizeof(uint16_t);
+        bytes += (t.size.capacity() + t.atime.capacity() + t.mtime.capacity() +
+                  t.ctime.capacity() + t.addr.capacity()) * sizeof(uint32_t);
+    }
 
-using namespace std;
-using namespace loomcom;
+    return bytes;
+}
 
-void usage() {
-    cerr << "Usage: imgread <file>" << endl;
+const void FileLoader::print_memory_stats() const
+{
+    std::cout << "MEMORY" << std::endl;
+    std::cout << "------" << std::endl;
+    std::cout << "  Arena bytes: " << std::dec << arena_.bytes_allocated() << std::endl;
+    std::cout << "  Arena chunks: " << arena_.chunk_count() << std::endl;
+    std::cout << "  Distinct names: " << names_.size() << std::endl;
 }
 
-int main(int argc, char ** argv) {
-    
-    // First argument is the file name.
-    if (argc < 2) {
-        usage();
-        return 1;
+const void FileLoader::print_cache_stats() const
+{
+    if (cache_) {
+        cache_->print_stats();
     }
 
-    char *name = argv[1];
-
-    // If the first arg isn't a file, die.
-    struct stat s;
-    stat(name, &s);
-
-    if (!S_ISREG(s.st_mode)) {
-        usage();
-        return 1;
+    if (dentries_) {
+        dentries_->print_stats();
     }
 
-    FileLoader file_loader(name);
-    file_loader.load();
+    if (image_) {
+        image_->print_stats();
+    }
+}
 
-    return 0;
+const uint32_t FileLoader::disk_addr(const uint8_t *buf) const
+{
+    return be24(buf);
 }
+
+}; // namespace
@@ -1,18 +1,33 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <fstream>
+#include <string_view>
 #include <sys/stat.h>
 
+#include "image.hh"
+#include "cache.hh"
+#include "bswap.hh"
+#include "arena.hh"
+#include "index.hh"
+#include "bitmap.hh"
+#include "trace.hh"
+#include "namei.hh"
+#include "ondisk.hh"
+
 #include <stdio.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 namespace loomcom {
@@ -62,6 +77,57 @@ struct dinode
     uint32_t di_ctime;       // Time created
 };
 
+//
+// The whole i-list, decoded into one array per field and indexed by
+// inode number. Inode numbers start at 1, so slot 0 is always empty.
+//
+struct InodeTable {
+    const static int ADDRS_PER_INODE = 13;
+
+    InodeTable() : count(0) {}
+
+    // The 13 block addresses from di_addr of inode `i`.
+    const uint32_t *addrs(uint32_t i) const
+    {
+        return &addr[i * ADDRS_PER_INODE];
+    }
+
+    uint32_t count;                 // Number of inodes
+    std::vector<uint16_t> mode;
+    std::vector<uint16_t> nlink;
+    std::vector<uint16_t> uid;
+    std::vector<uint16_t> gid;
+    std::vector<uint32_t> size;
+    std::vector<uint32_t> atime;
+    std::vector<uint32_t> mtime;
+    std::vector<uint32_t> ctime;
+    std::vector<uint32_t> addr;
+};
+
+//
+// Which blocks and inodes are in use, as found by following the free
+// block chain and scanning the i-list. A set bit means allocated.
+//
+struct AllocationMap {
+    AllocationMap() : free_blocks(0), free_inodes(0),
+                      duplicate_free(0), bad_free(0), chain_truncated(false) {}
+
+    Bitmap blocks;              // One bit per block of s_fsize
+    Bitmap inodes;              // One bit per inode, indexed by inode number
+
+    // Blocks holding the free list after the superblock's own group,
+    // in chain order. They are free, but their contents matter.
+    std::vector<uint32_t> chain;
+
+    uint32_t free_blocks;       // Counting the chain blocks themselves
+    uint32_t free_inodes;
+
+    // Damage found while following the free list
+    uint32_t duplicate_free;    // Blocks on the list more than once
+    uint32_t bad_free;          // Addresses outside the data area
+    bool chain_truncated;       // The chain ended at a bad block
+};
+
 //
 // On-disk structure of a directory entry.
 //
@@ -70,25 +136,79 @@ struct dentry {
     char     d_name[14];     // Name
 };
 
+//
+// A run of file blocks that sit next to each other on disk. An extent
+// with an address of zero is a hole.
+//
+struct Extent {
+    uint32_t file_block;     // First block of the run within the file
+    uint32_t addr;           // Disk address of that block
+    uint32_t count;          // Number of blocks in the run
+};
+
+class FileLoader;
+
+//
+// A file in the filesystem. FileEntries and their names live in the
+// arena of the FileLoader that made them, and are only valid for as
+// long as that loader is.
+//
 class FileEntry {
 public:
-    typedef std::shared_ptr<FileEntry> Ptr;
-    
-    FileEntry(const std::string name, uint32_t inode_num);
-    ~FileEntry();
-    
-    const std::vector<dentry> &dir_entries() const;
+    typedef FileEntry *Ptr;
+
+    // A directory's entries, as laid out in the arena
+    class List {
+    public:
+        List() : data_(nullptr), size_(0) {}
+        List(Ptr const *data, size_t size) : data_(data), size_(size) {}
+
+        Ptr const *begin() const { return data_; }
+        Ptr const *end() const { return data_ + size_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const Ptr &operator[](size_t i) const { return data_[i]; }
+
+    private:
+        Ptr const *data_;
+        size_t size_;
+    };
+
+    // File types, from the top four bits of di_mode
+    const static int FT_FIFO = 1;
+    const static int FT_CHR = 2;
+    const static int FT_DIR = 4;
+    const static int FT_BLK = 6;
+    const static int FT_REG = 8;
+
+    FileEntry(FileLoader *loader, std::string_view name, uint32_t inode_num);
+
+    // The entries of this directory, not counting "." and "..". They
+    // are read from the image the first time they are asked for.
+    const List &dir_entries() const;
+
+    // The entry of this directory called `name`, or nullptr. Larger
+    // directories are hashed by name the first time they're searched.
+    const Ptr find(std::string_view name) const;
+    const Ptr find(const NameKey &key) const;
 
     bool is_dir;
     struct dinode inode;
 
     // File attributes
-    std::string name;
+    std::string_view name;
     int file_type;
     int mode;
     uint32_t inode_num;
+
+    // Where this file came from in the sidecar index, if it did
+    uint32_t index_entry;
 private:
-    const std::vector<dentry> dir_entries_;
+    FileLoader *loader_;
+    mutable std::once_flag dir_loaded_;
+    mutable List dir_entries_;
+    mutable std::once_flag hash_built_;
+    mutable DirHash hash_;
 };
 
 //
@@ -96,41 +216,206 @@ private:
 //
 class FileLoader {
 public:
-    const static int SUPERBLOCK_OFFSET = 0x2600;
+    // Where the filesystem starts in an image without a VTOC. The
+    // superblock is the second 512-byte sector of any filesystem.
+    const static int DATA_OFFSET = 0x2400;
+    const static int SUPERBLOCK_OFFSET = 512;
 
     const static unsigned int FS_MAGIC = 0xfd187e20;
 
     const static int DIRENTRY_SIZE = 16;
     const static int INODE_SIZE = 64;
+
+    const static uint32_t ROOT_INODE = 2;
+
+    // di_addr holds 10 direct block addresses, then one single, one
+    // double and one triple indirect block address.
+    const static int NADDR_DIRECT = 10;
+    const static int NADDR = 13;
+
+    // Addresses per free list block, and in the superblock's s_free.
+    const static int NICFREE = 50;
+
+    typedef std::function<void(const std::string &path,
+                               const FileEntry::Ptr &entry)> Visitor;
     
-    FileLoader(const std::string file_name);
+    struct Options {
+        Options() : use_mmap(true), cache_blocks(1024), readahead(8),
+                    io_depth(16), io_uring(true),
+                    use_index(true),
+                    base(DATA_OFFSET), partition(-1) {}
+
+        bool use_mmap;          // Map the image rather than pread it
+        size_t cache_blocks;    // Block cache capacity, in blocks
+        unsigned readahead;     // Blocks to read ahead on sequential access
+        unsigned io_depth;      // Asynchronous reads in flight; 0 for none
+        bool io_uring;          // Use io_uring for them, not pread threads
+        bool use_index;         // Use a valid sidecar index if there is one
+        uint64_t base;          // Byte offset of the filesystem in the image
+        int partition;          // VTOC partition at `base`, or -1
+    };
+
+    FileLoader(const std::string file_name, const Options &options = Options());
+
+    // Load a filesystem out of an image that is already open. Several
+    // loaders can share one image, e.g. one per partition.
+    FileLoader(ImageSource::Ptr image, const Options &options = Options());
     ~FileLoader();
 
     const void load();
+    const InodeTable &load_inode_table();
+    const AllocationMap &load_allocation_map();
+
+    const FileEntry::Ptr &root() const { return root_; }
+
+    uint32_t block_size() const { return block_size_; }
+    uint64_t base() const { return options_.base; }
+    const Options &options() const { return options_; }
+    uint64_t image_size() const { return image_->size(); }
+    const ImageSource::Ptr &image() const { return image_; }
+    uint64_t superblock_hash() const { return superblock_hash_; }
+
+    // True if the tree is coming from a sidecar index.
+    bool indexed() const { return (bool) index_; }
+
+    // Write a sidecar index for this image.
+    const void write_index();
+
+    // Find a file by absolute path, or return nullptr. "." and ".."
+    // mean what they do on the host, and the root is its own parent.
+    // Every step is remembered in the dentry cache, hits and misses
+    // alike.
+    const FileEntry::Ptr lookup(const std::string &path);
+
+    // Visit every file below the root, depth first. Directories are
+    // visited before their contents. A directory that can't be read is
+    // reported and passed over, and the rest walked; returns how many
+    // there were.
+    const uint32_t walk(const Visitor &visit);
+
+    // The data block addresses of a file, in order. Holes in sparse
+    // files come back as zero.
+    const std::vector<uint32_t> block_list(const struct dinode &inode);
+
+    // The same, from NADDR already decoded addresses such as an
+    // InodeTable row. If `indirect` is given, the indirect blocks
+    // walked along the way are appended to it.
+    const std::vector<uint32_t> block_list(const uint32_t *addrs, uint32_t size,
+                                           std::vector<uint32_t> *indirect = nullptr);
+
+    // The block list of a file, merged into runs of physically
+    // contiguous blocks.
+    const std::vector<Extent> extents(const struct dinode &inode);
+    const std::vector<Extent> extents(const FileEntry &file);
+
+    // Copy up to `len` bytes of file data starting at `offset` into
+    // `buf`, given the file's extents. Each extent touched costs one
+    // read. Returns the number of bytes copied, which is short only at
+    // the end of the file.
+    const size_t read_data(const struct dinode &inode,
+                           const std::vector<Extent> &extents,
+                           uint64_t offset, uint8_t *buf, size_t len);
+
+    // Filesystem block `blkno`, through the block cache.
+    BlockCache::Block block(uint32_t blkno) { return cache_->get(blkno); }
+
+    const struct superblock &superblock() const { return superblock_; }
+
+    // Read the entries of a directory, and hash them by name.
+    // FileEntry calls these lazily.
+    const FileEntry::List read_dir(const FileEntry &dir);
+    const void hash_dir(const FileEntry::List &entries, DirHash &hash);
+
+    // Roughly how much memory the loader holds: the mapping of the
+    // image, or else its block cache, and its decoded i-list and file
+    // entries. Not to be called while load_inode_table() might be
+    // running.
+    const size_t memory_used() const;
+
     const void print_superblock() const;
-    const void print_inodes() const;
+    const void print_root();
+    const void print_inodes();
+    const void print_free_space();
+    const void print_tree();
+    const void print_memory_stats() const;
+    const void print_cache_stats() const;
 private:
-    const uint32_t eswap32(const uint32_t val) const;
-    const uint16_t eswap16(const uint16_t val) const;
-    const uint32_t disk_addr(uint8_t *buf) const;
+    // The decode paths, each compiled once per block size so that the
+    // block arithmetic in them is constant. read_superblock() picks a
+    // set to match the filesystem and the public calls go through it.
+    struct Decoders {
+        const void (FileLoader::*read_inode)(struct dinode &inode, const uint32_t inode_num);
+        const FileEntry::List (FileLoader::*read_dir)(const FileEntry &dir);
+        const std::vector<uint32_t> (FileLoader::*block_list)(const uint32_t *addrs,
+                                                              uint32_t size,
+                                                              std::vector<uint32_t> *indirect);
+        const size_t (FileLoader::*read_data)(const struct dinode &inode,
+                                              const std::vector<Extent> &extents,
+                                              uint64_t offset, uint8_t *buf, size_t len);
+    };
+
+    template <int BS> static const Decoders &decoders();
+    template <int BS> const void read_inode_as(struct dinode &inode, const uint32_t inode_num);
+    template <int BS> const FileEntry::List read_dir_as(const FileEntry &dir);
+    template <int BS> const std::vector<uint32_t> block_list_as(const uint32_t *addrs,
+                                                                uint32_t size,
+                                                                std::vector<uint32_t> *indirect);
+    template <int BS> const size_t read_data_as(const struct dinode &inode,
+                                                const std::vector<Extent> &extents,
+                                                uint64_t offset, uint8_t *buf, size_t len);
+    template <int BS> const void read_indirect(uint32_t addr, int level, uint32_t &remaining,
+                                               std::vector<uint32_t> &blocks,
+                                               std::vector<uint32_t> *indirect);
+
+    const uint32_t eswap32(const uint32_t val) const { return bswap32(val); }
+    const uint16_t eswap16(const uint16_t val) const { return bswap16(val); }
+    const uint32_t disk_addr(const uint8_t *buf) const;
     const void read_superblock();
     const void read_root();
     const void read_inode(struct dinode &inode, const uint32_t inode_num);
-    const FileEntry::Ptr read_fileentry(std::string name, uint32_t inode_num);
+    const FileEntry::Ptr read_fileentry(std::string_view name, uint32_t inode_num);
+    const FileEntry::Ptr index_fileentry(uint32_t entry_num);
+    const uint32_t walk_dir(const std::string &path, const FileEntry::Ptr &dir,
+                            std::vector<uint32_t> &parents, const Visitor &visit);
+    const bool mark_free(AllocationMap &map, uint32_t addr);
     const std::string file_name_;
+    const Options options_;
+    ImageSource::Ptr image_;
+    std::unique_ptr<BlockCache> cache_;
+    const Decoders *decode_;
     uint16_t block_size_;
-    uint32_t inode_offset_;
+    uint64_t inode_offset_;
     uint32_t inodes_per_block_; // How many inodes per block of the
                                 // inode list
 
     // The superblock
     struct superblock superblock_;
+    uint64_t superblock_hash_;
     // Number of inode entries (superblock only gives us this in blocks)
     uint32_t num_inodes_;
     struct tm last_update_;
 
+    // The decoded i-list, once load_inode_table() has been called
+    std::unique_ptr<InodeTable> inode_table_;
+
+    // The free block and inode maps, once load_allocation_map() has
+    // been called
+    std::unique_ptr<AllocationMap> allocation_map_;
+
+    // The sidecar index, if there is a valid one
+    std::unique_ptr<Index> index_;
+
+    // FileEntries and their names. Declared before root_ so that it
+    // outlives everything pointing into it.
+    Arena arena_;
+    NameTable names_;
+
     // The root directory
-    FileEntry root_;
+    FileEntry::Ptr root_;
+
+    // Name lookups, made on the first lookup()
+    std::once_flag dentries_made_;
+    std::unique_ptr<DentryCache> dentries_;
 };
 
 }; // namespace
@@ -0,0 +1,281 @@
+#include "index.hh"
+#include "imgread.hh"
+
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <errno.h>
+
+namespace loomcom {
+
+static const char INDEX_MAGIC[8] = "3B2RIDX";
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t) 7;
+}
+
+std::string Index::path_for(const std::string &image_name, int partition)
+{
+    if (partition >= 0) {
+        return image_name + ".p" + std::to_string(partition) + ".idx";
+    }
+
+    return image_name + ".idx";
+}
+
+uint64_t Index::superblock_hash(const void *raw, size_t len, uint64_t image_size)
+{
+    // FNV-1a, 64 bit
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const uint8_t *p = static_cast<const uint8_t *>(raw);
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((image_size >> (i * 8)) & 0xff)) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+void Index::write(FileLoader &loader, const std::string &path)
+{
+    std::vector<Entry> entries;
+    std::vector<FileEntry::Ptr> order;
+    std::string names;
+    std::unordered_map<std::string_view, uint32_t> name_offsets;
+    std::map<uint32_t, FileEntry::Ptr> files;
+    std::unordered_set<uint32_t> expanded;
+
+    order.push_back(loader.root());
+
+    // Breadth first, so each directory's children land together.
+    for (size_t i = 0; i < order.size(); i++) {
+        FileEntry::Ptr f = order[i];
+
+        Entry e;
+        e.inode = f->inode_num;     // Fixed up to a record number below
+        e.first_child = NONE;
+        e.child_count = 0;
+
+        std::unordered_map<std::string_view, uint32_t>::iterator n = name_offsets.find(f->name);
+
+        if (n == name_offsets.end()) {
+            e.name_offset = (uint32_t) names.size();
+            names.append(f->name);
+            name_offsets[f->name] = e.name_offset;
+        } else {
+            e.name_offset = n->second;
+        }
+
+        e.name_length = (uint32_t) f->name.size();
+
+        // A directory linked in twice is only expanded once.
+        if (f->is_dir && expanded.insert(f->inode_num).second) {
+            const FileEntry::List &children = f->dir_entries();
+
+            e.first_child = (uint32_t) order.size();
+            e.child_count = (uint32_t) children.size();
+            order.insert(order.end(), children.begin(), children.end());
+        }
+
+        files[f->inode_num] = f;
+        entries.push_back(e);
+    }
+
+    std::vector<Inode> inodes;
+    std::vector<Index::Extent> extents;
+    std::unordered_map<uint32_t, uint32_t> records;
+
+    for (std::map<uint32_t, FileEntry::Ptr>::iterator it = files.begin(); it != files.end(); ++it) {
+        const FileEntry::Ptr f = it->second;
+
+        Inode r;
+        r.inum = f->inode_num;
+        r.mode = f->inode.di_mode;
+        r.nlink = f->inode.di_nlink;
+        r.uid = f->inode.di_uid;
+        r.gid = f->inode.di_gid;
+        r.size = f->inode.di_size;
+        r.atime = f->inode.di_atime;
+        r.mtime = f->inode.di_mtime;
+        r.ctime = f->inode.di_ctime;
+        r.first_extent = (uint32_t) extents.size();
+        r.extent_count = 0;
+
+        if (f->file_type == FileEntry::FT_REG) {
+            std::vector<loomcom::Extent> runs = loader.extents(*f);
+
+            for (size_t i = 0; i < runs.size(); i++) {
+                Index::Extent x;
+                x.file_block = runs[i].file_block;
+                x.addr = runs[i].addr;
+                x.count = runs[i].count;
+                extents.push_back(x);
+            }
+
+            r.extent_count = (uint32_t) runs.size();
+        }
+
+        records[r.inum] = (uint32_t) inodes.size();
+        inodes.push_back(r);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].inode = records[entries[i].inode];
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.image_size = loader.image_size();
+    h.superblock_hash = loader.superblock_hash();
+    h.block_size = loader.block_size();
+    h.entry_count = (uint32_t) entries.size();
+    h.inode_count = (uint32_t) inodes.size();
+    h.extent_count = (uint32_t) extents.size();
+    h.name_bytes = (uint32_t) names.size();
+    h.entries_offset = align8(sizeof(Header));
+    h.inodes_offset = align8(h.entries_offset + entries.size() * sizeof(Entry));
+    h.extents_offset = align8(h.inodes_offset + inodes.size() * sizeof(Inode));
+    h.names_offset = align8(h.extents_offset + extents.size() * sizeof(Index::Extent));
+
+    std::vector<uint8_t> out(h.names_offset + names.size());
+    memcpy(out.data(), &h, sizeof(h));
+    memcpy(out.data() + h.entries_offset, entries.data(), entries.size() * sizeof(Entry));
+    memcpy(out.data() + h.inodes_offset, inodes.data(), inodes.size() * sizeof(Inode));
+    memcpy(out.data() + h.extents_offset, extents.data(), extents.size() * sizeof(Index::Extent));
+    memcpy(out.data() + h.names_offset, names.data(), names.size());
+
+    // Write to the side and rename, so a reader never sees half an index.
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+
+    if (fp == NULL || fwrite(out.data(), 1, out.size(), fp) != out.size()) {
+        std::cerr << "Unable to write " << tmp << ": " << strerror(errno) << std::endl;
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        throw std::exception();
+    }
+
+    fclose(fp);
+
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        std::cerr << "Unable to rename " << tmp << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+}
+
+std::unique_ptr<Index> Index::open(const std::string &path,
+                                   uint64_t image_size,
+                                   uint64_t superblock_hash,
+                                   uint32_t block_size)
+{
+    struct stat s;
+
+    if (stat(path.c_str(), &s) < 0 || !S_ISREG(s.st_mode)) {
+        return std::unique_ptr<Index>();
+    }
+
+    std::unique_ptr<Index> index(new Index(ImageSource::open(path)));
+
+    if (!index->validate(image_size, superblock_hash, block_size)) {
+        std::cerr << "Ignoring stale or damaged index " << path << std::endl;
+        return std::unique_ptr<Index>();
+    }
+
+    return index;
+}
+
+Index::Index(ImageSource::Ptr file) :
+    file_(file),
+    header_(nullptr),
+    entries_(nullptr),
+    inodes_(nullptr),
+    extents_(nullptr),
+    names_(nullptr)
+{
+}
+
+bool Index::validate(uint64_t image_size, uint64_t superblock_hash, uint32_t block_size)
+{
+    uint64_t size = file_->size();
+    const uint8_t *base;
+
+    if (size < sizeof(Header)) {
+        return false;
+    }
+
+    if (file_->mapped()) {
+        base = file_->view(0, size).data();
+    } else {
+        copy_.resize(size);
+        file_->read(0, copy_.data(), size);
+        base = copy_.data();
+    }
+
+    const Header *h = reinterpret_cast<const Header *>(base);
+
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != VERSION ||
+        h->byte_order != BYTE_ORDER_MARK ||
+        h->image_size != image_size ||
+        h->superblock_hash != superblock_hash ||
+        h->block_size != block_size ||
+        h->entry_count == 0) {
+        return false;
+    }
+
+    if (h->entries_offset + (uint64_t) h->entry_count * sizeof(Entry) > size ||
+        h->inodes_offset + (uint64_t) h->inode_count * sizeof(Inode) > size ||
+        h->extents_offset + (uint64_t) h->extent_count * sizeof(Extent) > size ||
+        h->names_offset + (uint64_t) h->name_bytes > size ||
+        (h->entries_offset | h->inodes_offset | h->extents_offset) % 8 != 0) {
+        return false;
+    }
+
+    header_ = h;
+    entries_ = reinterpret_cast<const Entry *>(base + h->entries_offset);
+    inodes_ = reinterpret_cast<const Inode *>(base + h->inodes_offset);
+    extents_ = reinterpret_cast<const Extent *>(base + h->extents_offset);
+    names_ = reinterpret_cast<const char *>(base + h->names_offset);
+
+    // Make sure nothing points outside the tables, so lookups later
+    // don't have to check.
+    for (uint32_t i = 0; i < h->entry_count; i++) {
+        const Entry &e = entries_[i];
+
+        if (e.inode >= h->inode_count ||
+            (uint64_t) e.name_offset + e.name_length > h->name_bytes ||
+            (e.first_child != NONE &&
+             (uint64_t) e.first_child + e.child_count > h->entry_count)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < h->inode_count; i++) {
+        const Inode &r = inodes_[i];
+
+        if ((uint64_t) r.first_extent + r.extent_count > h->extent_count ||
+            (i > 0 && r.inum <= inodes_[i - 1].inum)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string_view Index::name(const Entry &e) const
+{
+    return std::string_view(names_ + e.name_offset, e.name_length);
+}
+
+}; // namespace
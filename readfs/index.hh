@@ -0,0 +1,128 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "image.hh"
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+class FileLoader;
+
+//
+// A sidecar index of a filesystem image, written next to the image as
+// "<image>.idx". It records the whole directory tree, the metadata of
+// every inode in it and the extents of every regular file, so a later
+// run can open the image without reading a single inode or directory
+// block.
+//
+// The file is laid out to be used straight from a mapping: a header,
+// then fixed-width tables at 8-byte aligned offsets, then a string
+// table of names. Values are in host byte order; an index moved to a
+// host of the other byte order is simply rejected as stale.
+//
+// Directory entries are stored breadth first, so the children of any
+// directory are one contiguous run of the entry table. Entry 0 is the
+// root.
+//
+class Index {
+public:
+    const static uint32_t VERSION = 1;
+    const static uint32_t NONE = 0xffffffff;
+
+    struct Header {
+        char magic[8];              // "3B2RIDX"
+        uint32_t version;
+        uint32_t byte_order;        // 0x01020304, as written
+        uint64_t image_size;        // Size of the image file
+        uint64_t superblock_hash;   // superblock_hash() of the image
+        uint32_t block_size;
+        uint32_t entry_count;
+        uint32_t inode_count;
+        uint32_t extent_count;
+        uint32_t name_bytes;
+        uint32_t reserved;
+        uint64_t entries_offset;
+        uint64_t inodes_offset;
+        uint64_t extents_offset;
+        uint64_t names_offset;
+    };
+
+    struct Entry {
+        uint32_t inode;             // Record in the inode table
+        uint32_t name_offset;       // Into the string table
+        uint32_t name_length;
+        uint32_t first_child;       // Entry number, or NONE
+        uint32_t child_count;
+    };
+
+    // Sorted by inode number
+    struct Inode {
+        uint32_t inum;
+        uint16_t mode;
+        uint16_t nlink;
+        uint16_t uid;
+        uint16_t gid;
+        uint32_t size;
+        uint32_t atime;
+        uint32_t mtime;
+        uint32_t ctime;
+        uint32_t first_extent;
+        uint32_t extent_count;
+    };
+
+    struct Extent {
+        uint32_t file_block;
+        uint32_t addr;
+        uint32_t count;
+    };
+
+    // The sidecar path for an image, or for one partition of it.
+    static std::string path_for(const std::string &image_name, int partition = -1);
+
+    // Hash of the raw on-disk superblock and the image size, used to
+    // tell whether an index still describes its image.
+    static uint64_t superblock_hash(const void *raw, size_t len, uint64_t image_size);
+
+    // Write an index of everything `loader` can see.
+    static void write(FileLoader &loader, const std::string &path);
+
+    // Open an index, returning nothing if it is missing, malformed or
+    // doesn't match the image it claims to describe.
+    static std::unique_ptr<Index> open(const std::string &path,
+                                       uint64_t image_size,
+                                       uint64_t superblock_hash,
+                                       uint32_t block_size);
+
+    const Header &header() const { return *header_; }
+
+    const Entry &entry(uint32_t n) const { return entries_[n]; }
+    const Inode &inode(uint32_t n) const { return inodes_[n]; }
+    std::string_view name(const Entry &e) const;
+
+    const Extent *extents(const Inode &inode) const
+    {
+        return extents_ + inode.first_extent;
+    }
+
+private:
+    explicit Index(ImageSource::Ptr file);
+
+    bool validate(uint64_t image_size, uint64_t superblock_hash, uint32_t block_size);
+
+    ImageSource::Ptr file_;
+    std::vector<uint8_t> copy_;     // File contents, if it couldn't be mapped
+
+    const Header *header_;
+    const Entry *entries_;
+    const Inode *inodes_;
+    const Extent *extents_;
+    const char *names_;
+};
+
+}; // namespace
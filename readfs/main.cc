@@ -0,0 +1,546 @@
+#include "imgread.hh"
+#include "extract.hh"
+#include "compact.hh"
+#include "fsck.hh"
+#include "vtoc.hh"
+#include "hasher.hh"
+#include "diff.hh"
+#include "batch.hh"
+#include "build.hh"
+#include "query.hh"
+#include "server.hh"
+
+#include <signal.h>
+#include <thread>
+
+using namespace std;
+using namespace loomcom;
+
+//
+// Subcommands, and how many arguments (counting the image) each takes
+//
+struct Command {
+    const char *name;
+    int min_args;
+    int max_args;
+    bool quiet;         // Output is data, so loading must be silent
+};
+
+static const Command commands[] = {
+    { "extract", 2, 2, false },
+    { "index",   1, 1, false },
+    { "compact", 2, 2, false },
+    { "check",   1, 1, false },
+    { "ls",      1, 2, true },
+    { "cat",     2, 2, true },
+    { "partitions", 1, 1, true },
+    { "hash",    1, 2, true },
+    { "dups",    1, 1, true },
+    { "diff",    2, 2, true },
+    { "batch",   1, 2, false },
+    { "build",   2, 2, false },
+    { "find",    1, 64, true },
+    { "serve",   1, 1, false },
+};
+
+void usage() {
+    cerr << "Usage: imgread [options] <file>" << endl;
+    cerr << "       imgread [options] extract <file> <outdir>" << endl;
+    cerr << "       imgread [options] index <file>" << endl;
+    cerr << "       imgread [options] compact <file> <outfile>" << endl;
+    cerr << "       imgread [options] check <file>" << endl;
+    cerr << "       imgread [options] partitions <file>" << endl;
+    cerr << "       imgread [options] hash <file> [db]" << endl;
+    cerr << "       imgread dups <db>" << endl;
+    cerr << "       imgread [options] diff <file> <file2>" << endl;
+    cerr << "       imgread [options] ls <file> [path]" << endl;
+    cerr << "       imgread [options] cat <file> <path>" << endl;
+    cerr << "       imgread [options] batch <manifest> [db]" << endl;
+    cerr << "       imgread [options] build <dir> <outfile>" << endl;
+    cerr << "       imgread [options] find <file> [field<value | field=value | field>value | field value ...]" << endl;
+    cerr << "         fields: type (f, d, c, b, p), perm, nlink, uid, gid, size, atime, mtime, ctime" << endl;
+    cerr << "       imgread [options] serve <socket>" << endl;
+    cerr << endl;
+    cerr << "Options:" << endl;
+    cerr << "  -p         Read the image with pread(2) instead of mmap(2)" << endl;
+    cerr << "  -c blocks  Block cache capacity (default 1024)" << endl;
+    cerr << "  -r blocks  Sequential read-ahead window (default 8)" << endl;
+    cerr << "  -Q depth   Asynchronous reads kept in flight (default 16, 0 for none)" << endl;
+    cerr << "  -u         Issue asynchronous reads from threads, not io_uring" << endl;
+    cerr << "  -s         Print block cache and instrumentation statistics" << endl;
+    cerr << "  -T file    Write a Chrome trace of the run to `file'" << endl;
+    cerr << "  -d         Print debugging detail about the root directory" << endl;
+    cerr << "  -i         Print every allocated inode" << endl;
+    cerr << "  -l         List every file in the filesystem" << endl;
+    cerr << "  -f         Follow the free lists and report free space" << endl;
+    cerr << "  -j threads Worker threads for extract, check, hash and batch (default: one per CPU)" << endl;
+    cerr << "  -x         Ignore any sidecar index" << endl;
+    cerr << "  -P part    Use partition `part' of the disk's VTOC" << endl;
+    cerr << "  -t type    Filesystem type for build: 1 for 512-byte blocks, 2 for 1K (default 2)" << endl;
+    cerr << "  -M mbytes  Memory budget of serve's image pool (default 1024)" << endl;
+}
+
+int list_dir(FileLoader &loader, const std::string &path) {
+    FileEntry::Ptr dir = loader.lookup(path);
+
+    if (dir == nullptr) {
+        cerr << path << ": No such file or directory" << endl;
+        return 1;
+    }
+
+    FileEntry::List entries;
+
+    if (dir->is_dir) {
+        try {
+            entries = dir->dir_entries();
+        } catch (std::exception &e) {
+            cerr << "Unable to read " << path << endl;
+            return 1;
+        }
+    } else {
+        entries = FileEntry::List(&dir, 1);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const FileEntry::Ptr f = entries[i];
+        time_t t = (time_t) f->inode.di_mtime;
+        char time_str[100];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&t));
+
+        cout << std::setw(6) << std::setfill('0') << std::oct << f->inode.di_mode;
+        cout << std::setfill(' ') << std::dec;
+        cout << " " << std::setw(3) << f->inode.di_nlink;
+        cout << " " << std::setw(5) << f->inode.di_uid;
+        cout << " " << std::setw(5) << f->inode.di_gid;
+        cout << " " << std::setw(10) << f->inode.di_size;
+        cout << " " << time_str << " " << f->name << "\n";
+    }
+
+    return 0;
+}
+
+int cat_file(FileLoader &loader, const std::string &path) {
+    FileEntry::Ptr f = loader.lookup(path);
+
+    if (f == nullptr || f->file_type != FileEntry::FT_REG) {
+        cerr << path << ": Not a regular file" << endl;
+        return 1;
+    }
+
+    std::vector<Extent> extents = loader.extents(*f);
+    std::vector<uint8_t> buf(1024 * 1024);
+    uint64_t offset = 0;
+
+    while (offset < f->inode.di_size) {
+        size_t n = loader.read_data(f->inode, extents, offset, buf.data(), buf.size());
+
+        if (fwrite(buf.data(), 1, n, stdout) != n) {
+            return 1;
+        }
+
+        offset += n;
+    }
+
+    return 0;
+}
+
+//
+// Print a disk's VTOC, loading every SysV partition on it at once.
+//
+int list_partitions(const ImageSource::Ptr &image, const FileLoader::Options &defaults) {
+    std::vector<Partition> parts = Vtoc::read(*image);
+
+    if (parts.empty()) {
+        cerr << image->file_name() << ": No VTOC" << endl;
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<FileLoader> > loaders(parts.size());
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (!parts[i].sysv) {
+            continue;
+        }
+
+        FileLoader::Options options = defaults;
+        options.base = parts[i].offset();
+        options.partition = parts[i].index;
+        loaders[i].reset(new FileLoader(image, options));
+
+        threads.push_back(std::thread([&loaders, i]() {
+            try {
+                loaders[i]->load();
+            } catch (std::exception &e) {
+                loaders[i].reset();
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    cout << "PART TAG       START    SECTORS  FS" << "\n";
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        const Partition &p = parts[i];
+
+        cout << std::setfill(' ') << std::dec;
+        cout << std::setw(4) << p.index << " ";
+        cout << std::left << std::setw(7) << Vtoc::tag_name(p.tag) << std::right;
+        cout << " " << std::setw(8) << p.start;
+        cout << " " << std::setw(10) << p.sectors;
+
+        if (loaders[i]) {
+            const superblock &sb = loaders[i]->superblock();
+            cout << "  SysV " << loaders[i]->block_size() << "b, " <<
+                sb.s_fsize << " blocks, " << sb.s_tfree << " free, " <<
+                loaders[i]->root()->dir_entries().size() << " in /";
+        } else if (p.sysv) {
+            cout << "  SysV (damaged)";
+        }
+
+        cout << "\n";
+    }
+
+    return 0;
+}
+
+static Server *running_server = nullptr;
+
+static void stop_server(int sig) {
+    if (running_server != nullptr) {
+        running_server->stop();
+    }
+}
+
+int main(int argc, char ** argv) {
+    
+    FileLoader::Options options;
+    bool show_stats = false;
+    bool show_inodes = false;
+    bool show_tree = false;
+    bool show_free = false;
+    bool debug = false;
+    bool quiet = false;
+    unsigned threads = std::thread::hardware_concurrency();
+    int partition = -1;
+    uint32_t fs_type = 2;
+    size_t budget_mb = 1024;
+    const char *trace_file = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "+pc:r:Q:usilfj:xP:t:M:T:d")) != -1) {
+        switch (c) {
+        case 'p':
+            options.use_mmap = false;
+            break;
+        case 'c':
+            options.cache_blocks = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            options.readahead = strtoul(optarg, NULL, 0);
+            break;
+        case 'Q':
+            options.io_depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            options.io_uring = false;
+            break;
+        case 's':
+            show_stats = true;
+            break;
+        case 'i':
+            show_inodes = true;
+            break;
+        case 'l':
+            show_tree = true;
+            break;
+        case 'f':
+            show_free = true;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            options.use_index = false;
+            break;
+        case 'P':
+            partition = strtol(optarg, NULL, 0);
+            break;
+        case 't':
+            fs_type = strtoul(optarg, NULL, 0);
+            break;
+        case 'M':
+            budget_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'd':
+            debug = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    // First argument is the command or the file name.
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    std::string command;
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strcmp(argv[optind], commands[i].name) == 0) {
+            command = argv[optind++];
+
+            if (argc - optind < commands[i].min_args ||
+                argc - optind > commands[i].max_args) {
+                usage();
+                return 1;
+            }
+
+            quiet = commands[i].quiet;
+        }
+    }
+
+    // An index is always rebuilt from the image itself.
+    if (command == "index") {
+        options.use_index = false;
+    }
+
+    // The only command that reads neither an image nor a tree
+    if (command == "dups") {
+        HashDb::print_duplicates(argv[optind]);
+        return 0;
+    }
+
+    char *name = argv[optind];
+
+    // The one command that writes an image rather than reading one
+    if (command == "build") {
+        Builder::Options build_options;
+        build_options.type = fs_type;
+
+        Builder builder(name, argv[optind + 1], build_options);
+        int skipped = builder.run();
+        builder.print_stats();
+
+        return skipped > 0 ? 1 : 0;
+    }
+
+    // Clients name the images; the argument is where to listen for them.
+    if (command == "serve") {
+        Server server(name, options, budget_mb * 1024 * 1024, threads);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stop_server;
+        running_server = &server;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        server.run();
+        running_server = nullptr;
+        server.print_stats();
+
+        return 0;
+    }
+
+    // If the first arg isn't a file, die.
+    struct stat s;
+
+    if (stat(name, &s) < 0 || !S_ISREG(s.st_mode)) {
+        usage();
+        return 1;
+    }
+
+    if (trace_file != NULL) {
+        Trace::open_trace(trace_file);
+        atexit(Trace::close_trace);
+    } else if (show_stats) {
+        Trace::enable();
+    }
+
+    // The manifest names the images. Files are hashed only if there
+    // is a database to put the hashes in.
+    if (command == "batch") {
+        Batch batch(options, threads, optind + 1 < argc);
+        int bad = batch.run(Batch::read_manifest(name));
+
+        batch.print_report(cout);
+
+        if (optind + 1 < argc) {
+            batch.write_hashes(argv[optind + 1]);
+        }
+
+        if (show_stats) {
+            batch.print_stats();
+            Trace::print_stats();
+        }
+
+        return bad > 0 ? 1 : 0;
+    }
+
+    // All partitions share one open image.
+    ImageSource::Ptr image = ImageSource::open(name, options.use_mmap);
+
+    if (command == "partitions") {
+        return list_partitions(image, options);
+    }
+
+    if (!Vtoc::select(*image, partition, options)) {
+        return 1;
+    }
+
+    if (!quiet) {
+        cout << "Loading file " << name;
+        if (partition >= 0) {
+            cout << " partition " << partition;
+        }
+        cout << endl;
+    }
+
+    FileLoader file_loader(image, options);
+    file_loader.load();
+
+    if (!quiet) {
+        file_loader.print_superblock();
+
+        if (debug) {
+            file_loader.print_root();
+        }
+    }
+
+    if (command == "extract") {
+        Extractor extractor(file_loader, argv[optind + 1], threads);
+        int failures = extractor.run();
+        extractor.print_stats();
+
+        if (failures > 0) {
+            return 1;
+        }
+    } else if (command == "index") {
+        file_loader.write_index();
+        cout << "Wrote " << Index::path_for(name, partition) << endl;
+    } else if (command == "compact") {
+        Compactor compactor(file_loader, argv[optind + 1]);
+        compactor.run();
+        compactor.print_stats();
+    } else if (command == "check") {
+        Checker checker(file_loader, threads);
+        uint64_t problems = checker.run();
+        checker.print_stats();
+
+        if (problems > 0) {
+            return 1;
+        }
+    } else if (command == "hash") {
+        Hasher hasher(file_loader, threads);
+        int failures = hasher.run();
+
+        if (optind + 1 < argc) {
+            // Databases name images absolutely, so runs from anywhere agree.
+            char *path = realpath(name, NULL);
+            HashDb::append(argv[optind + 1], path != NULL ? path : name, partition,
+                           hasher.records());
+            free(path);
+            hasher.print_stats();
+        } else {
+            for (size_t i = 0; i < hasher.records().size(); i++) {
+                if (hasher.records()[i].ok) {
+                    HashDb::print_record(cout, name, partition, hasher.records()[i]);
+                }
+            }
+        }
+
+        if (failures > 0) {
+            return 1;
+        }
+    } else if (command == "diff") {
+        // Both images are read the same way, from the same partition.
+        FileLoader::Options other_options = options;
+        ImageSource::Ptr other = ImageSource::open(argv[optind + 1], options.use_mmap);
+
+        if (!Vtoc::select(*other, partition, other_options)) {
+            return 1;
+        }
+
+        FileLoader other_loader(other, other_options);
+        other_loader.load();
+
+        Differ differ(file_loader, other_loader);
+        uint64_t differences;
+
+        // As with diff(1), trouble is 2 and differences are 1.
+        try {
+            differences = differ.run(cout);
+        } catch (std::exception &e) {
+            return 2;
+        }
+
+        if (show_stats) {
+            differ.print_stats();
+        }
+
+        if (differences > 0) {
+            return 1;
+        }
+    } else if (command == "ls") {
+        return list_dir(file_loader, optind + 1 < argc ? argv[optind + 1] : "/");
+    } else if (command == "cat") {
+        return cat_file(file_loader, argv[optind + 1]);
+    } else if (command == "find") {
+        Finder finder(file_loader, threads);
+
+        try {
+            for (int i = optind + 1; i < argc; i++) {
+                std::string term = argv[i];
+
+                // "--uid 100" is "--uid=100", as find(1) would take it.
+                if (term.find_first_of("<=>") == std::string::npos && i + 1 < argc) {
+                    term += "=" + std::string(argv[++i]);
+                }
+
+                finder.add(Finder::parse(term));
+            }
+        } catch (std::exception &e) {
+            usage();
+            return 2;
+        }
+
+        bool found = !finder.run().empty();
+        finder.print(cout);
+
+        if (show_stats) {
+            finder.print_stats();
+        }
+
+        return found ? 0 : 1;
+    }
+
+    if (show_inodes) {
+        file_loader.print_inodes();
+    }
+
+    if (show_tree) {
+        file_loader.print_tree();
+    }
+
+    if (show_free) {
+        file_loader.print_free_space();
+    }
+
+    if (show_stats) {
+        file_loader.print_cache_stats();
+        file_loader.print_memory_stats();
+        Trace::print_stats();
+    }
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "namei.hh"
+#include "imgread.hh"
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// DirHash
+//
+
+void DirHash::build(Arena &arena, FileEntry *const *entries, size_t count)
+{
+    // Keep the load factor at or under 1/2, so probes stay short.
+    size_t size = 16;
+    while (size < count * 2) {
+        size <<= 1;
+    }
+
+    Slot *slots = arena.make_array<Slot>(size);
+
+    size_t mask = size - 1;
+
+    for (size_t i = 0; i < count; i++) {
+        NameKey key(entries[i]->name);
+        size_t s = key.hash() & mask;
+
+        while (slots[s].entry != nullptr) {
+            // A damaged directory can name a file twice; the first
+            // entry wins, as it would for a linear scan.
+            if (slots[s].key == key) {
+                break;
+            }
+            s = (s + 1) & mask;
+        }
+
+        if (slots[s].entry == nullptr) {
+            slots[s].key = key;
+            slots[s].entry = entries[i];
+        }
+    }
+
+    mask_ = mask;
+    slots_ = slots;
+}
+
+FileEntry *DirHash::find(const NameKey &key) const
+{
+    size_t s = key.hash() & mask_;
+
+    while (slots_[s].entry != nullptr) {
+        if (slots_[s].key == key) {
+            return slots_[s].entry;
+        }
+        s = (s + 1) & mask_;
+    }
+
+    return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////
+// DentryCache
+//
+
+DentryCache::DentryCache(size_t capacity) :
+    hits_(0),
+    negative_hits_(0),
+    misses_(0)
+{
+    size_t per_shard = 1;
+    while (per_shard * SHARDS < capacity) {
+        per_shard <<= 1;
+    }
+
+    for (size_t i = 0; i < SHARDS; i++) {
+        shards_[i].slots.resize(per_shard);
+    }
+
+    shard_mask_ = per_shard - 1;
+}
+
+bool DentryCache::get(uint32_t dir, const NameKey &key, FileEntry *&entry)
+{
+    uint64_t h = hash(dir, key);
+    Shard &sh = shard(h);
+
+    {
+        std::lock_guard<std::mutex> guard(sh.lock);
+        const Slot &slot = sh.slots[h & shard_mask_];
+
+        if (slot.dir == dir && slot.key == key) {
+            entry = slot.entry;
+            (entry != nullptr ? hits_ : negative_hits_).fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    return false;
+}
+
+void DentryCache::put(uint32_t dir, const NameKey &key, FileEntry *entry)
+{
+    uint64_t h = hash(dir, key);
+    Shard &sh = shard(h);
+
+    std::lock_guard<std::mutex> guard(sh.lock);
+    Slot &slot = sh.slots[h & shard_mask_];
+
+    slot.dir = dir;
+    slot.key = key;
+    slot.entry = entry;
+}
+
+DentryCache::Stats DentryCache::stats() const
+{
+    Stats s;
+    s.hits = hits_.load(std::memory_order_relaxed);
+    s.negative_hits = negative_hits_.load(std::memory_order_relaxed);
+    s.misses = misses_.load(std::memory_order_relaxed);
+    return s;
+}
+
+void DentryCache::print_stats() const
+{
+    Stats s = stats();
+
+    std::cout << "DENTRY CACHE" << std::endl;
+    std::cout << "------------" << std::endl;
+    std::cout << "  Capacity: " << std::dec << SHARDS * (shard_mask_ + 1) << std::endl;
+    std::cout << "  Hits: " << s.hits << std::endl;
+    std::cout << "  Negative hits: " << s.negative_hits << std::endl;
+    std::cout << "  Misses: " << s.misses << std::endl;
+}
+
+}; // namespace
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "arena.hh"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace loomcom {
+
+class FileEntry;
+
+//
+// A directory entry name as a fixed-width key. SysV names are at most
+// 14 bytes, so one fits, zero padded, in two 64-bit words, and hashing
+// or comparing two names never looks at their lengths.
+//
+struct NameKey {
+    const static size_t MAX_NAME = 14;
+
+    NameKey() { w[0] = w[1] = 0; }
+
+    // `name` must be no longer than MAX_NAME.
+    explicit NameKey(std::string_view name)
+    {
+        char buf[16] = {0};
+        memcpy(buf, name.data(), name.size());
+        memcpy(w, buf, sizeof(w));
+    }
+
+    bool operator==(const NameKey &other) const
+    {
+        return w[0] == other.w[0] && w[1] == other.w[1];
+    }
+
+    uint64_t hash(uint64_t seed = 0) const
+    {
+        uint64_t h = (w[0] ^ seed) * 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 29) ^ w[1]) * 0xbf58476d1ce4e5b9ULL;
+        return h ^ (h >> 32);
+    }
+
+    uint64_t w[2];
+};
+
+//
+// The entries of one directory, hashed by name, open addressed with
+// linear probing. The table lives in the loader's arena and is built
+// once, the first time the directory is searched; directories of only
+// a few entries are searched linearly instead.
+//
+class DirHash {
+public:
+    // At or below this many entries a linear scan beats hashing.
+    const static size_t SMALL_DIR = 8;
+
+    DirHash() : slots_(nullptr), mask_(0) {}
+
+    void build(Arena &arena, FileEntry *const *entries, size_t count);
+
+    bool built() const { return slots_ != nullptr; }
+
+    // The entry with this name, or nullptr.
+    FileEntry *find(const NameKey &key) const;
+
+private:
+    struct Slot {
+        Slot() : entry(nullptr) {}
+
+        NameKey key;
+        FileEntry *entry;       // nullptr for a free slot
+    };
+
+    Slot *slots_;
+    size_t mask_;
+};
+
+//
+// Recent name lookups, keyed by (directory inode, name), across every
+// directory of a filesystem. Failed lookups are remembered too, so
+// scripts that probe for files that aren't there don't rescan. The
+// cache is direct mapped, so a new entry simply replaces whatever was
+// in its slot, and is split into separately locked shards so threads
+// resolving different names don't wait on each other.
+//
+class DentryCache {
+public:
+    const static size_t SHARDS = 16;
+    const static size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    struct Stats {
+        Stats() : hits(0), negative_hits(0), misses(0) {}
+
+        uint64_t hits;
+        uint64_t negative_hits;         // Hits on a name known not to exist
+        uint64_t misses;
+    };
+
+    explicit DentryCache(size_t capacity = DEFAULT_CAPACITY);
+
+    // True if the lookup is cached, with `entry` set to the answer,
+    // which is nullptr if there is no such name.
+    bool get(uint32_t dir, const NameKey &key, FileEntry *&entry);
+
+    void put(uint32_t dir, const NameKey &key, FileEntry *entry);
+
+    Stats stats() const;
+    void print_stats() const;
+
+private:
+    struct Slot {
+        Slot() : dir(0), entry(nullptr) {}
+
+        uint32_t dir;           // 0 for a free slot
+        NameKey key;
+        FileEntry *entry;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::vector<Slot> slots;
+    };
+
+    Shard &shard(uint64_t hash) { return shards_[(hash >> 56) % SHARDS]; }
+
+    static uint64_t hash(uint32_t dir, const NameKey &key) { return key.hash(dir); }
+
+    Shard shards_[SHARDS];
+    size_t shard_mask_;
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> negative_hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+}; // namespace
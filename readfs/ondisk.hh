@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string_view>
+
+#include "bswap.hh"
+
+namespace loomcom {
+
+//
+// Read-only views of the on-disk structures, laid over image memory.
+// Each field is read big-endian from its offset on the disk when it is
+// asked for, so nothing is copied or swapped up front, and the layout
+// is the disk's rather than whatever padding the host compiler picks.
+//
+
+//
+// The superblock, the second 512-byte sector of a filesystem.
+//
+class SuperblockView {
+public:
+    const static size_t SIZE = 512;
+
+    const static size_t S_ISIZE = 0;
+    const static size_t S_FSIZE = 4;
+    const static size_t S_NFREE = 8;
+    const static size_t S_FREE = 12;        // 50 addresses
+    const static size_t S_NINODE = 212;
+    const static size_t S_INODE = 214;      // 100 inode numbers
+    const static size_t S_FLOCK = 414;
+    const static size_t S_ILOCK = 415;
+    const static size_t S_FMOD = 416;
+    const static size_t S_RONLY = 417;
+    const static size_t S_TIME = 420;
+    const static size_t S_DINFO = 424;      // 4 halfwords
+    const static size_t S_TFREE = 432;
+    const static size_t S_TINODE = 436;
+    const static size_t S_FNAME = 438;
+    const static size_t S_FPACK = 444;
+    const static size_t S_STATE = 500;
+    const static size_t S_MAGIC = 504;
+    const static size_t S_TYPE = 508;
+
+    // `p` must point at SIZE readable bytes.
+    explicit SuperblockView(const uint8_t *p) : p_(p) {}
+
+    uint16_t isize() const { return be16(p_ + S_ISIZE); }
+    uint32_t fsize() const { return be32(p_ + S_FSIZE); }
+    uint16_t nfree() const { return be16(p_ + S_NFREE); }
+    uint32_t free(int i) const { return be32(p_ + S_FREE + i * 4); }
+    uint16_t ninode() const { return be16(p_ + S_NINODE); }
+    uint16_t inode(int i) const { return be16(p_ + S_INODE + i * 2); }
+    uint8_t flock() const { return p_[S_FLOCK]; }
+    uint8_t ilock() const { return p_[S_ILOCK]; }
+    uint8_t fmod() const { return p_[S_FMOD]; }
+    uint8_t ronly() const { return p_[S_RONLY]; }
+    uint32_t time() const { return be32(p_ + S_TIME); }
+    uint16_t dinfo(int i) const { return be16(p_ + S_DINFO + i * 2); }
+    uint32_t tfree() const { return be32(p_ + S_TFREE); }
+    uint16_t tinode() const { return be16(p_ + S_TINODE); }
+    uint32_t state() const { return be32(p_ + S_STATE); }
+    uint32_t magic() const { return be32(p_ + S_MAGIC); }
+    uint32_t type() const { return be32(p_ + S_TYPE); }
+
+    // The names are NUL padded, but needn't be NUL terminated.
+    std::string_view fname() const { return text(S_FNAME, 6); }
+    std::string_view fpack() const { return text(S_FPACK, 6); }
+
+    const uint8_t *data() const { return p_; }
+
+private:
+    std::string_view text(size_t offset, size_t len) const
+    {
+        const char *s = reinterpret_cast<const char *>(p_ + offset);
+        return std::string_view(s, strnlen(s, len));
+    }
+
+    const uint8_t *p_;
+};
+
+//
+// An inode, one 64-byte slot of the i-list.
+//
+class DinodeView {
+public:
+    const static size_t SIZE = 64;
+
+    const static size_t DI_MODE = 0;
+    const static size_t DI_NLINK = 2;
+    const static size_t DI_UID = 4;
+    const static size_t DI_GID = 6;
+    const static size_t DI_SIZE = 8;
+    const static size_t DI_ADDR = 12;      // 13 3-byte addresses, 40 bytes
+    const static size_t DI_ATIME = 52;
+    const static size_t DI_MTIME = 56;
+    const static size_t DI_CTIME = 60;
+
+    const static size_t ADDR_BYTES = 40;
+
+    explicit DinodeView(const uint8_t *p) : p_(p) {}
+
+    uint16_t mode() const { return be16(p_ + DI_MODE); }
+    uint16_t nlink() const { return be16(p_ + DI_NLINK); }
+    uint16_t uid() const { return be16(p_ + DI_UID); }
+    uint16_t gid() const { return be16(p_ + DI_GID); }
+    uint32_t size() const { return be32(p_ + DI_SIZE); }
+    uint32_t atime() const { return be32(p_ + DI_ATIME); }
+    uint32_t mtime() const { return be32(p_ + DI_MTIME); }
+    uint32_t ctime() const { return be32(p_ + DI_CTIME); }
+
+    // Block address `i` of di_addr: 10 direct, then single, double and
+    // triple indirect.
+    uint32_t addr(int i) const { return be24(p_ + DI_ADDR + i * 3); }
+
+    // di_addr as it is on the disk.
+    const uint8_t *addr_bytes() const { return p_ + DI_ADDR; }
+
+    const uint8_t *data() const { return p_; }
+
+private:
+    const uint8_t *p_;
+};
+
+//
+// A 16-byte directory entry.
+//
+class DentryView {
+public:
+    const static size_t SIZE = 16;
+
+    const static size_t D_INUM = 0;
+    const static size_t D_NAME = 2;
+    const static size_t NAME_LEN = 14;
+
+    explicit DentryView(const uint8_t *p) : p_(p) {}
+
+    // Unused slots have an inode number of zero.
+    uint16_t inum() const { return be16(p_ + D_INUM); }
+
+    // A full 14-character name has no NUL after it.
+    std::string_view name() const
+    {
+        const char *s = reinterpret_cast<const char *>(p_ + D_NAME);
+        return std::string_view(s, strnlen(s, NAME_LEN));
+    }
+
+private:
+    const uint8_t *p_;
+};
+
+}; // namespace
@@ -0,0 +1,477 @@
+#include "query.hh"
+
+#include <chrono>
+#include <thread>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace loomcom {
+
+//////////////////////////////////////////////////////////////////////
+// Predicate kernels
+//
+// Each test8() checks eight inodes of one column, (col[i] & mask) op
+// value, and returns a byte with bit i set for each that passes. 16-bit
+// columns are widened to 32 bits first, so that either kind compares
+// against a full 32-bit value. SIMD compares are signed, so both sides
+// have their sign bits flipped to make them compare as unsigned.
+//
+
+static inline bool test1(uint32_t x, uint32_t mask, int op, uint32_t value)
+{
+    x &= mask;
+    return op == Finder::OP_LT ? x < value : op == Finder::OP_GT ? x > value : x == value;
+}
+
+#if defined(__AVX2__)
+
+static inline uint8_t compare8(__m256i v, uint32_t mask, int op, uint32_t value)
+{
+    const __m256i sign = _mm256_set1_epi32((int) 0x80000000);
+    __m256i x = _mm256_xor_si256(_mm256_and_si256(v, _mm256_set1_epi32((int) mask)), sign);
+    __m256i y = _mm256_set1_epi32((int) (value ^ 0x80000000));
+    __m256i r;
+
+    if (op == Finder::OP_LT) {
+        r = _mm256_cmpgt_epi32(y, x);
+    } else if (op == Finder::OP_GT) {
+        r = _mm256_cmpgt_epi32(x, y);
+    } else {
+        r = _mm256_cmpeq_epi32(x, y);
+    }
+
+    return (uint8_t) _mm256_movemask_ps(_mm256_castsi256_ps(r));
+}
+
+static inline uint8_t test8(const uint32_t *col, uint32_t mask, int op, uint32_t value)
+{
+    return compare8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(col)),
+                    mask, op, value);
+}
+
+static inline uint8_t test8(const uint16_t *col, uint32_t mask, int op, uint32_t value)
+{
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(col));
+    return compare8(_mm256_cvtepu16_epi32(raw), mask, op, value);
+}
+
+#elif defined(__SSE2__)
+
+static inline uint8_t compare4(__m128i v, uint32_t mask, int op, uint32_t value)
+{
+    const __m128i sign = _mm_set1_epi32((int) 0x80000000);
+    __m128i x = _mm_xor_si128(_mm_and_si128(v, _mm_set1_epi32((int) mask)), sign);
+    __m128i y = _mm_set1_epi32((int) (value ^ 0x80000000));
+    __m128i r;
+
+    if (op == Finder::OP_LT) {
+        r = _mm_cmplt_epi32(x, y);
+    } else if (op == Finder::OP_GT) {
+        r = _mm_cmpgt_epi32(x, y);
+    } else {
+        r = _mm_cmpeq_epi32(x, y);
+    }
+
+    return (uint8_t) _mm_movemask_ps(_mm_castsi128_ps(r));
+}
+
+static inline uint8_t test8(const uint32_t *col, uint32_t mask, int op, uint32_t value)
+{
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(col));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(col + 4));
+    return (uint8_t) (compare4(lo, mask, op, value) | compare4(hi, mask, op, value) << 4);
+}
+
+static inline uint8_t test8(const uint16_t *col, uint32_t mask, int op, uint32_t value)
+{
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(col));
+    __m128i zero = _mm_setzero_si128();
+    return (uint8_t) (compare4(_mm_unpacklo_epi16(raw, zero), mask, op, value) |
+                      compare4(_mm_unpackhi_epi16(raw, zero), mask, op, value) << 4);
+}
+
+#else
+
+template <typename T>
+static inline uint8_t test8(const T *col, uint32_t mask, int op, uint32_t value)
+{
+    uint8_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        bits |= (uint8_t) (test1(col[i], mask, op, value) << i);
+    }
+    return bits;
+}
+
+#endif
+
+// Clear the bit of every inode of col[0..n) that fails.
+template <typename T>
+static void filter(const T *col, uint32_t n, uint32_t mask, int op, uint32_t value,
+                   uint8_t *bits)
+{
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        bits[i / 8] &= test8(col + i, mask, op, value);
+    }
+
+    for (; i < n; i++) {
+        if (!test1(col[i], mask, op, value)) {
+            bits[i / 8] &= (uint8_t) ~(1 << (i % 8));
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// Finder
+//
+
+Finder::Predicate Finder::parse(const std::string &term)
+{
+    size_t start = term.find_first_not_of('-');
+    size_t op_pos = term.find_first_of("<=>");
+
+    if (start == std::string::npos || op_pos == std::string::npos || op_pos <= start ||
+        op_pos + 1 >= term.size()) {
+        std::cerr << "Bad query term \"" << term << "\"" << std::endl;
+        throw std::exception();
+    }
+
+    std::string field = term.substr(start, op_pos - start);
+    std::string value = term.substr(op_pos + 1);
+    const char *v = value.c_str();
+    char *end = NULL;
+
+    Predicate p;
+    p.op = term[op_pos] == '<' ? OP_LT : term[op_pos] == '>' ? OP_GT : OP_EQ;
+    p.value = 0;
+
+    if (field == "type") {
+        static const char types[] = "pcdbf";
+        static const uint32_t modes[] = { 010000, 020000, 040000, 060000, 0100000 };
+        const char *t = value.size() == 1 ? strchr(types, value[0]) : NULL;
+
+        if (t == NULL || *t == '\0' || p.op != OP_EQ) {
+            std::cerr << "Bad type in \"" << term << "\"; use type=f, d, c, b or p" << std::endl;
+            throw std::exception();
+        }
+
+        p.field = F_TYPE;
+        p.value = modes[t - types];
+        return p;
+    }
+
+    unsigned long long n;
+
+    if (field == "perm") {
+        p.field = F_PERM;
+        n = strtoull(v, &end, 8);
+    } else if (field == "atime" || field == "mtime" || field == "ctime") {
+        p.field = field == "atime" ? F_ATIME : field == "mtime" ? F_MTIME : F_CTIME;
+
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(v, "%Y-%m-%d", &tm);
+
+        if (rest != NULL && *rest == '\0') {
+            tm.tm_isdst = -1;
+            n = (unsigned long long) mktime(&tm);
+            end = const_cast<char *>(rest);
+        } else {
+            n = strtoull(v, &end, 0);
+        }
+    } else if (field == "size" || field == "nlink" || field == "uid" || field == "gid") {
+        p.field = field == "size" ? F_SIZE : field == "nlink" ? F_NLINK :
+            field == "uid" ? F_UID : F_GID;
+        n = strtoull(v, &end, 0);
+
+        if (p.field == F_SIZE && end != NULL && (*end == 'k' || *end == 'M')) {
+            n <<= *end == 'k' ? 10 : 20;
+            end++;
+        }
+    } else {
+        std::cerr << "Unknown field \"" << field << "\" in \"" << term << "\"" << std::endl;
+        throw std::exception();
+    }
+
+    if (end == v || *end != '\0' || n > UINT32_MAX) {
+        std::cerr << "Bad value in \"" << term << "\"" << std::endl;
+        throw std::exception();
+    }
+
+    p.value = (uint32_t) n;
+    return p;
+}
+
+Finder::Finder(FileLoader &loader, unsigned threads) :
+    loader_(loader),
+    threads_(threads > 0 ? threads : 1),
+    table_(nullptr),
+    next_range_(0),
+    links_built_(false),
+    scan_seconds_(0),
+    index_seconds_(0)
+{
+}
+
+const std::vector<uint32_t> &Finder::run()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    table_ = &loader_.load_inode_table();
+
+    uint32_t ranges = (table_->count + INODE_RANGE - 1) / INODE_RANGE;
+    range_matches_.assign(ranges, std::vector<uint32_t>());
+    next_range_ = 0;
+
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 0; i < std::min(threads_, ranges); i++) {
+        workers.push_back(std::thread(&Finder::worker, this));
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    matches_.clear();
+
+    for (size_t i = 0; i < range_matches_.size(); i++) {
+        matches_.insert(matches_.end(), range_matches_[i].begin(), range_matches_[i].end());
+    }
+
+    range_matches_.clear();
+    scan_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return matches_;
+}
+
+void Finder::worker()
+{
+    uint32_t ranges = (uint32_t) range_matches_.size();
+
+    for (;;) {
+        uint32_t r = next_range_.fetch_add(1);
+
+        if (r >= ranges) {
+            break;
+        }
+
+        scan_range(1 + r * INODE_RANGE, range_matches_[r]);
+    }
+}
+
+const void Finder::scan_range(uint32_t first, std::vector<uint32_t> &out) const
+{
+    uint32_t n = std::min((uint32_t) INODE_RANGE, table_->count + 1 - first);
+    uint8_t bits[INODE_RANGE / 8];
+
+    memset(bits, 0xff, sizeof(bits));
+
+    // Only allocated inodes can match.
+    filter(&table_->mode[first], n, 0xffff, OP_GT, 0, bits);
+
+    for (size_t i = 0; i < predicates_.size(); i++) {
+        const Predicate &p = predicates_[i];
+
+        switch (p.field) {
+        case F_TYPE:
+            filter(&table_->mode[first], n, 0170000, p.op, p.value, bits);
+            break;
+        case F_PERM:
+            filter(&table_->mode[first], n, 07777, p.op, p.value, bits);
+            break;
+        case F_NLINK:
+            filter(&table_->nlink[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_UID:
+            filter(&table_->uid[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_GID:
+            filter(&table_->gid[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_SIZE:
+            filter(&table_->size[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_ATIME:
+            filter(&table_->atime[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_MTIME:
+            filter(&table_->mtime[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        case F_CTIME:
+            filter(&table_->ctime[first], n, 0xffffffff, p.op, p.value, bits);
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i += 8) {
+        uint8_t b = bits[i / 8];
+
+        for (; b != 0; b &= (uint8_t) (b - 1)) {
+            uint32_t bit = (uint32_t) __builtin_ctz(b);
+
+            if (i + bit < n) {
+                out.push_back(first + i + bit);
+            }
+        }
+    }
+}
+
+//
+// Read every directory reachable from the root, breadth first, and
+// note each name of each inode. A directory is only read once, however
+// many names it has, so loops in a damaged tree end.
+//
+const void Finder::build_links()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const struct superblock &sb = loader_.superblock();
+    uint32_t entries_per_block = loader_.block_size() / DentryView::SIZE;
+
+    first_link_.assign(table_->count + 1, (uint32_t) NONE);
+    links_.clear();
+
+    std::vector<bool> queued(table_->count + 1, false);
+    std::vector<uint32_t> dirs(1, (uint32_t) FileLoader::ROOT_INODE);
+    queued[FileLoader::ROOT_INODE] = true;
+
+    for (size_t d = 0; d < dirs.size(); d++) {
+        uint32_t inum = dirs[d];
+        uint32_t entry_count = table_->size[inum] / DentryView::SIZE;
+        std::vector<uint32_t> blocks = loader_.block_list(table_->addrs(inum), table_->size[inum]);
+
+        for (size_t b = 0; b < blocks.size() && entry_count > 0; b++) {
+            uint32_t entries_this_block = std::min(entry_count, entries_per_block);
+            entry_count -= entries_this_block;
+
+            if (blocks[b] == 0 || blocks[b] < sb.s_isize || blocks[b] >= sb.s_fsize) {
+                continue;
+            }
+
+            BlockCache::Block block = loader_.block(blocks[b]);
+
+            for (uint32_t i = 0; i < entries_this_block; i++) {
+                DentryView entry(block.get() + (i * DentryView::SIZE));
+                uint32_t child = entry.inum();
+                std::string_view name = entry.name();
+
+                if (child == 0 || child > table_->count || name == "." || name == "..") {
+                    continue;
+                }
+
+                Link l;
+                l.parent = inum;
+                l.next = first_link_[child];
+                l.name = std::string(name);
+                first_link_[child] = (uint32_t) links_.size();
+                links_.push_back(l);
+
+                if ((table_->mode[child] & 0170000) == 040000 && !queued[child]) {
+                    queued[child] = true;
+                    dirs.push_back(child);
+                }
+            }
+        }
+    }
+
+    links_built_ = true;
+    index_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//
+// The path of directory `inum`, through the first name of each
+// directory above it. False if it doesn't lead back to the root.
+//
+const bool Finder::dir_path(uint32_t inum, std::string &path) const
+{
+    std::vector<const std::string *> names;
+
+    while (inum != FileLoader::ROOT_INODE) {
+        uint32_t l = first_link_[inum];
+
+        if (l == NONE || names.size() > table_->count) {
+            return false;
+        }
+
+        names.push_back(&links_[l].name);
+        inum = links_[l].parent;
+    }
+
+    path.clear();
+
+    for (size_t i = names.size(); i-- > 0; ) {
+        path += "/";
+        path += *names[i];
+    }
+
+    return true;
+}
+
+const std::vector<std::string> Finder::paths(uint32_t inum)
+{
+    if (!links_built_) {
+        build_links();
+    }
+
+    std::vector<std::string> result;
+
+    if (inum == FileLoader::ROOT_INODE) {
+        result.push_back("/");
+        return result;
+    }
+
+    std::string dir;
+
+    for (uint32_t l = first_link_[inum]; l != NONE; l = links_[l].next) {
+        if (dir_path(links_[l].parent, dir)) {
+            result.push_back(dir + "/" + links_[l].name);
+        }
+    }
+
+    // Links are pushed on the front of each inode's list.
+    std::reverse(result.begin(), result.end());
+
+    return result;
+}
+
+const void Finder::print(std::ostream &out)
+{
+    for (size_t i = 0; i < matches_.size(); i++) {
+        std::vector<std::string> names = paths(matches_[i]);
+
+        if (names.empty()) {
+            out << "<unlinked inode " << matches_[i] << ">\n";
+        }
+
+        for (size_t j = 0; j < names.size(); j++) {
+            out << names[j] << "\n";
+        }
+    }
+
+    out << std::flush;
+}
+
+const size_t Finder::memory_used() const
+{
+    return matches_.capacity() * sizeof(uint32_t) +
+        first_link_.capacity() * sizeof(uint32_t) +
+        links_.capacity() * sizeof(Link);
+}
+
+const void Finder::print_stats() const
+{
+    std::cout << "QUERY" << std::endl;
+    std::cout << "-----" << std::endl;
+    std::cout << "  Predicates: " << std::dec << predicates_.size() << std::endl;
+    std::cout << "  Inodes scanned: " << (table_ != nullptr ? table_->count : 0) << std::endl;
+    std::cout << "  Matches: " << matches_.size() << std::endl;
+    std::cout << "  Directory entries indexed: " << links_.size() << std::endl;
+    std::cout << "  Scan seconds: " << std::fixed << std::setprecision(6) << scan_seconds_ << std::endl;
+    std::cout << "  Index seconds: " << index_seconds_ << std::endl;
+}
+
+}; // namespace
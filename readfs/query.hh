@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "imgread.hh"
+
+namespace loomcom {
+
+//
+// find(1)-style metadata queries, run straight over the decoded i-list.
+//
+// A query is a list of predicates such as "size>4096" or "type=d",
+// all of which must hold. Worker threads take the i-list a range at a
+// time and test each predicate against a whole column at once (mode,
+// uid, size, mtime and so on), eight inodes to a SIMD compare, leaving
+// a bitmap of the inodes that pass. No FileEntry is made for anything.
+//
+// Paths come from a reverse index of every directory entry, built by
+// reading the directories straight out of their blocks, and only once
+// something has matched.
+//
+class Finder {
+public:
+    // Inodes per unit of work
+    const static uint32_t INODE_RANGE = 4096;
+
+    enum Field {
+        F_TYPE,                 // The file type bits of di_mode
+        F_PERM,                 // The permission bits of di_mode
+        F_NLINK,
+        F_UID,
+        F_GID,
+        F_SIZE,
+        F_ATIME,
+        F_MTIME,
+        F_CTIME
+    };
+
+    enum Op { OP_LT, OP_EQ, OP_GT };
+
+    struct Predicate {
+        Field field;
+        Op op;
+        uint32_t value;
+    };
+
+    // Parse one term: a field name, optionally after "-" or "--", then
+    // one of <, = or >, then a value. Sizes may end in k or M, times
+    // may be given as YYYY-MM-DD, types are f, d, c, b or p and
+    // permissions are octal. Throws if the term can't be parsed.
+    static Predicate parse(const std::string &term);
+
+    Finder(FileLoader &loader, unsigned threads);
+
+    const void add(const Predicate &p) { predicates_.push_back(p); }
+
+    // Forget the predicates, to run another query. The reverse index
+    // is kept.
+    const void clear() { predicates_.clear(); }
+
+    // The allocated inodes that pass every predicate, in order.
+    const std::vector<uint32_t> &run();
+
+    // Every path naming inode `inum`. Unlinked inodes have none.
+    const std::vector<std::string> paths(uint32_t inum);
+
+    // One line per path of each match, or a placeholder for a match
+    // that no directory names.
+    const void print(std::ostream &out);
+
+    // Bytes held by the matches and the reverse index
+    const size_t memory_used() const;
+
+    const void print_stats() const;
+
+private:
+    // One name of an inode: entry `name` in directory `parent`
+    struct Link {
+        uint32_t parent;
+        uint32_t next;          // Next name of the same inode, or NONE
+        std::string name;
+    };
+
+    const static uint32_t NONE = 0xffffffff;
+
+    void worker();
+    const void scan_range(uint32_t first, std::vector<uint32_t> &out) const;
+    const void build_links();
+    const bool dir_path(uint32_t inum, std::string &path) const;
+
+    FileLoader &loader_;
+    const unsigned threads_;
+    std::vector<Predicate> predicates_;
+
+    const InodeTable *table_;
+    std::atomic<uint32_t> next_range_;
+
+    // Matches of each range, then all of them in order
+    std::vector<std::vector<uint32_t> > range_matches_;
+    std::vector<uint32_t> matches_;
+
+    // The reverse index
+    bool links_built_;
+    std::vector<uint32_t> first_link_;  // Indexed by inode number
+    std::vector<Link> links_;
+
+    double scan_seconds_;
+    double index_seconds_;
+};
+
+}; // namespace
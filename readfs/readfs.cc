@@ -0,0 +1,213 @@
+//
+// The C API of readfs.h, over one FileLoader per open image.
+//
+// FileLoader is already safe to share between threads, and an open
+// file is never changed after readfs_file_open(), so nothing here needs
+// a lock of its own. No exception gets past the API: each becomes EIO,
+// or with readfs_open(), NULL and errno, which keeps open(2)'s reason
+// when the image couldn't be opened at all.
+//
+
+#include "readfs.h"
+
+#include "imgread.hh"
+#include "vtoc.hh"
+
+#include <errno.h>
+
+using namespace loomcom;
+
+struct readfs {
+    std::unique_ptr<FileLoader> loader;
+};
+
+struct readfs_file {
+    readfs_t *fs;
+    FileEntry::Ptr entry;
+    std::vector<Extent> extents;
+};
+
+static void fill_stat(const FileEntry &f, readfs_stat_t *st)
+{
+    st->ino = f.inode_num;
+    st->mode = f.inode.di_mode;
+    st->nlink = f.inode.di_nlink;
+    st->uid = f.inode.di_uid;
+    st->gid = f.inode.di_gid;
+    st->size = f.inode.di_size;
+    st->atime = f.inode.di_atime;
+    st->mtime = f.inode.di_mtime;
+    st->ctime = f.inode.di_ctime;
+}
+
+// Look up `path`, or return a negative errno value.
+static int find(readfs_t *fs, const char *path, FileEntry::Ptr &f)
+{
+    if (fs == NULL || path == NULL) {
+        return -EINVAL;
+    }
+
+    try {
+        f = fs->loader->lookup(path);
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+
+    return f == nullptr ? -ENOENT : 0;
+}
+
+readfs_t *readfs_open(const char *image, int partition, int flags)
+{
+    if (image == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    FileLoader::Options options;
+    options.use_mmap = (flags & READFS_PREAD) == 0;
+    options.use_index = (flags & READFS_NO_INDEX) == 0;
+
+    std::unique_ptr<readfs_t> fs(new readfs_t());
+
+    try {
+        ImageSource::Ptr source = ImageSource::open(image, options.use_mmap);
+
+        if (!Vtoc::select(*source, partition, options)) {
+            errno = ENXIO;
+            return NULL;
+        }
+
+        fs->loader.reset(new FileLoader(source, options));
+        fs->loader->load();
+    } catch (OpenError &e) {
+        errno = e.error();
+        return NULL;
+    } catch (std::exception &e) {
+        // Opened, but not a filesystem that can be read
+        errno = EIO;
+        return NULL;
+    }
+
+    return fs.release();
+}
+
+void readfs_close(readfs_t *fs)
+{
+    delete fs;
+}
+
+uint32_t readfs_block_size(const readfs_t *fs)
+{
+    return fs->loader->block_size();
+}
+
+int readfs_lookup(readfs_t *fs, const char *path, uint32_t *ino)
+{
+    FileEntry::Ptr f;
+    int rc = find(fs, path, f);
+
+    if (rc == 0 && ino != NULL) {
+        *ino = f->inode_num;
+    }
+
+    return rc;
+}
+
+int readfs_stat(readfs_t *fs, const char *path, readfs_stat_t *st)
+{
+    FileEntry::Ptr f;
+    int rc = find(fs, path, f);
+
+    if (rc == 0) {
+        fill_stat(*f, st);
+    }
+
+    return rc;
+}
+
+ssize_t readfs_readdir(readfs_t *fs, const char *path, size_t offset,
+                       readfs_dirent_t *ents, size_t max)
+{
+    FileEntry::Ptr dir;
+    int rc = find(fs, path, dir);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (!dir->is_dir) {
+        return -ENOTDIR;
+    }
+
+    size_t n = 0;
+
+    try {
+        const FileEntry::List &entries = dir->dir_entries();
+
+        for (size_t i = offset; i < entries.size() && n < max; i++, n++) {
+            const FileEntry &f = *entries[i];
+            size_t len = std::min(f.name.size(), sizeof(ents[n].name) - 1);
+
+            fill_stat(f, &ents[n].st);
+            memcpy(ents[n].name, f.name.data(), len);
+            ents[n].name[len] = '\0';
+        }
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+
+    return (ssize_t) n;
+}
+
+int readfs_file_open(readfs_t *fs, const char *path, readfs_file_t **file)
+{
+    FileEntry::Ptr f;
+    int rc = find(fs, path, f);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (f->is_dir) {
+        return -EISDIR;
+    }
+
+    if (f->file_type != FileEntry::FT_REG) {
+        return -EACCES;
+    }
+
+    std::unique_ptr<readfs_file_t> open(new readfs_file_t());
+    open->fs = fs;
+    open->entry = f;
+
+    try {
+        open->extents = fs->loader->extents(*f);
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+
+    *file = open.release();
+
+    return 0;
+}
+
+int readfs_file_stat(const readfs_file_t *file, readfs_stat_t *st)
+{
+    fill_stat(*file->entry, st);
+    return 0;
+}
+
+ssize_t readfs_read(readfs_file_t *file, uint64_t offset, void *buf, size_t len)
+{
+    try {
+        return (ssize_t) file->fs->loader->read_data(file->entry->inode, file->extents, offset,
+                                                     static_cast<uint8_t *>(buf), len);
+    } catch (std::exception &e) {
+        return -EIO;
+    }
+}
+
+void readfs_file_close(readfs_file_t *file)
+{
+    delete file;
+}
@@ -0,0 +1,94 @@
+/*
+ * libreadfs: read a SysV filesystem image from C, in process.
+ *
+ * A readfs_t is one open image, shared by any number of threads: all of
+ * them may look up, stat, list and read at once. A readfs_file_t holds
+ * what a file needs to be read without another lookup, and may also be
+ * read from several threads at once.
+ *
+ * Functions returning int return 0 or a negative errno value, as a FUSE
+ * operation would. Data is copied straight from the image (or its block
+ * cache) into the caller's buffer.
+ *
+ * Link with -lreadfs -lz -llzma -lpthread, or against libreadfs.so.
+ */
+
+#ifndef READFS_H
+#define READFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct readfs readfs_t;
+typedef struct readfs_file readfs_file_t;
+
+/* Flags for readfs_open() */
+#define READFS_PREAD     0x1    /* Read the image with pread(2), not mmap(2) */
+#define READFS_NO_INDEX  0x2    /* Ignore any sidecar index */
+
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;              /* Type and permissions, as in st_mode */
+    uint16_t nlink;
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+} readfs_stat_t;
+
+typedef struct {
+    readfs_stat_t st;
+    char name[15];              /* NUL terminated */
+} readfs_dirent_t;
+
+/*
+ * Open `image`, or partition `partition` of its VTOC if that is not -1.
+ * Returns NULL with errno set on failure: as open(2) sets it if the
+ * file can't be opened, ENXIO if there is no such SysV partition, or
+ * EIO if the filesystem can't be read.
+ */
+readfs_t *readfs_open(const char *image, int partition, int flags);
+void readfs_close(readfs_t *fs);
+
+uint32_t readfs_block_size(const readfs_t *fs);
+
+/*
+ * Paths are relative to the root of the filesystem; a leading / is
+ * optional. "." and ".." work as they do on the host, and the root is
+ * its own parent.
+ */
+int readfs_lookup(readfs_t *fs, const char *path, uint32_t *ino);
+int readfs_stat(readfs_t *fs, const char *path, readfs_stat_t *st);
+
+/*
+ * Fill up to `max` entries of directory `path`, starting with entry
+ * `offset`, not counting "." and "..". Returns the number filled, which
+ * is less than `max` only at the end of the directory, or a negative
+ * errno value.
+ */
+ssize_t readfs_readdir(readfs_t *fs, const char *path, size_t offset,
+                       readfs_dirent_t *ents, size_t max);
+
+/* Regular files only. */
+int readfs_file_open(readfs_t *fs, const char *path, readfs_file_t **file);
+int readfs_file_stat(const readfs_file_t *file, readfs_stat_t *st);
+
+/*
+ * Read up to `len` bytes at `offset` into `buf`. Returns the number
+ * read, 0 at the end of the file, or a negative errno value.
+ */
+ssize_t readfs_read(readfs_file_t *file, uint64_t offset, void *buf, size_t len);
+void readfs_file_close(readfs_file_t *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,174 @@
+#include "scheduler.hh"
+
+#include <iostream>
+#include <exception>
+
+namespace loomcom {
+
+thread_local Scheduler *Scheduler::owner_ = nullptr;
+thread_local int Scheduler::current_ = -1;
+
+Scheduler::Scheduler(unsigned threads) :
+    wakeups_(0),
+    stopping_(false),
+    pending_(0),
+    next_worker_(0),
+    jobs_(0),
+    steals_(0)
+{
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        threads_.push_back(std::thread(&Scheduler::run, this, i));
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        stopping_ = true;
+    }
+    work_ready_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i].join();
+    }
+}
+
+void Scheduler::spawn(const Job &job)
+{
+    unsigned target;
+
+    if (owner_ == this) {
+        target = (unsigned) current_;
+    } else {
+        target = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    }
+
+    pending_.fetch_add(1);
+
+    {
+        std::lock_guard<std::mutex> guard(workers_[target]->lock);
+        workers_[target]->jobs.push_back(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        wakeups_++;
+    }
+    work_ready_.notify_one();
+}
+
+void Scheduler::wait()
+{
+    std::unique_lock<std::mutex> guard(idle_lock_);
+    all_done_.wait(guard, [this]() { return pending_.load() == 0; });
+}
+
+void Scheduler::run(unsigned self)
+{
+    owner_ = this;
+    current_ = (int) self;
+
+    for (;;) {
+        uint64_t seen;
+
+        {
+            std::lock_guard<std::mutex> guard(idle_lock_);
+
+            if (stopping_) {
+                return;
+            }
+
+            seen = wakeups_;
+        }
+
+        Job job;
+
+        if (take(self, job)) {
+            try {
+                job();
+            } catch (std::exception &e) {
+                std::cerr << "A scheduled job failed." << std::endl;
+            }
+
+            jobs_.fetch_add(1, std::memory_order_relaxed);
+            job = Job();
+            finished();
+            continue;
+        }
+
+        // Nothing anywhere. Sleep until something is spawned, unless
+        // something was while we were looking.
+        std::unique_lock<std::mutex> guard(idle_lock_);
+        work_ready_.wait(guard, [this, seen]() { return stopping_ || wakeups_ != seen; });
+    }
+}
+
+//
+// Take this worker's newest job, or failing that the oldest job of
+// some other worker, starting with the one after this.
+//
+bool Scheduler::take(unsigned self, Job &job)
+{
+    {
+        Worker &w = *workers_[self];
+        std::lock_guard<std::mutex> guard(w.lock);
+
+        if (!w.jobs.empty()) {
+            job = std::move(w.jobs.back());
+            w.jobs.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers_.size(); i++) {
+        Worker &victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            steals_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Scheduler::finished()
+{
+    if (pending_.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> guard(idle_lock_);
+        all_done_.notify_all();
+    }
+}
+
+Scheduler::Stats Scheduler::stats() const
+{
+    Stats s;
+    s.jobs = jobs_.load(std::memory_order_relaxed);
+    s.steals = steals_.load(std::memory_order_relaxed);
+    return s;
+}
+
+void Scheduler::print_stats() const
+{
+    Stats s = stats();
+
+    std::cout << "SCHEDULER" << std::endl;
+    std::cout << "---------" << std::endl;
+    std::cout << "  Worker threads: " << std::dec << workers_.size() << std::endl;
+    std::cout << "  Jobs run: " << s.jobs << std::endl;
+    std::cout << "  Jobs stolen: " << s.steals << std::endl;
+}
+
+}; // namespace
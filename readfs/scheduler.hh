@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace loomcom {
+
+//
+// A work-stealing pool of threads for many small jobs.
+//
+// Every worker has a deque of its own. Jobs spawned from inside a job
+// go on the back of the running worker's deque, and a worker takes
+// its next job from the back too, so it finishes what it started
+// while its working set is still warm. A worker with nothing left
+// steals from the front of another's deque, where the oldest, and
+// usually biggest, pieces of work are. Jobs spawned from outside the
+// pool are dealt out to the workers in turn.
+//
+class Scheduler {
+public:
+    typedef std::function<void()> Job;
+
+    struct Stats {
+        Stats() : jobs(0), steals(0) {}
+
+        uint64_t jobs;          // Jobs run
+        uint64_t steals;        // Of those, jobs taken from another worker
+    };
+
+    explicit Scheduler(unsigned threads);
+
+    // Waits for the workers to finish whatever they are running.
+    ~Scheduler();
+
+    unsigned threads() const { return (unsigned) workers_.size(); }
+
+    // Queue a job. A job that throws is reported and dropped.
+    void spawn(const Job &job);
+
+    // Wait until every job has run, including any spawned meanwhile.
+    void wait();
+
+    // The worker running the calling thread's job, from 0 up to
+    // threads() - 1, or -1 outside the pool.
+    static int current() { return current_; }
+
+    Stats stats() const;
+    void print_stats() const;
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Job> jobs;
+    };
+
+    void run(unsigned self);
+    bool take(unsigned self, Job &job);
+    void finished();
+
+    std::vector<std::unique_ptr<Worker> > workers_;
+    std::vector<std::thread> threads_;
+
+    // Sleeping workers wait for `wakeups_` to move; wait() waits for
+    // `pending_` to reach zero.
+    std::mutex idle_lock_;
+    std::condition_variable work_ready_;
+    std::condition_variable all_done_;
+    uint64_t wakeups_;
+    bool stopping_;
+
+    std::atomic<uint64_t> pending_;     // Spawned but not yet finished
+    std::atomic<unsigned> next_worker_;
+    std::atomic<uint64_t> jobs_;
+    std::atomic<uint64_t> steals_;
+
+    static thread_local Scheduler *owner_;
+    static thread_local int current_;
+};
+
+}; // namespace
@@ -0,0 +1,695 @@
+#include "server.hh"
+#include "vtoc.hh"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace loomcom {
+
+// Bytes taken from a connection at a time
+static const size_t RECV_SIZE = 64 * 1024;
+
+static void set32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t) (val >> 24);
+    p[1] = (uint8_t) (val >> 16);
+    p[2] = (uint8_t) (val >> 8);
+    p[3] = (uint8_t) val;
+}
+
+static void put16(std::vector<uint8_t> &out, uint16_t val)
+{
+    out.push_back((uint8_t) (val >> 8));
+    out.push_back((uint8_t) val);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t val)
+{
+    put16(out, (uint16_t) (val >> 16));
+    put16(out, (uint16_t) val);
+}
+
+static void put_str(std::vector<uint8_t> &out, std::string_view s)
+{
+    put16(out, (uint16_t) s.size());
+    out.insert(out.end(), s.begin(), s.begin() + (uint16_t) s.size());
+}
+
+static void put_stat(std::vector<uint8_t> &out, const FileEntry &f)
+{
+    put32(out, f.inode_num);
+    put16(out, f.inode.di_mode);
+    put16(out, f.inode.di_nlink);
+    put16(out, f.inode.di_uid);
+    put16(out, f.inode.di_gid);
+    put32(out, f.inode.di_size);
+    put32(out, f.inode.di_atime);
+    put32(out, f.inode.di_mtime);
+    put32(out, f.inode.di_ctime);
+}
+
+//
+// The fields of a request, in order. Reading past the end gives zeros
+// and marks the request bad, so a short request is caught once, at the
+// end, rather than at every field.
+//
+class Cursor {
+public:
+    Cursor(const uint8_t *p, size_t len) : p_(p), left_(len), bad_(false) {}
+
+    uint8_t u8() { return take(1) ? p_[-1] : 0; }
+    uint16_t u16() { return take(2) ? be16(p_ - 2) : 0; }
+    uint32_t u32() { return take(4) ? be32(p_ - 4) : 0; }
+    uint64_t u64() { uint64_t hi = u32(); return (hi << 32) | u32(); }
+
+    std::string str()
+    {
+        uint16_t len = u16();
+        return take(len) ? std::string(reinterpret_cast<const char *>(p_ - len), len) : "";
+    }
+
+    bool bad() const { return bad_; }
+
+private:
+    bool take(size_t n)
+    {
+        if (bad_ || n > left_) {
+            bad_ = true;
+            return false;
+        }
+
+        p_ += n;
+        left_ -= n;
+        return true;
+    }
+
+    const uint8_t *p_;
+    size_t left_;
+    bool bad_;
+};
+
+static bool send_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+Server::Server(const std::string &socket_path, const FileLoader::Options &options,
+               size_t budget, unsigned threads) :
+    socket_path_(socket_path),
+    options_(options),
+    budget_(budget),
+    threads_(threads > 0 ? threads : 1),
+    listen_fd_(-1),
+    pool_bytes_(0),
+    connections_(0),
+    requests_(0),
+    errors_(0),
+    bytes_sent_(0),
+    loads_(0),
+    evictions_(0)
+{
+    if (pipe(wake_fd_) < 0) {
+        std::cerr << "pipe: " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+}
+
+Server::~Server()
+{
+    close(wake_fd_[0]);
+    close(wake_fd_[1]);
+}
+
+const void Server::run()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (socket_path_.size() >= sizeof(addr.sun_path)) {
+        std::cerr << socket_path_ << ": Socket path too long" << std::endl;
+        throw std::exception();
+    }
+
+    memcpy(addr.sun_path, socket_path_.c_str(), socket_path_.size());
+
+    // A socket left behind by a server that didn't shut down cleanly
+    // would stop the bind; anything else there is left alone.
+    struct stat st;
+
+    if (lstat(socket_path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path_.c_str());
+    }
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listen_fd_ < 0 ||
+        bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd_, SOMAXCONN) < 0) {
+        std::cerr << socket_path_ << ": " << strerror(errno) << std::endl;
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+        }
+        throw std::exception();
+    }
+
+    std::cout << "Serving on " << socket_path_ << std::endl;
+
+    for (;;) {
+        struct pollfd fds[2];
+        fds[0].fd = listen_fd_;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake_fd_[0];
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "poll: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        int fd = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        connections_++;
+
+        std::list<Client> finished;
+        std::lock_guard<std::mutex> guard(clients_lock_);
+
+        for (std::list<Client>::iterator it = clients_.begin(); it != clients_.end(); ) {
+            std::list<Client>::iterator next = std::next(it);
+
+            if (it->done) {
+                finished.splice(finished.end(), clients_, it);
+            }
+
+            it = next;
+        }
+
+        clients_.emplace_back();
+        Client &client = clients_.back();
+        client.fd = fd;
+        client.done = false;
+        client.thread = std::thread(&Server::serve, this, &client);
+
+        // These have returned, so joining them doesn't wait.
+        for (std::list<Client>::iterator it = finished.begin(); it != finished.end(); it++) {
+            it->thread.join();
+            close(it->fd);
+        }
+    }
+
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+
+    // Hang up on everyone, then wait for them to notice.
+    std::list<Client> clients;
+    {
+        std::lock_guard<std::mutex> guard(clients_lock_);
+        clients.splice(clients.end(), clients_);
+
+        for (std::list<Client>::iterator it = clients.begin(); it != clients.end(); it++) {
+            shutdown(it->fd, SHUT_RDWR);
+        }
+    }
+
+    for (std::list<Client>::iterator it = clients.begin(); it != clients.end(); it++) {
+        it->thread.join();
+        close(it->fd);
+    }
+}
+
+const void Server::stop()
+{
+    char c = 0;
+
+    // Nothing to be done about a failure in a signal handler.
+    if (write(wake_fd_[1], &c, 1) < 0) {
+        return;
+    }
+}
+
+//
+// Answer one connection until it closes. Whatever has arrived is
+// answered in one go: every complete request in it is handled, and the
+// responses are sent together.
+//
+const void Server::serve(Client *client)
+{
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    OpenFile open;
+    bool ok = true;
+
+    while (ok) {
+        size_t have = in.size();
+        in.resize(have + RECV_SIZE);
+
+        ssize_t n = recv(client->fd, in.data() + have, RECV_SIZE, 0);
+
+        if (n < 0 && errno == EINTR) {
+            in.resize(have);
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        in.resize(have + n);
+
+        size_t pos = 0;
+
+        while (ok && in.size() - pos >= 4) {
+            uint32_t len = be32(&in[pos]);
+
+            if (len > MAX_REQUEST) {
+                ok = false;
+                break;
+            }
+
+            if (in.size() - pos - 4 < len) {
+                break;
+            }
+
+            ok = handle(&in[pos + 4], len, out, open);
+            pos += 4 + len;
+
+            // Don't let a long pipeline of reads pile up unsent.
+            if (ok && out.size() >= MAX_READ) {
+                ok = send_all(client->fd, out.data(), out.size());
+                bytes_sent_ += out.size();
+                out.clear();
+            }
+        }
+
+        in.erase(in.begin(), in.begin() + pos);
+
+        if (ok && !out.empty()) {
+            ok = send_all(client->fd, out.data(), out.size());
+            bytes_sent_ += out.size();
+            out.clear();
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(clients_lock_);
+    client->done = true;
+}
+
+//
+// Handle one request, appending its response to `out`. Returns false
+// if it is too garbled to answer, and the connection should be closed.
+//
+const bool Server::handle(const uint8_t *req, size_t len, std::vector<uint8_t> &out,
+                          OpenFile &open)
+{
+    Cursor c(req, len);
+    uint32_t tag = c.u32();
+    uint8_t op = c.u8();
+    uint16_t partition = c.u16();
+    std::string path = c.str();
+
+    if (c.bad()) {
+        return false;
+    }
+
+    requests_++;
+
+    // The header goes in once the status is known.
+    size_t start = out.size();
+    out.resize(start + 12);
+
+    int status = -EINVAL;
+    ImagePtr image;
+
+    try {
+        switch (op) {
+        case OP_STAT: {
+            std::string file = c.str();
+
+            if (!c.bad() && (image = acquire(path, partition, status)) != nullptr) {
+                status = op_stat(*image, file, out);
+            }
+            break;
+        }
+        case OP_READDIR: {
+            std::string file = c.str();
+            uint32_t first = c.u32();
+            uint32_t max = c.u32();
+
+            if (!c.bad() && (image = acquire(path, partition, status)) != nullptr) {
+                status = op_readdir(*image, file, first, max, out);
+            }
+            break;
+        }
+        case OP_READ: {
+            std::string file = c.str();
+            uint64_t offset = c.u64();
+            uint32_t count = c.u32();
+
+            if (!c.bad() && count <= MAX_READ &&
+                (image = acquire(path, partition, status)) != nullptr) {
+                status = op_read(image, file, offset, count, out, open);
+            }
+            break;
+        }
+        case OP_FIND: {
+            std::vector<std::string> terms(c.u16());
+
+            for (size_t i = 0; i < terms.size(); i++) {
+                terms[i] = c.str();
+            }
+
+            if (!c.bad() && (image = acquire(path, partition, status)) != nullptr) {
+                status = op_find(*image, terms, out);
+            }
+            break;
+        }
+        }
+    } catch (std::exception &e) {
+        status = -EIO;
+    }
+
+    if (status != 0) {
+        out.resize(start + 12);
+        errors_++;
+    }
+
+    set32(&out[start], (uint32_t) (out.size() - start - 4));
+    set32(&out[start + 4], tag);
+    set32(&out[start + 8], (uint32_t) status);
+
+    if (image) {
+        charge(image);
+    }
+
+    return true;
+}
+
+const int Server::op_stat(Image &image, const std::string &path, std::vector<uint8_t> &out)
+{
+    FileEntry::Ptr f = image.loader->lookup(path);
+
+    if (f == nullptr) {
+        return -ENOENT;
+    }
+
+    put_stat(out, *f);
+
+    return 0;
+}
+
+const int Server::op_readdir(Image &image, const std::string &path, uint32_t first,
+                             uint32_t max, std::vector<uint8_t> &out)
+{
+    FileEntry::Ptr dir = image.loader->lookup(path);
+
+    if (dir == nullptr) {
+        return -ENOENT;
+    }
+
+    if (!dir->is_dir) {
+        return -ENOTDIR;
+    }
+
+    const FileEntry::List &entries = dir->dir_entries();
+    size_t count_at = out.size();
+    uint32_t n = 0;
+
+    put32(out, 0);
+
+    for (size_t i = first; i < entries.size() && n < max; i++, n++) {
+        put_stat(out, *entries[i]);
+        put_str(out, entries[i]->name);
+    }
+
+    set32(&out[count_at], n);
+
+    return 0;
+}
+
+//
+// File data goes straight from the image into the response.
+//
+const int Server::op_read(const ImagePtr &image, const std::string &path, uint64_t offset,
+                          uint32_t len, std::vector<uint8_t> &out, OpenFile &open)
+{
+    if (open.image != image || open.path != path) {
+        FileEntry::Ptr f = image->loader->lookup(path);
+
+        if (f == nullptr) {
+            return -ENOENT;
+        }
+
+        if (f->is_dir) {
+            return -EISDIR;
+        }
+
+        if (f->file_type != FileEntry::FT_REG) {
+            return -EACCES;
+        }
+
+        open.image.reset();
+        open.extents = image->loader->extents(*f);
+        open.image = image;
+        open.path = path;
+        open.entry = f;
+    }
+
+    size_t at = out.size();
+    out.resize(at + len);
+
+    size_t n = image->loader->read_data(open.entry->inode, open.extents, offset,
+                                        out.data() + at, len);
+    out.resize(at + n);
+
+    return 0;
+}
+
+//
+// Each image keeps one Finder, so the reverse index is built by the
+// first query that matches anything and reused by all the rest.
+//
+const int Server::op_find(Image &image, const std::vector<std::string> &terms,
+                          std::vector<uint8_t> &out)
+{
+    std::vector<Finder::Predicate> predicates;
+
+    try {
+        for (size_t i = 0; i < terms.size(); i++) {
+            predicates.push_back(Finder::parse(terms[i]));
+        }
+    } catch (std::exception &e) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> guard(image.lock);
+
+    if (!image.finder) {
+        image.finder.reset(new Finder(*image.loader, threads_));
+    }
+
+    Finder &finder = *image.finder;
+    finder.clear();
+
+    for (size_t i = 0; i < predicates.size(); i++) {
+        finder.add(predicates[i]);
+    }
+
+    const std::vector<uint32_t> &matches = finder.run();
+
+    put32(out, (uint32_t) matches.size());
+
+    for (size_t i = 0; i < matches.size(); i++) {
+        std::vector<std::string> names = finder.paths(matches[i]);
+
+        put32(out, matches[i]);
+        put16(out, (uint16_t) names.size());
+
+        for (size_t j = 0; j < names.size(); j++) {
+            put_str(out, names[j]);
+        }
+    }
+
+    return 0;
+}
+
+Server::ImagePtr Server::acquire(const std::string &path, int partition, int &error)
+{
+    if (partition == NO_PARTITION) {
+        partition = -1;
+    }
+
+    // Images are pooled by where they really are, however they're named.
+    char real[PATH_MAX];
+
+    if (realpath(path.c_str(), real) == NULL) {
+        error = -errno;
+        return nullptr;
+    }
+
+    std::string key = std::string(real) + '\0' + std::to_string(partition);
+    ImagePtr image;
+
+    {
+        std::lock_guard<std::mutex> guard(pool_lock_);
+        std::map<std::string, ImagePtr>::iterator it = pool_.find(key);
+
+        if (it != pool_.end()) {
+            image = it->second;
+            lru_.splice(lru_.begin(), lru_, image->lru);
+        } else {
+            image = std::make_shared<Image>();
+            image->key = key;
+            image->path = real;
+            image->partition = partition;
+            lru_.push_front(key);
+            image->lru = lru_.begin();
+            pool_[key] = image;
+        }
+    }
+
+    {
+        // Anyone else wanting the image while it loads waits here.
+        std::lock_guard<std::mutex> guard(image->lock);
+
+        if (!image->loader && image->error == 0) {
+            try {
+                FileLoader::Options options = options_;
+                ImageSource::Ptr source = ImageSource::open(image->path, options.use_mmap);
+
+                if (!Vtoc::select(*source, partition, options)) {
+                    image->error = -ENXIO;
+                } else {
+                    std::unique_ptr<FileLoader> loader(new FileLoader(source, options));
+                    loader->load();
+                    image->loader = std::move(loader);
+                    loads_++;
+                }
+            } catch (OpenError &e) {
+                image->error = -e.error();
+            } catch (std::exception &e) {
+                image->error = -EIO;
+            }
+        }
+    }
+
+    if (image->error != 0) {
+        // Forget it, so that a later request tries again.
+        std::lock_guard<std::mutex> guard(pool_lock_);
+        std::map<std::string, ImagePtr>::iterator it = pool_.find(key);
+
+        if (it != pool_.end() && it->second == image) {
+            lru_.erase(image->lru);
+            pool_.erase(it);
+        }
+
+        error = image->error;
+        return nullptr;
+    }
+
+    return image;
+}
+
+//
+// Bring the pool's count of an image's memory up to date, then drop
+// least recently used images until the pool is back under budget. The
+// image just used is never dropped, so one image bigger than the whole
+// budget can still be served.
+//
+const void Server::charge(const ImagePtr &image)
+{
+    size_t bytes;
+
+    {
+        // A find running on the image will charge it when it's done.
+        std::unique_lock<std::mutex> guard(image->lock, std::try_to_lock);
+
+        if (!guard.owns_lock() || !image->loader) {
+            return;
+        }
+
+        bytes = image->loader->memory_used();
+
+        if (image->finder) {
+            bytes += image->finder->memory_used();
+        }
+    }
+
+    // Dropped outside the lock, since unmapping an image takes a while.
+    std::vector<ImagePtr> evicted;
+
+    {
+        std::lock_guard<std::mutex> guard(pool_lock_);
+        std::map<std::string, ImagePtr>::iterator it = pool_.find(image->key);
+
+        if (it == pool_.end() || it->second != image) {
+            return;
+        }
+
+        pool_bytes_ = pool_bytes_ - image->bytes + bytes;
+        image->bytes = bytes;
+
+        while (pool_bytes_ > budget_ && !lru_.empty()) {
+            std::map<std::string, ImagePtr>::iterator victim = pool_.find(lru_.back());
+
+            if (victim->second == image) {
+                break;
+            }
+
+            pool_bytes_ -= victim->second->bytes;
+            evicted.push_back(victim->second);
+            pool_.erase(victim);
+            lru_.pop_back();
+            evictions_++;
+        }
+    }
+}
+
+const void Server::print_stats() const
+{
+    std::cout << "SERVER" << std::endl;
+    std::cout << "------" << std::endl;
+    std::cout << "  Connections: " << std::dec << connections_ << std::endl;
+    std::cout << "  Requests: " << requests_ << std::endl;
+    std::cout << "  Errors: " << errors_ << std::endl;
+    std::cout << "  Bytes sent: " << bytes_sent_ << std::endl;
+    std::cout << "  Images loaded: " << loads_ << std::endl;
+    std::cout << "  Images evicted: " << evictions_ << std::endl;
+    std::cout << "  Images held: " << pool_.size() << std::endl;
+    std::cout << "  Pool bytes: " << pool_bytes_ << " of " << budget_ << std::endl;
+}
+
+}; // namespace
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "imgread.hh"
+#include "query.hh"
+
+namespace loomcom {
+
+//
+// A daemon answering requests about many images from one pool of
+// loaded ones, over a Unix socket.
+//
+// Each request names its image. The first request for an image loads
+// it, and every later one, from any client, shares its mapping, block
+// cache, dentry cache, decoded i-list and find index. The pool holds
+// as many images as fit its memory budget; once it is over, whole
+// images are dropped, least recently used first. A dropped image that
+// a request is still using lives until that request is done.
+//
+// The protocol is binary and big-endian, like the disk. A request is
+//
+//     u32 length           of the rest of the request
+//     u32 tag              echoed in the response
+//     u8  op
+//     u16 partition        VTOC partition, or 0xffff for none
+//     str image            a u16 length, then that many bytes
+//     ...                  the arguments of `op`
+//
+// and a response is
+//
+//     u32 length           of the rest of the response
+//     u32 tag
+//     i32 status           0, or a negative errno value: for an image
+//                          that can't be loaded, as open(2) would set
+//                          it, -ENXIO for no such partition, or -EIO if
+//                          it holds no readable filesystem
+//     ...                  the result, if status is 0
+//
+// Clients may send any number of requests without waiting. Requests
+// on one connection are answered in order, and the answers to all the
+// requests that arrived together go back in one write.
+//
+class Server {
+public:
+    enum Op {
+        OP_STAT = 1,            // str path -> stat
+        OP_READDIR = 2,         // str path, u32 first, u32 max -> u32 n, n * (stat, str name)
+        OP_READ = 3,            // str path, u64 offset, u32 len -> the data
+        OP_FIND = 4,            // u16 n, n * str term -> u32 n, n * (u32 inum, u16 m, m * str path)
+    };
+
+    // A stat is u32 inum, u16 mode, nlink, uid, gid, then u32 size,
+    // atime, mtime and ctime.
+    const static size_t STAT_SIZE = 28;
+
+    // Largest request, and largest read, that will be served
+    const static size_t MAX_REQUEST = 64 * 1024;
+    const static size_t MAX_READ = 4 * 1024 * 1024;
+
+    const static uint16_t NO_PARTITION = 0xffff;
+
+    Server(const std::string &socket_path, const FileLoader::Options &options,
+           size_t budget, unsigned threads);
+    ~Server();
+
+    // Serve until stop() is called.
+    const void run();
+
+    // Safe to call from a signal handler.
+    const void stop();
+
+    const void print_stats() const;
+
+private:
+    // One image of the pool
+    struct Image {
+        Image() : partition(-1), bytes(0), error(0) {}
+
+        std::string key;        // Into pool_
+        std::string path;
+        int partition;
+        std::unique_ptr<FileLoader> loader;
+
+        // Held while loading, while finding and while counting memory,
+        // none of which FileLoader and Finder allow at once
+        std::mutex lock;
+        std::unique_ptr<Finder> finder;
+
+        size_t bytes;           // Memory charged to the pool
+        int error;              // Why it didn't load, or 0
+        std::list<std::string>::iterator lru;
+    };
+
+    typedef std::shared_ptr<Image> ImagePtr;
+
+    // What a connection keeps from one read to the next, so that a
+    // file read in many pieces is looked up once
+    struct OpenFile {
+        OpenFile() : entry(nullptr) {}
+
+        ImagePtr image;
+        std::string path;
+        FileEntry::Ptr entry;
+        std::vector<Extent> extents;
+    };
+
+    struct Client {
+        int fd;
+        bool done;              // serve() has returned
+        std::thread thread;
+    };
+
+    const void serve(Client *client);
+    const bool handle(const uint8_t *req, size_t len, std::vector<uint8_t> &out,
+                      OpenFile &open);
+    const int op_stat(Image &image, const std::string &path, std::vector<uint8_t> &out);
+    const int op_readdir(Image &image, const std::string &path, uint32_t first,
+                         uint32_t max, std::vector<uint8_t> &out);
+    const int op_read(const ImagePtr &image, const std::string &path, uint64_t offset,
+                      uint32_t len, std::vector<uint8_t> &out, OpenFile &open);
+    const int op_find(Image &image, const std::vector<std::string> &terms,
+                      std::vector<uint8_t> &out);
+
+    // The pooled image, loading it if need be, or nullptr with `error`
+    // set if it can't be loaded.
+    ImagePtr acquire(const std::string &path, int partition, int &error);
+    const void charge(const ImagePtr &image);
+
+    const std::string socket_path_;
+    const FileLoader::Options options_;
+    const size_t budget_;
+    const unsigned threads_;
+
+    int listen_fd_;
+    int wake_fd_[2];            // Written by stop() to end run()
+
+    // Connections, reaped as new ones arrive
+    std::mutex clients_lock_;
+    std::list<Client> clients_;
+
+    // The pool, keyed by image path and partition, and its keys from
+    // most to least recently used
+    std::mutex pool_lock_;
+    std::map<std::string, ImagePtr> pool_;
+    std::list<std::string> lru_;
+    size_t pool_bytes_;
+
+    std::atomic<uint64_t> connections_;
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> bytes_sent_;
+    std::atomic<uint64_t> loads_;
+    std::atomic<uint64_t> evictions_;
+};
+
+}; // namespace
@@ -0,0 +1,156 @@
+#include "synth.hh"
+
+#include <stdio.h>
+
+namespace loomcom {
+
+// Fixed s_time, so that images are reproducible
+static const uint32_t SYNTH_TIME = 560000000;
+
+// splitmix64: small, fast and good enough for test data
+static inline uint64_t next_random(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t file_size(const SyntheticImage::Spec &spec, uint64_t &state)
+{
+    uint64_t r = next_random(state);
+
+    if (spec.max_size <= spec.min_size) {
+        return spec.min_size;
+    }
+
+    if (spec.distribution == SyntheticImage::SIZE_UNIFORM) {
+        return spec.min_size + r % (spec.max_size - spec.min_size + 1);
+    }
+
+    double lo = log((double) spec.min_size + 1);
+    double hi = log((double) spec.max_size + 1);
+    double x = lo + (hi - lo) * ((double) (r >> 11) / (double) (1ULL << 53));
+
+    return std::min(spec.max_size, (uint64_t) exp(x) - 1);
+}
+
+const SyntheticImage::Stats SyntheticImage::write(const std::string &file_name, const Spec &spec)
+{
+    Stats stats;
+    uint32_t block_size = spec.type == 1 ? 512 : 1024;
+
+    // Count the directories level by level.
+    uint64_t dirs = 0;
+    uint64_t level = 1;
+    for (uint32_t d = 0; d < spec.depth; d++) {
+        level *= spec.fanout;
+        dirs += level;
+    }
+
+    uint64_t inodes = dirs + spec.files + FileLoader::ROOT_INODE;
+
+    if (inodes > 65000) {
+        std::cerr << "A tree of " << dirs << " directories and " << spec.files <<
+            " files needs more inodes than a SysV filesystem has" << std::endl;
+        throw std::exception();
+    }
+
+    // Sizes first, so the filesystem can be made just big enough.
+    uint64_t state = spec.seed;
+    std::vector<uint64_t> sizes(spec.files);
+    uint64_t blocks = 0;
+
+    for (uint32_t i = 0; i < spec.files; i++) {
+        sizes[i] = file_size(spec, state);
+        blocks += ImageWriter::blocks_for(sizes[i], block_size);
+    }
+
+    uint32_t per_dir = (uint32_t) (spec.files / (dirs + 1) + 1);
+    uint64_t dir_size = (uint64_t) (per_dir + spec.fanout + 2) * FileLoader::DIRENTRY_SIZE;
+    blocks += (dirs + 1) * ImageWriter::blocks_for(dir_size, block_size);
+
+    ImageWriter::Options options;
+    options.type = spec.type;
+    options.inodes = (uint32_t) (inodes + inodes / 16 + 16);
+    options.time = SYNTH_TIME;
+    options.fname = "synth";
+    options.fpack = "bench";
+
+    uint32_t ilist = (options.inodes + (block_size / FileLoader::INODE_SIZE) - 1) /
+        (block_size / FileLoader::INODE_SIZE);
+    blocks += 2 + ilist;
+
+    // Leave some room on the free list, so it has a chain to follow.
+    options.blocks = (uint32_t) (blocks + blocks / 16 + 256);
+
+    ImageWriter writer(file_name, options);
+
+    ImageWriter::Attr dir_attr;
+    dir_attr.mode = 0755;
+    dir_attr.atime = dir_attr.mtime = dir_attr.ctime = SYNTH_TIME;
+
+    // Breadth first, so directory inodes of a level sit together.
+    std::vector<uint32_t> parents(1, writer.root());
+    std::vector<uint32_t> all(1, writer.root());
+
+    for (uint32_t d = 0; d < spec.depth; d++) {
+        std::vector<uint32_t> children;
+        char name[16];
+
+        for (size_t p = 0; p < parents.size(); p++) {
+            for (uint32_t i = 0; i < spec.fanout; i++) {
+                snprintf(name, sizeof(name), "d%u", i);
+                children.push_back(writer.mkdir(parents[p], name, dir_attr));
+            }
+        }
+
+        all.insert(all.end(), children.begin(), children.end());
+        parents.swap(children);
+    }
+
+    stats.dirs = (uint32_t) (all.size() - 1);
+
+    std::vector<uint8_t> data;
+    ImageWriter::Attr file_attr;
+    file_attr.atime = file_attr.mtime = file_attr.ctime = SYNTH_TIME;
+
+    for (uint32_t i = 0; i < spec.files; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%u", (uint32_t) (i / all.size()));
+
+        data.resize(sizes[i]);
+        for (size_t j = 0; j < data.size(); j += 8) {
+            uint64_t r = next_random(state);
+            memcpy(&data[j], &r, std::min<size_t>(8, data.size() - j));
+        }
+
+        file_attr.uid = (uint16_t) (i % 7);
+        writer.add_file(all[i % all.size()], name, file_attr, data.data(), data.size());
+
+        stats.files++;
+        stats.bytes += sizes[i];
+    }
+
+    writer.finish();
+
+    stats.blocks = options.blocks;
+
+    return stats;
+}
+
+const void SyntheticImage::print_stats(const Spec &spec, const Stats &stats)
+{
+    std::cout << "SYNTHETIC IMAGE" << std::endl;
+    std::cout << "---------------" << std::endl;
+    std::cout << "  Block size: " << std::dec << (spec.type == 1 ? 512 : 1024) << std::endl;
+    std::cout << "  Directories: " << stats.dirs << " (fan-out " << spec.fanout <<
+        ", depth " << spec.depth << ")" << std::endl;
+    std::cout << "  Files: " << stats.files << " (" <<
+        (spec.distribution == SIZE_UNIFORM ? "uniform" : "log-uniform") << " " <<
+        spec.min_size << "-" << spec.max_size << " bytes)" << std::endl;
+    std::cout << "  Bytes of file data: " << stats.bytes << std::endl;
+    std::cout << "  Size in blocks: " << stats.blocks << std::endl;
+}
+
+}; // namespace
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+
+#include "writer.hh"
+
+namespace loomcom {
+
+//
+// Synthetic SysV images for benchmarking. The tree is a complete
+// `fanout`-ary tree of directories `depth` levels deep, with the files
+// dealt out round-robin across every directory, root included. File
+// sizes and contents come from a seeded generator, so the same spec
+// always makes the same image.
+//
+class SyntheticImage {
+public:
+    enum SizeDistribution {
+        SIZE_UNIFORM,           // Evenly spread over [min_size, max_size]
+        SIZE_LOG                // Log-uniform: mostly small, a few large
+    };
+
+    struct Spec {
+        Spec() : type(2), files(2000), fanout(8), depth(2), min_size(0),
+                 max_size(64 * 1024), distribution(SIZE_LOG), seed(1) {}
+
+        uint32_t type;          // s_type: 1 for 512-byte blocks, 2 for 1K
+        uint32_t files;         // Regular files
+        uint32_t fanout;        // Subdirectories per directory
+        uint32_t depth;         // Levels of directories below the root
+        uint64_t min_size;
+        uint64_t max_size;
+        SizeDistribution distribution;
+        uint64_t seed;
+    };
+
+    struct Stats {
+        Stats() : dirs(0), files(0), bytes(0), blocks(0) {}
+
+        uint32_t dirs;          // Not counting the root
+        uint32_t files;
+        uint64_t bytes;         // File data
+        uint32_t blocks;        // s_fsize
+    };
+
+    // Write the image described by `spec` to `file_name`.
+    static const Stats write(const std::string &file_name, const Spec &spec);
+
+    static const void print_stats(const Spec &spec, const Stats &stats);
+};
+
+}; // namespace
@@ -0,0 +1,231 @@
+#include "trace.hh"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace loomcom {
+
+static const char *counter_names[Trace::NUM_COUNTERS] = {
+    "Bytes read",
+    "I/O calls",
+    "Cache hits",
+    "Cache misses",
+    "Direct mapped blocks",
+    "Inodes decoded",
+    "Directories read",
+    "Directory entries",
+};
+
+static const char *phase_names[Trace::NUM_PHASES] = {
+    "load",
+    "read_superblock",
+    "read_root",
+    "read_inode_table",
+    "read_allocation_map",
+    "read_dir",
+    "walk",
+    "read_data",
+    "write_index",
+};
+
+// One phase as it ran, for the trace
+struct TraceEvent {
+    Trace::Phase phase;
+    uint64_t start;
+    uint64_t duration;
+};
+
+//
+// What one thread has counted. Only the owning thread writes its
+// counts, so relaxed loads and stores are enough; they're atomic only
+// so that totals can be read while the thread is still running.
+//
+struct ThreadCounts {
+    ThreadCounts(uint32_t id) : id(id)
+    {
+        for (int i = 0; i < Trace::NUM_COUNTERS; i++) {
+            counts[i] = 0;
+        }
+
+        for (int i = 0; i < Trace::NUM_PHASES; i++) {
+            phase_ns[i] = 0;
+            phase_calls[i] = 0;
+        }
+    }
+
+    const uint32_t id;
+    std::atomic<uint64_t> counts[Trace::NUM_COUNTERS];
+    std::atomic<uint64_t> phase_ns[Trace::NUM_PHASES];
+    std::atomic<uint64_t> phase_calls[Trace::NUM_PHASES];
+
+    std::mutex events_lock;     // Only contended while writing the trace
+    std::vector<TraceEvent> events;
+};
+
+std::atomic<bool> Trace::enabled_(false);
+
+static std::atomic<bool> tracing(false);
+static FILE *trace_file = nullptr;
+static std::string trace_path;
+static uint64_t trace_start = 0;
+
+// Every thread that has counted anything. They are never freed, so
+// that threads' counts outlive the threads themselves.
+static std::mutex registry_lock;
+static std::vector<ThreadCounts *> registry;
+static thread_local ThreadCounts *local_counts = nullptr;
+
+static ThreadCounts &local()
+{
+    if (local_counts == nullptr) {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        local_counts = new ThreadCounts((uint32_t) registry.size() + 1);
+        registry.push_back(local_counts);
+    }
+
+    return *local_counts;
+}
+
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void Trace::enable()
+{
+    enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Trace::open_trace(const std::string &path)
+{
+    trace_file = fopen(path.c_str(), "w");
+
+    if (trace_file == nullptr) {
+        std::cerr << "Unable to create " << path << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    trace_path = path;
+    trace_start = now();
+    tracing.store(true, std::memory_order_relaxed);
+    enable();
+}
+
+void Trace::close_trace()
+{
+    if (trace_file == nullptr) {
+        return;
+    }
+
+    tracing.store(false, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    int pid = (int) getpid();
+    bool first = true;
+
+    fprintf(trace_file, "{\"traceEvents\":[\n");
+
+    for (size_t t = 0; t < registry.size(); t++) {
+        ThreadCounts &thread = *registry[t];
+        std::lock_guard<std::mutex> events_guard(thread.events_lock);
+
+        for (size_t i = 0; i < thread.events.size(); i++) {
+            const TraceEvent &e = thread.events[i];
+
+            // Chrome trace times are in microseconds.
+            fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"readfs\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                    first ? "" : ",\n", phase_names[e.phase],
+                    (e.start - trace_start) / 1000.0, e.duration / 1000.0, pid, thread.id);
+            first = false;
+        }
+    }
+
+    fprintf(trace_file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(trace_file) != 0) {
+        std::cerr << "Unable to write " << trace_path << ": " << strerror(errno) << std::endl;
+    }
+
+    trace_file = nullptr;
+}
+
+uint64_t Trace::total(Counter c)
+{
+    std::lock_guard<std::mutex> guard(registry_lock);
+    uint64_t sum = 0;
+
+    for (size_t t = 0; t < registry.size(); t++) {
+        sum += registry[t]->counts[c].load(std::memory_order_relaxed);
+    }
+
+    return sum;
+}
+
+void Trace::print_stats()
+{
+    std::cout << "INSTRUMENTATION" << std::endl;
+    std::cout << "---------------" << std::endl;
+
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        std::cout << "  " << counter_names[i] << ": " << std::dec <<
+            total((Counter) i) << std::endl;
+    }
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    std::cout << "  Threads counted: " << registry.size() << std::endl;
+
+    // Phases nest, so their times overlap.
+    for (int p = 0; p < NUM_PHASES; p++) {
+        uint64_t ns = 0;
+        uint64_t calls = 0;
+
+        for (size_t t = 0; t < registry.size(); t++) {
+            ns += registry[t]->phase_ns[p].load(std::memory_order_relaxed);
+            calls += registry[t]->phase_calls[p].load(std::memory_order_relaxed);
+        }
+
+        if (calls > 0) {
+            std::cout << "  Time in " << phase_names[p] << ": " << std::fixed <<
+                std::setprecision(3) << ns / 1e6 << " ms over " << calls <<
+                (calls == 1 ? " call" : " calls") << std::endl;
+        }
+    }
+}
+
+uint64_t Trace::now()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::add(Counter c, uint64_t n)
+{
+    bump(local().counts[c], n);
+}
+
+void Trace::finish(Phase phase, uint64_t start)
+{
+    uint64_t end = now();
+    ThreadCounts &counts = local();
+
+    bump(counts.phase_ns[phase], end - start);
+    bump(counts.phase_calls[phase], 1);
+
+    if (tracing.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> guard(counts.events_lock);
+        TraceEvent e = { phase, start, end - start };
+        counts.events.push_back(e);
+    }
+}
+
+}; // namespace
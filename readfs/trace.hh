@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+
+namespace loomcom {
+
+//
+// Instrumentation of the hot paths: event counters, time spent in each
+// phase of the work, and optionally a Chrome trace ("about:tracing",
+// Perfetto) of every phase as it ran.
+//
+// Everything is off until enable() or open_trace() is called; until
+// then each counting site costs one relaxed load and a branch. Counts
+// are kept per thread and only summed when printed, so threads never
+// contend on them.
+//
+class Trace {
+public:
+    enum Counter {
+        BYTES_READ,         // Image bytes copied or viewed
+        IO_CALLS,           // pread(2) calls on the image
+        CACHE_HITS,
+        CACHE_MISSES,
+        CACHE_DIRECT,       // Blocks served straight from a mapping
+        INODES_DECODED,
+        DIRS_READ,
+        DIR_ENTRIES,
+        NUM_COUNTERS
+    };
+
+    enum Phase {
+        LOAD,
+        READ_SUPERBLOCK,
+        READ_ROOT,
+        READ_INODE_TABLE,
+        READ_ALLOCATION_MAP,
+        READ_DIR,
+        WALK,
+        READ_DATA,
+        WRITE_INDEX,
+        NUM_PHASES
+    };
+
+    // Times a phase from construction to destruction.
+    class Scope {
+    public:
+        explicit Scope(Phase phase) : phase_(phase), start_(enabled() ? now() : 0) {}
+        ~Scope() { if (start_ != 0) { Trace::finish(phase_, start_); } }
+
+    private:
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        const Phase phase_;
+        const uint64_t start_;
+    };
+
+    // Start counting.
+    static void enable();
+
+    // Start counting, and record every phase for a Chrome trace to be
+    // written to `path` by close_trace(). Throws if it can't be created.
+    static void open_trace(const std::string &path);
+
+    // Write out the trace, if one was opened. Call once the worker
+    // threads are done.
+    static void close_trace();
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    static void count(Counter c, uint64_t n = 1)
+    {
+        if (enabled()) {
+            add(c, n);
+        }
+    }
+
+    // Totals over every thread so far
+    static uint64_t total(Counter c);
+
+    static void print_stats();
+
+private:
+    static uint64_t now();
+    static void add(Counter c, uint64_t n);
+    static void finish(Phase phase, uint64_t start);
+
+    static std::atomic<bool> enabled_;
+};
+
+}; // namespace
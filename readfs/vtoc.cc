@@ -0,0 +1,124 @@
+#include "vtoc.hh"
+#include "bswap.hh"
+#include "imgread.hh"
+
+namespace loomcom {
+
+// Byte offsets of the fields used here
+static const int PD_SANITY_OFFSET = 4;
+static const int PD_LOGICALST_OFFSET = 40;
+
+static const int VTOC_SANITY_OFFSET = 12;
+static const int VTOC_NPARTS_OFFSET = 30;
+static const int VTOC_PARTS_OFFSET = 72;
+static const int VTOC_PART_SIZE = 12;
+
+// Where a SysV filesystem keeps its magic number, from the start of
+// the partition
+static const int FS_MAGIC_OFFSET = FileLoader::SUPERBLOCK_OFFSET + SuperblockView::S_MAGIC;
+
+std::vector<Partition> Vtoc::read(ImageSource &image)
+{
+    std::vector<Partition> parts;
+    uint8_t pdinfo[SECTOR_SIZE];
+    uint8_t vtoc[SECTOR_SIZE];
+
+    if (image.size() < SECTOR_SIZE) {
+        return parts;
+    }
+
+    image.read(0, pdinfo, SECTOR_SIZE);
+
+    if (be32(pdinfo + PD_SANITY_OFFSET) != PD_SANITY) {
+        return parts;
+    }
+
+    uint32_t logicalst = be32(pdinfo + PD_LOGICALST_OFFSET);
+    uint64_t vtoc_offset = ((uint64_t) logicalst + 1) * SECTOR_SIZE;
+
+    if (vtoc_offset + SECTOR_SIZE > image.size()) {
+        return parts;
+    }
+
+    image.read(vtoc_offset, vtoc, SECTOR_SIZE);
+
+    if (be32(vtoc + VTOC_SANITY_OFFSET) != VTOC_SANITY) {
+        return parts;
+    }
+
+    int nparts = std::min<int>(be16(vtoc + VTOC_NPARTS_OFFSET), (int) MAX_PARTITIONS);
+
+    for (int i = 0; i < nparts; i++) {
+        const uint8_t *p = vtoc + VTOC_PARTS_OFFSET + (i * VTOC_PART_SIZE);
+
+        Partition part;
+        part.index = i;
+        part.tag = be16(p);
+        part.flag = be16(p + 2);
+        part.start = logicalst + be32(p + 4);
+        part.sectors = be32(p + 8);
+        part.sysv = false;
+
+        if (part.sectors == 0) {
+            continue;
+        }
+
+        // Look for a superblock rather than trusting the tag.
+        if (part.offset() + FS_MAGIC_OFFSET + 4 <= image.size()) {
+            uint8_t magic[4];
+            image.read(part.offset() + FS_MAGIC_OFFSET, magic, 4);
+            part.sysv = be32(magic) == FileLoader::FS_MAGIC;
+        }
+
+        parts.push_back(part);
+    }
+
+    return parts;
+}
+
+bool Vtoc::select(ImageSource &image, int partition, FileLoader::Options &options)
+{
+    if (partition < 0) {
+        return true;
+    }
+
+    std::vector<Partition> parts = read(image);
+    const Partition *p = nullptr;
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (parts[i].index == partition) {
+            p = &parts[i];
+        }
+    }
+
+    if (p == nullptr || !p->sysv) {
+        std::cerr << image.file_name() << ": No SysV filesystem in partition " <<
+            partition << std::endl;
+        return false;
+    }
+
+    options.base = p->offset();
+    options.partition = partition;
+
+    return true;
+}
+
+const char *Vtoc::tag_name(uint16_t tag)
+{
+    switch (tag) {
+    case V_BOOT:
+        return "boot";
+    case V_ROOT:
+        return "root";
+    case V_SWAP:
+        return "swap";
+    case V_USR:
+        return "usr";
+    case V_BACKUP:
+        return "backup";
+    default:
+        return "other";
+    }
+}
+
+}; // namespace
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "image.hh"
+#include "imgread.hh"
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// One slice of a disk, as described by its VTOC.
+//
+struct Partition {
+    int index;              // Slot in the VTOC, which is how users name it
+    uint16_t tag;           // V_ROOT, V_USR, ...
+    uint16_t flag;
+    uint32_t start;         // First sector, counted from the start of the disk
+    uint32_t sectors;
+    bool sysv;              // Holds a SysV filesystem
+
+    uint64_t offset() const { return (uint64_t) start * 512; }
+    uint64_t size() const { return (uint64_t) sectors * 512; }
+};
+
+//
+// The 3B2 volume table of contents.
+//
+// Sector 0 of a disk holds the physical description of the drive
+// (pdinfo), including the sector where the logical disk starts. The
+// VTOC is the sector after that, and lists up to 16 partitions with
+// their start sectors relative to the logical start.
+//
+class Vtoc {
+public:
+    const static uint32_t PD_SANITY = 0xca5e600d;
+    const static uint32_t VTOC_SANITY = 0x600ddeee;
+
+    const static int SECTOR_SIZE = 512;
+    const static int MAX_PARTITIONS = 16;
+
+    // Partition tags
+    const static uint16_t V_BOOT = 1;
+    const static uint16_t V_ROOT = 2;
+    const static uint16_t V_SWAP = 3;
+    const static uint16_t V_USR = 4;
+    const static uint16_t V_BACKUP = 5;
+
+    // The partitions of a disk image, in VTOC order. Empty slots are
+    // left out. Returns nothing if the image has no valid VTOC.
+    static std::vector<Partition> read(ImageSource &image);
+
+    // Point `options` at partition `partition` of the disk, unless it's
+    // -1. Returns false, having said why, if the disk has no such SysV
+    // partition.
+    static bool select(ImageSource &image, int partition, FileLoader::Options &options);
+
+    static const char *tag_name(uint16_t tag);
+};
+
+}; // namespace
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace loomcom {
+
+//
+// A simple multi-producer, multi-consumer work queue. Consumers block
+// in pop() until an item arrives or the queue is closed and drained.
+//
+template <typename T>
+class WorkQueue {
+public:
+    WorkQueue() : closed_(false) {}
+
+    void push(const T &item)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            items_.push_back(item);
+        }
+        ready_.notify_one();
+    }
+
+    // Take the next item. Returns false once the queue has been closed
+    // and every item has been handed out.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+
+        ready_.wait(guard, [this]() { return closed_ || !items_.empty(); });
+
+        if (items_.empty()) {
+            return false;
+        }
+
+        item = items_.front();
+        items_.pop_front();
+
+        return true;
+    }
+
+    // Take the next item if there is one to hand, without waiting.
+    bool try_pop(T &item)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        if (items_.empty()) {
+            return false;
+        }
+
+        item = items_.front();
+        items_.pop_front();
+
+        return true;
+    }
+
+    // No more items will be pushed.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+private:
+    std::mutex lock_;
+    std::condition_variable ready_;
+    std::deque<T> items_;
+    bool closed_;
+};
+
+}; // namespace
@@ -0,0 +1,531 @@
+#include "writer.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+
+namespace loomcom {
+
+// s_state of a cleanly unmounted filesystem is this less s_time.
+static const uint32_t FS_OKAY = 0x7c269d38;
+
+// Free inodes the superblock keeps at hand in s_inode
+static const int NICINOD = 100;
+
+// Largest inode number a directory entry can hold
+static const uint32_t MAX_INODES = 65535;
+
+// Largest block address di_addr can hold
+static const uint32_t MAX_BLOCKS = 1 << 24;
+
+static_assert(sizeof(struct superblock) == 512, "superblock must fill a sector");
+static_assert(sizeof(struct dinode) == 64, "dinode must match the disk layout");
+
+// The structs are written out whole, so they must agree with the
+// offsets the views read them back from.
+static_assert(offsetof(superblock, s_isize) == SuperblockView::S_ISIZE &&
+              offsetof(superblock, s_fsize) == SuperblockView::S_FSIZE &&
+              offsetof(superblock, s_nfree) == SuperblockView::S_NFREE &&
+              offsetof(superblock, s_free) == SuperblockView::S_FREE &&
+              offsetof(superblock, s_ninode) == SuperblockView::S_NINODE &&
+              offsetof(superblock, s_inode) == SuperblockView::S_INODE &&
+              offsetof(superblock, s_time) == SuperblockView::S_TIME &&
+              offsetof(superblock, s_tfree) == SuperblockView::S_TFREE &&
+              offsetof(superblock, s_tinode) == SuperblockView::S_TINODE &&
+              offsetof(superblock, s_fname) == SuperblockView::S_FNAME &&
+              offsetof(superblock, s_fpack) == SuperblockView::S_FPACK &&
+              offsetof(superblock, s_state) == SuperblockView::S_STATE &&
+              offsetof(superblock, s_magic) == SuperblockView::S_MAGIC &&
+              offsetof(superblock, s_type) == SuperblockView::S_TYPE,
+              "superblock must match SuperblockView");
+static_assert(offsetof(dinode, di_size) == DinodeView::DI_SIZE &&
+              offsetof(dinode, di_addr) == DinodeView::DI_ADDR &&
+              offsetof(dinode, di_atime) == DinodeView::DI_ATIME,
+              "dinode must match DinodeView");
+
+static inline void put_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t) (val >> 8);
+    p[1] = (uint8_t) val;
+}
+
+static inline void put_be24(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t) (val >> 16);
+    p[1] = (uint8_t) (val >> 8);
+    p[2] = (uint8_t) val;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t) (val >> 24);
+    p[1] = (uint8_t) (val >> 16);
+    p[2] = (uint8_t) (val >> 8);
+    p[3] = (uint8_t) val;
+}
+
+ImageWriter::ImageWriter(const std::string &file_name, const Options &options) :
+    file_name_(file_name),
+    options_(options),
+    block_size_(options.type == 1 ? 512 : 1024),
+    fd_(-1),
+    finished_(false),
+    next_inode_(1),
+    next_block_(0),
+    pending_offset_(0),
+    writes_(0),
+    bytes_written_(0)
+{
+    if (options_.type != 1 && options_.type != 2) {
+        std::cerr << "Unsupported filesystem type " << options_.type << std::endl;
+        throw std::exception();
+    }
+
+    uint32_t per_block = block_size_ / FileLoader::INODE_SIZE;
+    uint32_t ilist_blocks = (std::max(options_.inodes, (uint32_t) FileLoader::ROOT_INODE) +
+                             per_block - 1) / per_block;
+
+    // Rounding up mustn't make inode numbers too big for a dentry.
+    ilist_blocks = std::min(ilist_blocks, MAX_INODES / per_block);
+
+    isize_ = 2 + ilist_blocks;
+    next_block_ = isize_;
+
+    if (options_.blocks <= isize_ || options_.blocks > MAX_BLOCKS) {
+        std::cerr << "Can't make a filesystem of " << options_.blocks <<
+            " blocks with " << ilist_blocks << " blocks of inodes" << std::endl;
+        throw std::exception();
+    }
+
+    inodes_.resize(ilist_blocks * per_block + 1);
+    dirs_.resize(inodes_.size());
+    memset(inodes_.data(), 0, inodes_.size() * sizeof(struct dinode));
+
+    fd_ = open(file_name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd_ < 0) {
+        std::cerr << "Unable to create " << file_name_ << ": " << strerror(errno) << std::endl;
+        throw std::exception();
+    }
+
+    // Everything not written below reads back as zeroes.
+    if (ftruncate(fd_, options_.base + (uint64_t) options_.blocks * block_size_) < 0) {
+        std::cerr << "Unable to size " << file_name_ << ": " << strerror(errno) << std::endl;
+        close(fd_);
+        throw std::exception();
+    }
+
+    // Inode 1 is reserved, and the root is its own parent.
+    next_inode_ = FileLoader::ROOT_INODE;
+
+    Attr attr;
+    attr.mode = 0755;
+    attr.atime = attr.mtime = attr.ctime = options_.time;
+    new_inode(0, "", 040000, attr);
+}
+
+ImageWriter::~ImageWriter()
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+uint64_t ImageWriter::blocks_for(uint64_t size, uint32_t block_size)
+{
+    uint64_t per_block = block_size / 4;
+    uint64_t data = (size + block_size - 1) / block_size;
+    uint64_t rest = data - std::min(data, (uint64_t) FileLoader::NADDR_DIRECT);
+    uint64_t total = data;
+    uint64_t span = 1;
+
+    // A level-n indirect block maps per_block^n blocks through one
+    // block at its own level and a whole tree of blocks below it.
+    for (int level = 1; level <= FileLoader::NADDR - FileLoader::NADDR_DIRECT && rest > 0;
+         level++) {
+        span *= per_block;
+        uint64_t here = std::min(rest, span);
+        uint64_t mapped = 1;
+
+        for (int l = 0; l < level; l++) {
+            mapped *= per_block;
+            total += (here + mapped - 1) / mapped;
+        }
+
+        rest -= here;
+    }
+
+    return total;
+}
+
+const uint32_t ImageWriter::mkdir(uint32_t parent, const std::string &name, const Attr &attr)
+{
+    uint32_t inum = new_inode(parent, name, 040000, attr);
+
+    dirs_[parent].subdirs++;
+
+    return inum;
+}
+
+const uint32_t ImageWriter::add_file(uint32_t parent, const std::string &name, const Attr &attr,
+                                     const uint8_t *data, uint64_t size)
+{
+    if (size > UINT32_MAX) {
+        std::cerr << name << ": Too big for a SysV filesystem" << std::endl;
+        throw std::exception();
+    }
+
+    uint32_t inum = new_inode(parent, name, 0100000, attr);
+
+    write_data(inodes_[inum], data, size);
+
+    return inum;
+}
+
+const void ImageWriter::link(uint32_t parent, const std::string &name, uint32_t inum)
+{
+    if (inum >= next_inode_ || inum < FileLoader::ROOT_INODE ||
+        (inodes_[inum].di_mode & 0170000) == 040000) {
+        std::cerr << "Can't link " << name << " to inode " << inum << std::endl;
+        throw std::exception();
+    }
+
+    add_entry(parent, name, inum);
+    inodes_[inum].di_nlink++;
+}
+
+const void ImageWriter::finish()
+{
+    if (finished_) {
+        return;
+    }
+
+    // Directories get their blocks last, after all the file data.
+    for (uint32_t inum = FileLoader::ROOT_INODE; inum < next_inode_; inum++) {
+        struct dinode &inode = inodes_[inum];
+
+        if ((inode.di_mode & 0170000) != 040000) {
+            continue;
+        }
+
+        const Dir &dir = dirs_[inum];
+        std::vector<uint8_t> data((dir.entries.size() + 2) * FileLoader::DIRENTRY_SIZE, 0);
+        uint8_t *p = data.data();
+
+        put_be16(p, (uint16_t) inum);
+        memcpy(p + 2, ".", 1);
+        p += FileLoader::DIRENTRY_SIZE;
+
+        put_be16(p, (uint16_t) dir.parent);
+        memcpy(p + 2, "..", 2);
+        p += FileLoader::DIRENTRY_SIZE;
+
+        for (size_t i = 0; i < dir.entries.size(); i++) {
+            put_be16(p, (uint16_t) dir.entries[i].second);
+            memcpy(p + 2, dir.entries[i].first.data(), dir.entries[i].first.size());
+            p += FileLoader::DIRENTRY_SIZE;
+        }
+
+        inode.di_nlink = (uint16_t) (2 + dir.subdirs);
+        write_data(inode, data.data(), data.size());
+    }
+
+    // The i-list, in disk byte order
+    std::vector<uint8_t> ilist((uint64_t) (isize_ - 2) * block_size_, 0);
+
+    for (uint32_t inum = 1; inum < next_inode_; inum++) {
+        const struct dinode &inode = inodes_[inum];
+        uint8_t *p = ilist.data() + (uint64_t) (inum - 1) * FileLoader::INODE_SIZE;
+
+        put_be16(p, inode.di_mode);
+        put_be16(p + 2, inode.di_nlink);
+        put_be16(p + 4, inode.di_uid);
+        put_be16(p + 6, inode.di_gid);
+        put_be32(p + 8, inode.di_size);
+        memcpy(p + 12, inode.di_addr, sizeof(inode.di_addr));
+        put_be32(p + 52, inode.di_atime);
+        put_be32(p + 56, inode.di_mtime);
+        put_be32(p + 60, inode.di_ctime);
+    }
+
+    write_at(options_.base + 2 * block_size_, ilist.data(), ilist.size());
+
+    write_free_list();
+    flush();
+
+    finished_ = true;
+}
+
+const uint32_t ImageWriter::new_inode(uint32_t parent, const std::string &name, uint16_t mode,
+                                      const Attr &attr)
+{
+    if (next_inode_ >= inodes_.size()) {
+        std::cerr << file_name_ << ": Out of inodes adding " << name << std::endl;
+        throw std::exception();
+    }
+
+    uint32_t inum = next_inode_;
+
+    if (parent == 0) {
+        parent = inum;
+    } else {
+        add_entry(parent, name, inum);
+    }
+
+    next_inode_++;
+
+    struct dinode &inode = inodes_[inum];
+    inode.di_mode = (uint16_t) (mode | (attr.mode & 07777));
+    inode.di_nlink = 1;
+    inode.di_uid = attr.uid;
+    inode.di_gid = attr.gid;
+    inode.di_atime = attr.atime;
+    inode.di_mtime = attr.mtime;
+    inode.di_ctime = attr.ctime;
+
+    dirs_[inum].parent = parent;
+
+    return inum;
+}
+
+const void ImageWriter::add_entry(uint32_t parent, const std::string &name, uint32_t inum)
+{
+    if (finished_ || parent >= next_inode_ || (inodes_[parent].di_mode & 0170000) != 040000) {
+        std::cerr << "Can't add " << name << ": inode " << parent <<
+            " is not a directory" << std::endl;
+        throw std::exception();
+    }
+
+    if (name.empty() || name.size() > NAME_MAX || name == "." || name == ".." ||
+        name.find('/') != std::string::npos || name.find('\0') != std::string::npos) {
+        std::cerr << "Bad file name \"" << name << "\"" << std::endl;
+        throw std::exception();
+    }
+
+    Dir &dir = dirs_[parent];
+
+    if (!dir.names.insert(name).second) {
+        std::cerr << name << ": Already exists in directory inode " << parent << std::endl;
+        throw std::exception();
+    }
+
+    dir.entries.push_back(std::make_pair(name, inum));
+}
+
+const void ImageWriter::write_data(struct dinode &inode, const uint8_t *data, uint64_t size)
+{
+    uint32_t count = (uint32_t) ((size + block_size_ - 1) / block_size_);
+
+    inode.di_size = (uint32_t) size;
+
+    if (count == 0) {
+        return;
+    }
+
+    // The data goes down in one run, so it reads back as one extent.
+    uint32_t first = alloc(count);
+    write_at(options_.base + (uint64_t) first * block_size_, data, size);
+
+    std::vector<uint32_t> blocks(count);
+    for (uint32_t i = 0; i < count; i++) {
+        blocks[i] = first + i;
+    }
+
+    uint32_t addrs[FileLoader::NADDR] = {0};
+    size_t next = 0;
+
+    for (; next < blocks.size() && next < (size_t) FileLoader::NADDR_DIRECT; next++) {
+        addrs[next] = blocks[next];
+    }
+
+    for (int level = 1; level <= FileLoader::NADDR - FileLoader::NADDR_DIRECT &&
+             next < blocks.size(); level++) {
+        addrs[FileLoader::NADDR_DIRECT + level - 1] = write_indirect(blocks, next, level);
+    }
+
+    if (next < blocks.size()) {
+        std::cerr << "File of " << size << " bytes is too big for " << block_size_ <<
+            " byte blocks" << std::endl;
+        throw std::exception();
+    }
+
+    for (int i = 0; i < FileLoader::NADDR; i++) {
+        put_be24(inode.di_addr + (i * 3), addrs[i]);
+    }
+}
+
+//
+// Write an indirect block mapping blocks from `next` on, and return
+// its address. `level` is 1 for a single indirect block, 2 for double
+// and 3 for triple indirect.
+//
+const uint32_t ImageWriter::write_indirect(const std::vector<uint32_t> &blocks, size_t &next,
+                                           int level)
+{
+    uint32_t addr = alloc(1);
+    uint32_t per_block = block_size_ / 4;
+    std::vector<uint8_t> buf(block_size_, 0);
+
+    for (uint32_t i = 0; i < per_block && next < blocks.size(); i++) {
+        uint32_t entry = level == 1 ? blocks[next++] : write_indirect(blocks, next, level - 1);
+        put_be32(buf.data() + (i * 4), entry);
+    }
+
+    write_at(options_.base + (uint64_t) addr * block_size_, buf.data(), buf.size());
+
+    return addr;
+}
+
+//
+// Every block past the last one handed out goes on the free list. The
+// superblock holds the first group; the first address of each group
+// links to the block holding the next one, or is zero at the end.
+//
+const void ImageWriter::write_free_list()
+{
+    uint32_t next = next_block_;
+    uint32_t tfree = options_.blocks - next_block_;
+    std::vector<uint32_t> sb_free;
+    std::vector<uint32_t> group;
+    uint32_t link = 0;
+
+    for (bool first = true; first || link != 0; first = false) {
+        group.assign(1, 0);
+
+        while (group.size() < (size_t) FileLoader::NICFREE && next < options_.blocks) {
+            group.push_back(next++);
+        }
+
+        if (next < options_.blocks) {
+            group[0] = next++;
+        }
+
+        if (first) {
+            sb_free = group;
+        } else {
+            std::vector<uint8_t> buf(block_size_, 0);
+
+            put_be32(buf.data(), (uint32_t) group.size());
+            for (size_t i = 0; i < group.size(); i++) {
+                put_be32(buf.data() + 4 + (i * 4), group[i]);
+            }
+
+            write_at(options_.base + (uint64_t) link * block_size_, buf.data(), buf.size());
+        }
+
+        link = group[0];
+    }
+
+    write_superblock(sb_free, tfree);
+}
+
+const void ImageWriter::write_superblock(const std::vector<uint32_t> &sb_free, uint32_t tfree)
+{
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+
+    sb.s_isize = bswap16((uint16_t) isize_);
+    sb.s_fsize = bswap32(options_.blocks);
+    sb.s_nfree = bswap16((uint16_t) sb_free.size());
+
+    for (size_t i = 0; i < sb_free.size(); i++) {
+        sb.s_free[i] = bswap32(sb_free[i]);
+    }
+
+    uint32_t ninode = 0;
+    for (uint32_t inum = next_inode_; inum < inodes_.size() && ninode < (uint32_t) NICINOD;
+         inum++) {
+        sb.s_inode[ninode++] = bswap16((uint16_t) inum);
+    }
+
+    sb.s_ninode = bswap16((uint16_t) ninode);
+    sb.s_time = bswap32(options_.time);
+    sb.s_tfree = bswap32(tfree);
+    sb.s_tinode = bswap16((uint16_t) free_inodes());
+    // Fixed-width and NUL padded, but not NUL terminated when full
+    memcpy(sb.s_fname, options_.fname.data(), std::min(options_.fname.size(), sizeof(sb.s_fname)));
+    memcpy(sb.s_fpack, options_.fpack.data(), std::min(options_.fpack.size(), sizeof(sb.s_fpack)));
+    sb.s_state = bswap32(FS_OKAY - options_.time);
+    sb.s_magic = bswap32(FileLoader::FS_MAGIC);
+    sb.s_type = bswap32(options_.type);
+
+    write_at(options_.base + FileLoader::SUPERBLOCK_OFFSET, &sb, sizeof(sb));
+}
+
+//
+// Writes are gathered into WRITE_CHUNK sized runs. Blocks are handed
+// out in order, so file data, indirect blocks and directories mostly
+// follow on from one another; the only gaps are the unused tails of
+// last blocks, which are filled with zeroes rather than seeked over.
+// Anything at least WRITE_CHUNK long goes straight out.
+//
+const void ImageWriter::write_at(uint64_t offset, const void *buf, size_t len)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(buf);
+    uint64_t pending_end = pending_offset_ + pending_.size();
+
+    if (!pending_.empty() &&
+        (offset < pending_end || offset - pending_end >= block_size_ ||
+         pending_.size() + (offset - pending_end) + len > WRITE_CHUNK)) {
+        flush();
+        pending_end = pending_offset_;
+    }
+
+    if (len >= WRITE_CHUNK) {
+        write_out(offset, p, len);
+        return;
+    }
+
+    if (pending_.empty()) {
+        pending_offset_ = offset;
+    } else {
+        pending_.insert(pending_.end(), (size_t) (offset - pending_end), 0);
+    }
+
+    pending_.insert(pending_.end(), p, p + len);
+}
+
+const void ImageWriter::flush()
+{
+    if (!pending_.empty()) {
+        write_out(pending_offset_, pending_.data(), pending_.size());
+        pending_.clear();
+    }
+}
+
+const void ImageWriter::write_out(uint64_t offset, const uint8_t *p, size_t len)
+{
+    writes_++;
+    bytes_written_ += len;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd_, p, len, offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            std::cerr << "Unable to write " << file_name_ << ": " << strerror(errno) << std::endl;
+            throw std::exception();
+        }
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+const uint32_t ImageWriter::alloc(uint32_t count)
+{
+    if ((uint64_t) next_block_ + count > options_.blocks) {
+        std::cerr << file_name_ << ": Out of space" << std::endl;
+        throw std::exception();
+    }
+
+    uint32_t first = next_block_;
+    next_block_ += count;
+
+    return first;
+}
+
+}; // namespace
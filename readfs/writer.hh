@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "imgread.hh"
+
+namespace loomcom {
+
+//
+// Write a new SysV filesystem image.
+//
+// File data goes to the image as each file is added, in one contiguous
+// run of blocks per file with its indirect blocks after it. Since files
+// are laid down one after another, small writes are gathered into
+// large sequential ones. Inodes and directories are kept in memory and
+// written by finish(), along with the free list and the superblock, so
+// nothing is readable until then.
+//
+class ImageWriter {
+public:
+    struct Options {
+        Options() : type(2), blocks(8192), inodes(1024),
+                    base(FileLoader::DATA_OFFSET), time(0) {}
+
+        uint32_t type;          // s_type: 1 for 512-byte blocks, 2 for 1K
+        uint32_t blocks;        // s_fsize, the whole volume
+        uint32_t inodes;        // Rounded up to fill the i-list's last block
+        uint64_t base;          // Byte offset of the filesystem in the image
+        uint32_t time;          // s_time
+        std::string fname;      // s_fname, up to 6 characters
+        std::string fpack;      // s_fpack, up to 6 characters
+    };
+
+    // Ownership, permissions and times of a new file. Only the
+    // permission bits of `mode` are used; the type comes from the call.
+    struct Attr {
+        Attr() : mode(0644), uid(0), gid(0), atime(0), mtime(0), ctime(0) {}
+
+        uint16_t mode;
+        uint16_t uid;
+        uint16_t gid;
+        uint32_t atime;
+        uint32_t mtime;
+        uint32_t ctime;
+    };
+
+    // Longest name a directory entry holds
+    const static size_t NAME_MAX = 14;
+
+    // Size of the runs writes are gathered into
+    const static size_t WRITE_CHUNK = 4 * 1024 * 1024;
+
+    // Create (or truncate) `file_name` to hold the filesystem.
+    ImageWriter(const std::string &file_name, const Options &options = Options());
+    ~ImageWriter();
+
+    uint32_t block_size() const { return block_size_; }
+    uint32_t root() const { return FileLoader::ROOT_INODE; }
+    uint32_t free_blocks() const { return options_.blocks - next_block_; }
+    uint32_t free_inodes() const { return (uint32_t) (inodes_.size() - next_inode_); }
+    uint32_t blocks() const { return options_.blocks; }
+
+    // write(2) calls made, and the bytes they wrote
+    uint64_t writes() const { return writes_; }
+    uint64_t bytes_written() const { return bytes_written_; }
+
+    // Blocks a file of `size` bytes takes up, indirect blocks included.
+    static uint64_t blocks_for(uint64_t size, uint32_t block_size);
+
+    // Each of these adds a new entry to directory `parent` and returns
+    // the new inode's number. Errors, such as a full filesystem or a
+    // duplicate name, are reported and thrown.
+    const uint32_t mkdir(uint32_t parent, const std::string &name, const Attr &attr);
+    const uint32_t add_file(uint32_t parent, const std::string &name, const Attr &attr,
+                            const uint8_t *data, uint64_t size);
+
+    // Add another name for existing non-directory inode `inum`.
+    const void link(uint32_t parent, const std::string &name, uint32_t inum);
+
+    // Write the inodes, directories, free list and superblock.
+    const void finish();
+
+private:
+    struct Dir {
+        Dir() : parent(0), subdirs(0) {}
+
+        std::vector<std::pair<std::string, uint32_t> > entries;
+        std::unordered_set<std::string> names;
+        uint32_t parent;
+        uint32_t subdirs;
+    };
+
+    const uint32_t new_inode(uint32_t parent, const std::string &name, uint16_t mode,
+                             const Attr &attr);
+    const void add_entry(uint32_t parent, const std::string &name, uint32_t inum);
+    const void write_data(struct dinode &inode, const uint8_t *data, uint64_t size);
+    const uint32_t write_indirect(const std::vector<uint32_t> &blocks, size_t &next,
+                                  int level);
+    const void write_free_list();
+    const void write_superblock(const std::vector<uint32_t> &sb_free, uint32_t tfree);
+    const void write_at(uint64_t offset, const void *buf, size_t len);
+    const void flush();
+    const void write_out(uint64_t offset, const uint8_t *p, size_t len);
+    const uint32_t alloc(uint32_t count);
+
+    const std::string file_name_;
+    const Options options_;
+    const uint32_t block_size_;
+    int fd_;
+    bool finished_;
+
+    // Host order, indexed by inode number; slot 0 is unused
+    std::vector<struct dinode> inodes_;
+    std::vector<Dir> dirs_;             // Indexed by inode number
+    uint32_t isize_;                    // First data block
+    uint32_t next_inode_;
+    uint32_t next_block_;
+
+    // Writes not yet made, starting at pending_offset_
+    std::vector<uint8_t> pending_;
+    uint64_t pending_offset_;
+
+    uint64_t writes_;
+    uint64_t bytes_written_;
+};
+
+}; // namespace
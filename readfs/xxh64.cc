@@ -0,0 +1,160 @@
+#include "xxh64.hh"
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace loomcom {
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// xxHash reads its input as little-endian words.
+static inline uint64_t read64(const uint8_t *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+        (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+        (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+        (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+XXH64::XXH64(uint64_t seed)
+{
+    reset(seed);
+}
+
+void XXH64::reset(uint64_t seed)
+{
+    seed_ = seed;
+    v_[0] = seed + PRIME1 + PRIME2;
+    v_[1] = seed + PRIME2;
+    v_[2] = seed;
+    v_[3] = seed - PRIME1;
+    total_ = 0;
+    buffered_ = 0;
+}
+
+void XXH64::update(const void *data, size_t len)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    const uint8_t *end = p + len;
+
+    total_ += len;
+
+    // Top up a partial stripe first.
+    if (buffered_ > 0) {
+        size_t n = std::min(len, sizeof(buf_) - buffered_);
+        memcpy(buf_ + buffered_, p, n);
+        buffered_ += n;
+        p += n;
+
+        if (buffered_ < sizeof(buf_)) {
+            return;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            v_[i] = round(v_[i], read64(buf_ + (i * 8)));
+        }
+        buffered_ = 0;
+    }
+
+    uint64_t v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+
+    while (end - p >= 32) {
+        v0 = round(v0, read64(p));
+        v1 = round(v1, read64(p + 8));
+        v2 = round(v2, read64(p + 16));
+        v3 = round(v3, read64(p + 24));
+        p += 32;
+    }
+
+    v_[0] = v0;
+    v_[1] = v1;
+    v_[2] = v2;
+    v_[3] = v3;
+
+    if (p < end) {
+        buffered_ = end - p;
+        memcpy(buf_, p, buffered_);
+    }
+}
+
+uint64_t XXH64::digest() const
+{
+    uint64_t h;
+
+    if (total_ >= 32) {
+        h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge_round(h, v_[i]);
+        }
+    } else {
+        h = seed_ + PRIME5;
+    }
+
+    h += total_;
+
+    const uint8_t *p = buf_;
+    const uint8_t *end = buf_ + buffered_;
+
+    while (end - p >= 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+
+    if (end - p >= 4) {
+        h ^= (uint64_t) read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t XXH64::hash(const void *data, size_t len, uint64_t seed)
+{
+    XXH64 state(seed);
+    state.update(data, len);
+    return state.digest();
+}
+
+}; // namespace
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace loomcom {
+
+//
+// The 64-bit xxHash, fed incrementally. Matches the reference XXH64,
+// so digests can be compared with other tools.
+//
+class XXH64 {
+public:
+    explicit XXH64(uint64_t seed = 0);
+
+    void reset(uint64_t seed = 0);
+    void update(const void *data, size_t len);
+    uint64_t digest() const;
+
+    // One-shot hash of a buffer.
+    static uint64_t hash(const void *data, size_t len, uint64_t seed = 0);
+
+private:
+    uint64_t v_[4];
+    uint64_t total_;
+    uint8_t buf_[32];           // Input that doesn't yet fill a stripe
+    size_t buffered_;
+    uint64_t seed_;
+};
+
+}; // namespace
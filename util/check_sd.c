@@ -1,27 +1,30 @@
 #include <stdio.h>
 #include <stdint.h>
 
-#define P(sd)             ((sd) & 1)
-#define M(sd)             (((sd) >> 1) & 1)
-#define C(sd)             (((sd) >> 2) & 1)
-#define CC(sd)            (((sd) >> 3) & 1)
-#define T(sd)             (((sd) >> 4) & 1)
-#define R(sd)             (((sd) >> 5) & 1)
-#define V(sd)             (((sd) >> 6) & 1)
-#define I(sd)             (((sd) >> 7) & 1)
-#define MAX_OFF(sd)       ((((sd) >> 10) & 0x1fff) + 1)
-#define ACC(sd)           (((sd) >> 24) & 0xff)
+#include "fields.h"
 
 int main(int argc, char **argv) {
     uint32_t sd;
     int scanret;
 
-    if (argc != 2) {
+    struct fields_opts opts;
+    int arg = fields_parse_opts(argc, argv, &opts);
+
+    if (arg < 0 || argc - arg > 1) {
         fprintf(stderr, "Usage: check_sd <descriptor>\n");
+        fprintf(stderr, "       check_sd [-c | -r] [-b] [-f file]\n");
+        fprintf(stderr, "  With no descriptor, decode every descriptor on stdin (or in file).\n");
+        fprintf(stderr, "  -c  CSV output\n");
+        fprintf(stderr, "  -r  Fixed-width binary records (see fields.h)\n");
+        fprintf(stderr, "  -b  Input is raw big-endian 32-bit words\n");
         return 1;
     }
 
-    scanret = sscanf(argv[1], "%x", &sd);
+    if (arg == argc) {
+        return fields_run(&sd_fields, &opts);
+    }
+
+    scanret = sscanf(argv[arg], "%x", &sd);
 
     if (scanret <= 0 || scanret == EOF) {
         fprintf(stderr, "Unable to parse segment descriptor.\n");
@@ -29,16 +32,16 @@ int main(int argc, char **argv) {
     }
 
     printf("     Segment Descriptor 0x%08x\n\n", sd);
-    printf("Present:     %d\n", P(sd));
-    printf("Modified:    %d\n", P(sd));
-    printf("Contiguous:  %d\n", C(sd));
-    printf("Cacheable:   %d\n", CC(sd));
-    printf("Object Trap: %d\n", T(sd));
-    printf("Referenced:  %d\n", R(sd));
-    printf("Valid:       %d\n", V(sd));
-    printf("Indirect:    %d\n", I(sd));
-    printf("Max Offset:  %04x\n", MAX_OFF(sd));
-    printf("Access:      %02x\n", ACC(sd));
+    printf("Present:     %d\n", fields_get(&sd_fields, sd, "P"));
+    printf("Modified:    %d\n", fields_get(&sd_fields, sd, "M"));
+    printf("Contiguous:  %d\n", fields_get(&sd_fields, sd, "C"));
+    printf("Cacheable:   %d\n", fields_get(&sd_fields, sd, "CC"));
+    printf("Object Trap: %d\n", fields_get(&sd_fields, sd, "T"));
+    printf("Referenced:  %d\n", fields_get(&sd_fields, sd, "R"));
+    printf("Valid:       %d\n", fields_get(&sd_fields, sd, "V"));
+    printf("Indirect:    %d\n", fields_get(&sd_fields, sd, "I"));
+    printf("Max Offset:  %04x\n", fields_get(&sd_fields, sd, "MAX_OFF"));
+    printf("Access:      %02x\n", fields_get(&sd_fields, sd, "ACC"));
 
     return 0;
 }
@@ -1,22 +1,15 @@
 #include <stdio.h>
 #include <stdint.h>
 
-#define SID(va)           (((va) >> 30) & 3)
-#define SSL(va)           (((va) >> 17) & 0x1fff)
-#define SOT(va)           (va & 0x1ffff)
-#define PSL(va)           (((va) >> 11) & 0x3f)
-#define POT(va)           (va & 0x7ff)
-
-#define PD_TAG(vaddr)     (((vaddr >> 13) & 0xf) | ((vaddr >> 14) & 0xfff0))
-#define PD_IDX(vaddr)     (((vaddr >> 11) & 3) | ((vaddr >> 15) & 4))
+#include "fields.h"
 
 void print_paged_vaddr(uint32_t vaddr) {
     printf("     Paged Virtual Address 0x%08x\n\n", vaddr);
-    printf("SID: %d\n", SID(vaddr));
-    printf("SSL: %x\n", SSL(vaddr));
-    printf("SOT: %x\n", SOT(vaddr));
-    printf("PSL: %x\n", PSL(vaddr));
-    printf("POT: %x\n", POT(vaddr));
+    printf("SID: %d\n", fields_get(&vaddr_fields, vaddr, "SID"));
+    printf("SSL: %x\n", fields_get(&vaddr_fields, vaddr, "SSL"));
+    printf("SOT: %x\n", fields_get(&vaddr_fields, vaddr, "SOT"));
+    printf("PSL: %x\n", fields_get(&vaddr_fields, vaddr, "PSL"));
+    printf("POT: %x\n", fields_get(&vaddr_fields, vaddr, "POT"));
 
     printf("\n\n");
 
@@ -39,19 +32,32 @@ void print_paged_vaddr(uint32_t vaddr) {
 
     printf("\n");
 
-    printf("    TAG=%04x    IDX=%04x\n", PD_TAG(vaddr), PD_IDX(vaddr));
+    printf("    TAG=%04x    IDX=%04x\n", fields_get(&vaddr_fields, vaddr, "TAG"),
+           fields_get(&vaddr_fields, vaddr, "IDX"));
 }
 
 int main(int argc, char **argv) {
     uint32_t vaddr;
     int scanret;
 
-    if (argc != 2) {
+    struct fields_opts opts;
+    int arg = fields_parse_opts(argc, argv, &opts);
+
+    if (arg < 0 || argc - arg > 1) {
         fprintf(stderr, "Usage: check_vaddr <vaddr>\n");
+        fprintf(stderr, "       check_vaddr [-c | -r] [-b] [-f file]\n");
+        fprintf(stderr, "  With no vaddr, decode every vaddr on stdin (or in file).\n");
+        fprintf(stderr, "  -c  CSV output\n");
+        fprintf(stderr, "  -r  Fixed-width binary records (see fields.h)\n");
+        fprintf(stderr, "  -b  Input is raw big-endian 32-bit words\n");
         return 1;
     }
 
-    scanret = sscanf(argv[1], "%x", &vaddr);
+    if (arg == argc) {
+        return fields_run(&vaddr_fields, &opts);
+    }
+
+    scanret = sscanf(argv[arg], "%x", &vaddr);
 
     if (scanret <= 0 || scanret == EOF) {
         fprintf(stderr, "Unable to parse vaddr.\n");
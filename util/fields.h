@@ -0,0 +1,367 @@
+/*
+ * Table-driven decoding of WE32100 PSWs, WE32101 MMU virtual addresses
+ * and segment descriptors, shared by psw, check_vaddr and check_sd.
+ *
+ * Each field is ((word >> shift) & mask), optionally ORed with a second
+ * (shift2, mask2) part for fields that are split across the word, plus
+ * a constant bias. The tools' single-value modes look fields up by
+ * name with fields_get(), so both modes decode from the same table.
+ *
+ * The stream helpers read whitespace-separated hex words (with or
+ * without a 0x prefix) or raw big-endian 32-bit words, and write one
+ * record per word as text or CSV through a large stdio buffer.
+ *
+ * They can also write fixed-width binary records, for tools that would
+ * rather map the result than parse it. The file starts with a struct
+ * fields_rec_header, followed by field_count 8-byte NUL-padded field
+ * names, followed by one record per word: the word itself and then each
+ * field in table order, all as host-order uint32_t. The header and
+ * names are multiples of 8 bytes long, so the records start 8-byte
+ * aligned.
+ */
+
+#ifndef FIELDS_H
+#define FIELDS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct field_def {
+    const char *name;
+    int         shift;
+    uint32_t    mask;
+    int         shift2;
+    uint32_t    mask2;
+    uint32_t    bias;
+};
+
+struct field_set {
+    const char             *name;
+    const struct field_def *fields;
+    int                     count;
+};
+
+static const struct field_def psw_field_defs[] = {
+    { "ET",   0,  0x3, 0, 0, 0 },
+    { "TM",   2,  0x1, 0, 0, 0 },
+    { "ISC",  3,  0xf, 0, 0, 0 },
+    { "I",    7,  0x1, 0, 0, 0 },
+    { "R",    8,  0x1, 0, 0, 0 },
+    { "PM",   9,  0x3, 0, 0, 0 },
+    { "CM",   11, 0x3, 0, 0, 0 },
+    { "IPL",  13, 0xf, 0, 0, 0 },
+    { "TE",   17, 0x1, 0, 0, 0 },
+    { "C",    18, 0x1, 0, 0, 0 },
+    { "V",    19, 0x1, 0, 0, 0 },
+    { "Z",    20, 0x1, 0, 0, 0 },
+    { "N",    21, 0x1, 0, 0, 0 },
+    { "OE",   22, 0x1, 0, 0, 0 },
+    { "CD",   23, 0x1, 0, 0, 0 },
+    { "QIE",  24, 0x1, 0, 0, 0 },
+    { "CFD",  25, 0x1, 0, 0, 0 },
+};
+
+static const struct field_def vaddr_field_defs[] = {
+    { "SID",  30, 0x3,     0,  0,      0 },
+    { "SSL",  17, 0x1fff,  0,  0,      0 },
+    { "SOT",  0,  0x1ffff, 0,  0,      0 },
+    { "PSL",  11, 0x3f,    0,  0,      0 },
+    { "POT",  0,  0x7ff,   0,  0,      0 },
+    { "TAG",  13, 0xf,     14, 0xfff0, 0 },
+    { "IDX",  11, 0x3,     15, 0x4,    0 },
+};
+
+static const struct field_def sd_field_defs[] = {
+    { "P",       0,  0x1,    0, 0, 0 },
+    { "M",       1,  0x1,    0, 0, 0 },
+    { "C",       2,  0x1,    0, 0, 0 },
+    { "CC",      3,  0x1,    0, 0, 0 },
+    { "T",       4,  0x1,    0, 0, 0 },
+    { "R",       5,  0x1,    0, 0, 0 },
+    { "V",       6,  0x1,    0, 0, 0 },
+    { "I",       7,  0x1,    0, 0, 0 },
+    { "MAX_OFF", 10, 0x1fff, 0, 0, 1 },
+    { "ACC",     24, 0xff,   0, 0, 0 },
+};
+
+#define FIELD_COUNT(defs) ((int) (sizeof(defs) / sizeof((defs)[0])))
+
+static const struct field_set psw_fields =
+    { "PSW", psw_field_defs, FIELD_COUNT(psw_field_defs) };
+static const struct field_set vaddr_fields =
+    { "VADDR", vaddr_field_defs, FIELD_COUNT(vaddr_field_defs) };
+static const struct field_set sd_fields =
+    { "SD", sd_field_defs, FIELD_COUNT(sd_field_defs) };
+
+/* Largest number of fields in any set */
+#define FIELDS_MAX 17
+
+enum field_output {
+    FIELDS_TEXT,
+    FIELDS_CSV,
+    FIELDS_BINARY
+};
+
+#define FIELDS_REC_MAGIC "WEFIELDS"
+#define FIELDS_REC_ORDER 0x01020304
+#define FIELDS_NAME_LEN  8
+
+struct fields_rec_header {
+    char     magic[8];          /* FIELDS_REC_MAGIC, not NUL-terminated */
+    uint32_t byte_order;        /* FIELDS_REC_ORDER, as written */
+    uint16_t field_count;
+    uint16_t record_size;       /* In bytes: (field_count + 1) * 4 */
+    char     set_name[8];       /* "PSW", "VADDR" or "SD" */
+};
+
+static inline uint32_t field_extract(const struct field_def *f, uint32_t word)
+{
+    return (((word >> f->shift) & f->mask) |
+            ((word >> f->shift2) & f->mask2)) + f->bias;
+}
+
+static inline void fields_extract_all(const struct field_set *set, uint32_t word,
+                                      uint32_t *out)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        out[i] = field_extract(&set->fields[i], word);
+    }
+}
+
+/*
+ * Field `name` of `word`. The names are fixed in each tool, so a name
+ * that isn't in the set is a bug, and aborts.
+ */
+static inline uint32_t fields_get(const struct field_set *set, uint32_t word,
+                                  const char *name)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        if (strcmp(set->fields[i].name, name) == 0) {
+            return field_extract(&set->fields[i], word);
+        }
+    }
+
+    fprintf(stderr, "No field %s in %s\n", name, set->name);
+    abort();
+}
+
+static void fields_print_header(const struct field_set *set, enum field_output fmt)
+{
+    int i;
+
+    if (fmt == FIELDS_BINARY) {
+        struct fields_rec_header h;
+        char name[FIELDS_NAME_LEN];
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, FIELDS_REC_MAGIC, sizeof(h.magic));
+        h.byte_order = FIELDS_REC_ORDER;
+        h.field_count = (uint16_t) set->count;
+        h.record_size = (uint16_t) ((set->count + 1) * sizeof(uint32_t));
+        memcpy(h.set_name, set->name, strnlen(set->name, sizeof(h.set_name)));
+        fwrite(&h, sizeof(h), 1, stdout);
+
+        for (i = 0; i < set->count; i++) {
+            memset(name, 0, sizeof(name));
+            memcpy(name, set->fields[i].name, strnlen(set->fields[i].name, sizeof(name)));
+            fwrite(name, sizeof(name), 1, stdout);
+        }
+
+        return;
+    }
+
+    if (fmt != FIELDS_CSV) {
+        return;
+    }
+
+    fputs(set->name, stdout);
+
+    for (i = 0; i < set->count; i++) {
+        printf(",%s", set->fields[i].name);
+    }
+
+    putchar('\n');
+}
+
+static void fields_print(const struct field_set *set, uint32_t word,
+                         enum field_output fmt)
+{
+    uint32_t vals[FIELDS_MAX + 1];
+    int i;
+
+    if (fmt == FIELDS_BINARY) {
+        vals[0] = word;
+        fields_extract_all(set, word, vals + 1);
+        fwrite(vals, sizeof(uint32_t), set->count + 1, stdout);
+        return;
+    }
+
+    fields_extract_all(set, word, vals);
+
+    if (fmt == FIELDS_CSV) {
+        printf("%08x", word);
+        for (i = 0; i < set->count; i++) {
+            printf(",%x", vals[i]);
+        }
+    } else {
+        printf("%08x", word);
+        for (i = 0; i < set->count; i++) {
+            printf(" %s=%x", set->fields[i].name, vals[i]);
+        }
+    }
+
+    putchar('\n');
+}
+
+/*
+ * Read the next word from `in`. Returns 1 on success, 0 at end of
+ * input and -1 on a token that isn't hex.
+ */
+static int fields_next_word(FILE *in, int binary, uint32_t *word)
+{
+    if (binary) {
+        unsigned char b[4];
+
+        if (fread(b, 1, 4, in) != 4) {
+            return 0;
+        }
+
+        *word = ((uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 |
+                 (uint32_t) b[2] << 8 | (uint32_t) b[3]);
+        return 1;
+    } else {
+        char tok[64];
+        char *end;
+
+        if (fscanf(in, "%63s", tok) != 1) {
+            return 0;
+        }
+
+        *word = (uint32_t) strtoul(tok, &end, 16);
+
+        return (*end == '\0' && end != tok) ? 1 : -1;
+    }
+}
+
+/*
+ * Decode every word in `in`. Returns the number of tokens that could
+ * not be parsed.
+ */
+static int fields_stream(const struct field_set *set, FILE *in, int binary,
+                         enum field_output fmt)
+{
+    static char outbuf[1 << 20];
+    uint32_t word;
+    int bad = 0;
+    int r;
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    fields_print_header(set, fmt);
+
+    while ((r = fields_next_word(in, binary, &word)) != 0) {
+        if (r < 0) {
+            bad++;
+            continue;
+        }
+        fields_print(set, word, fmt);
+    }
+
+    fflush(stdout);
+
+    return bad;
+}
+
+/*
+ * Common option handling for the stream mode of each tool:
+ *
+ *   -c        CSV output
+ *   -r        Fixed-width binary records (see above)
+ *   -b        Input is raw big-endian 32-bit words
+ *   -f file   Read from `file` instead of stdin
+ */
+struct fields_opts {
+    enum field_output fmt;
+    int               binary;
+    const char       *file;
+};
+
+/*
+ * Returns the index of the first non-option argument, or -1 on a bad
+ * option.
+ */
+static int fields_parse_opts(int argc, char **argv, struct fields_opts *opts)
+{
+    int c;
+
+    opts->fmt = FIELDS_TEXT;
+    opts->binary = 0;
+    opts->file = NULL;
+
+    while ((c = getopt(argc, argv, "crbf:")) != -1) {
+        switch (c) {
+        case 'c':
+            opts->fmt = FIELDS_CSV;
+            break;
+        case 'r':
+            opts->fmt = FIELDS_BINARY;
+            break;
+        case 'b':
+            opts->binary = 1;
+            break;
+        case 'f':
+            opts->file = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return optind;
+}
+
+/*
+ * Run stream mode as set up by fields_parse_opts(). Returns a process
+ * exit status.
+ */
+static int fields_run(const struct field_set *set, const struct fields_opts *opts)
+{
+    FILE *in = stdin;
+    int bad;
+
+    if (opts->fmt == FIELDS_BINARY && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Not writing binary records to a terminal.\n");
+        return 1;
+    }
+
+    if (opts->file != NULL) {
+        in = fopen(opts->file, opts->binary ? "rb" : "r");
+
+        if (in == NULL) {
+            perror(opts->file);
+            return 1;
+        }
+    }
+
+    bad = fields_stream(set, in, opts->binary, opts->fmt);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (bad > 0) {
+        fprintf(stderr, "%d value(s) could not be parsed.\n", bad);
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif /* FIELDS_H */
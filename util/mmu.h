@@ -0,0 +1,73 @@
+/*
+ * WE32101 MMU virtual address, segment descriptor and page descriptor
+ * layouts, as macros for mmu_xlate's translation loop. The decoders use
+ * the tables of fields.h.
+ *
+ * A virtual address is a 2-bit section ID, a 13-bit segment select and
+ * a 17-bit segment offset. In a paged segment the offset is itself a
+ * 6-bit page select and an 11-bit offset into a 2K page.
+ *
+ * Each section's segment descriptor table (SDT) starts at the address
+ * in its SRAMA register, and its SRAMB register gives the number of
+ * descriptors, less one. A segment descriptor is two words: flags,
+ * access and maximum offset in the first, and in the second either the
+ * segment's physical address (contiguous segments) or the address of
+ * its page descriptor table (paged segments). An indirect descriptor's
+ * second word instead points at the descriptor to use.
+ */
+
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdint.h>
+
+/* Virtual addresses */
+#define SID(va)           (((va) >> 30) & 3)
+#define SSL(va)           (((va) >> 17) & 0x1fff)
+#define SOT(va)           (va & 0x1ffff)
+#define PSL(va)           (((va) >> 11) & 0x3f)
+#define POT(va)           (va & 0x7ff)
+
+#define PD_TAG(vaddr)     (((vaddr >> 13) & 0xf) | ((vaddr >> 14) & 0xfff0))
+#define PD_IDX(vaddr)     (((vaddr >> 11) & 3) | ((vaddr >> 15) & 4))
+
+/* Section RAM */
+#define SRAMB_LEN(sramb)  (((sramb) >> 10) & 0x1fff)
+
+/* Segment descriptors, first word */
+#define SD_PRESENT(sd)    ((sd) & 1)
+#define SD_MODIFIED(sd)   (((sd) >> 1) & 1)
+#define SD_CONTIG(sd)     (((sd) >> 2) & 1)
+#define SD_CACHE(sd)      (((sd) >> 3) & 1)
+#define SD_TRAP(sd)       (((sd) >> 4) & 1)
+#define SD_REF(sd)        (((sd) >> 5) & 1)
+#define SD_VALID(sd)      (((sd) >> 6) & 1)
+#define SD_INDIRECT(sd)   (((sd) >> 7) & 1)
+#define SD_MAX_OFF(sd)    ((((sd) >> 10) & 0x1fff) + 1)
+#define SD_ACC(sd)        (((sd) >> 24) & 0xff)
+
+/* Segment descriptors, second word */
+#define SD_SEG_ADDR(sd1)  ((sd1) & 0xffffffe0)
+
+/*
+ * Access permission of execution level `lvl` (0 kernel, 1 executive,
+ * 2 supervisor, 3 user). Kernel's two bits are the top two of ACC.
+ */
+#define SD_PERM(sd, lvl)  ((SD_ACC(sd) >> ((3 - (lvl)) * 2)) & 3)
+
+#define PERM_NONE         0
+#define PERM_EXEC         1
+#define PERM_READ_EXEC    2
+#define PERM_ALL          3
+
+/* Page descriptors */
+#define PD_PRESENT(pd)    ((pd) & 1)
+#define PD_MODIFIED(pd)   (((pd) >> 1) & 1)
+#define PD_LAST(pd)       (((pd) >> 2) & 1)
+#define PD_WFAULT(pd)     (((pd) >> 4) & 1)
+#define PD_REF(pd)        (((pd) >> 5) & 1)
+#define PD_ADDR(pd)       ((pd) & 0xfffff800)
+
+#define PAGE_SIZE_WE32    2048
+
+#endif /* MMU_H */
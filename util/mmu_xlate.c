@@ -0,0 +1,546 @@
+/*
+ * Translate WE32101 virtual addresses to physical ones, in bulk, by
+ * walking the segment and page descriptor tables in a memory dump.
+ *
+ * The dump is a raw image of physical memory starting at -m base
+ * (main memory on a 3B2 starts at 0x2000000). The section RAM
+ * registers are given with -s, one section at a time. Every address of
+ * the trace on stdin (or -f file) is translated, or classified by the
+ * fault it would take, and written out one per line.
+ *
+ * Segment and page descriptors are remembered in two direct-mapped
+ * caches, the way the MMU's own descriptor caches work, so a hot loop
+ * of translations through the same few segments reads the tables once.
+ * Referenced and modified bits are never written back; the dump is
+ * only read.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mmu.h"
+
+/* Descriptor cache sizes, in entries. Both must be powers of two. */
+#define SDC_SIZE          1024
+#define PDC_SIZE          4096
+
+enum access {
+    ACCESS_READ,
+    ACCESS_WRITE,
+    ACCESS_EXEC
+};
+
+enum fault {
+    F_NONE,
+    F_SDT_LENGTH,       /* Segment select past the end of the SDT */
+    F_INVALID_SD,       /* Descriptor's valid bit is clear, or double indirect */
+    F_ACCESS,           /* Execution level not permitted this access */
+    F_SEG_NOT_PRESENT,  /* Contiguous segment not present */
+    F_PDT_NOT_PRESENT,  /* Paged segment's page table not present */
+    F_OBJECT_TRAP,      /* Descriptor's trap bit is set */
+    F_SEG_OFFSET,       /* Offset past the end of a contiguous segment */
+    F_PDT_LENGTH,       /* Page select past the end of a paged segment */
+    F_PAGE_NOT_PRESENT,
+    F_PAGE_WRITE,       /* Write to a page with its write fault bit set */
+    F_MEMORY,           /* A descriptor lies outside the dump */
+    F_COUNT
+};
+
+static const char *fault_names[F_COUNT] = {
+    "none",
+    "sdt_length",
+    "invalid_sd",
+    "access",
+    "seg_not_present",
+    "pdt_not_present",
+    "object_trap",
+    "seg_offset",
+    "pdt_length",
+    "page_not_present",
+    "page_write",
+    "memory",
+};
+
+struct section {
+    uint32_t srama;     /* Physical address of the SDT */
+    uint32_t sramb;     /* SDT length, in SRAMB_LEN() */
+    int      set;
+};
+
+/* A cached segment descriptor, indirection already followed */
+struct sd_entry {
+    uint32_t tag;       /* (SID << 13 | SSL) + 1, or 0 if empty */
+    uint32_t sd0;
+    uint32_t sd1;
+};
+
+/* A cached page descriptor */
+struct pd_entry {
+    uint32_t tag;       /* (SID << 19 | SSL << 6 | PSL) + 1, or 0 if empty */
+    uint32_t pd;
+};
+
+struct mmu {
+    const uint8_t   *mem;
+    uint32_t         mem_base;
+    uint64_t         mem_size;
+    struct section   sec[4];
+
+    struct sd_entry  sdc[SDC_SIZE];
+    struct pd_entry  pdc[PDC_SIZE];
+
+    uint64_t         translations;
+    uint64_t         sdc_hits;
+    uint64_t         sdc_misses;
+    uint64_t         pdc_hits;
+    uint64_t         pdc_misses;
+    uint64_t         faults[F_COUNT];
+};
+
+/*
+ * Read the big-endian word at physical address `pa`. Returns 0 if it
+ * isn't in the dump.
+ */
+static int mem_word(const struct mmu *m, uint32_t pa, uint32_t *word)
+{
+    uint64_t off;
+    const uint8_t *p;
+
+    if (pa < m->mem_base || (off = (uint64_t) pa - m->mem_base) + 4 > m->mem_size) {
+        return 0;
+    }
+
+    p = m->mem + off;
+    *word = ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+             (uint32_t) p[2] << 8 | (uint32_t) p[3]);
+    return 1;
+}
+
+/*
+ * The segment descriptor for `va`, from the cache or the SDT.
+ */
+static enum fault get_sd(struct mmu *m, uint32_t va, uint32_t *sd0, uint32_t *sd1)
+{
+    uint32_t key = (SID(va) << 13) | SSL(va);
+    struct sd_entry *e = &m->sdc[key & (SDC_SIZE - 1)];
+    const struct section *s = &m->sec[SID(va)];
+    uint32_t addr;
+
+    if (e->tag == key + 1) {
+        m->sdc_hits++;
+        *sd0 = e->sd0;
+        *sd1 = e->sd1;
+        return F_NONE;
+    }
+
+    m->sdc_misses++;
+
+    if (SSL(va) > SRAMB_LEN(s->sramb)) {
+        return F_SDT_LENGTH;
+    }
+
+    addr = s->srama + SSL(va) * 8;
+
+    if (!mem_word(m, addr, sd0) || !mem_word(m, addr + 4, sd1)) {
+        return F_MEMORY;
+    }
+
+    if (SD_VALID(*sd0) && SD_INDIRECT(*sd0)) {
+        addr = *sd1;
+
+        if (!mem_word(m, addr, sd0) || !mem_word(m, addr + 4, sd1)) {
+            return F_MEMORY;
+        }
+
+        if (SD_INDIRECT(*sd0)) {
+            return F_INVALID_SD;
+        }
+    }
+
+    if (!SD_VALID(*sd0)) {
+        return F_INVALID_SD;
+    }
+
+    e->tag = key + 1;
+    e->sd0 = *sd0;
+    e->sd1 = *sd1;
+
+    return F_NONE;
+}
+
+/*
+ * The page descriptor for `va` in the page table at `pdt`.
+ */
+static enum fault get_pd(struct mmu *m, uint32_t va, uint32_t pdt, uint32_t *pd)
+{
+    uint32_t key = (SID(va) << 19) | (SSL(va) << 6) | PSL(va);
+    struct pd_entry *e = &m->pdc[key & (PDC_SIZE - 1)];
+
+    if (e->tag == key + 1) {
+        m->pdc_hits++;
+        *pd = e->pd;
+        return F_NONE;
+    }
+
+    m->pdc_misses++;
+
+    if (!mem_word(m, pdt + PSL(va) * 4, pd)) {
+        return F_MEMORY;
+    }
+
+    e->tag = key + 1;
+    e->pd = *pd;
+
+    return F_NONE;
+}
+
+static int permitted(uint32_t sd0, int level, enum access acc)
+{
+    switch (SD_PERM(sd0, level)) {
+    case PERM_NONE:
+        return 0;
+    case PERM_EXEC:
+        return acc == ACCESS_EXEC;
+    case PERM_READ_EXEC:
+        return acc != ACCESS_WRITE;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Translate `va` for an access `acc` at execution level `level`.
+ * Returns F_NONE with `pa` set, or the fault the access would take.
+ */
+static enum fault translate(struct mmu *m, uint32_t va, int level, enum access acc,
+                            uint32_t *pa)
+{
+    uint32_t sd0, sd1, pd;
+    enum fault f;
+
+    m->translations++;
+
+    if ((f = get_sd(m, va, &sd0, &sd1)) != F_NONE) {
+        return f;
+    }
+
+    if (!permitted(sd0, level, acc)) {
+        return F_ACCESS;
+    }
+
+    if (!SD_PRESENT(sd0)) {
+        return SD_CONTIG(sd0) ? F_SEG_NOT_PRESENT : F_PDT_NOT_PRESENT;
+    }
+
+    if (SD_TRAP(sd0)) {
+        return F_OBJECT_TRAP;
+    }
+
+    /*
+     * The maximum offset is counted in 8-byte units. A contiguous
+     * segment ends there; a paged one has a descriptor for every page
+     * up to and including the one holding the last doubleword.
+     */
+    if (SD_CONTIG(sd0)) {
+        if ((SOT(va) >> 3) >= SD_MAX_OFF(sd0)) {
+            return F_SEG_OFFSET;
+        }
+
+        *pa = SD_SEG_ADDR(sd1) + SOT(va);
+        return F_NONE;
+    }
+
+    if (PSL(va) > (SD_MAX_OFF(sd0) - 1) >> 8) {
+        return F_PDT_LENGTH;
+    }
+
+    if ((f = get_pd(m, va, SD_SEG_ADDR(sd1), &pd)) != F_NONE) {
+        return f;
+    }
+
+    if (!PD_PRESENT(pd)) {
+        return F_PAGE_NOT_PRESENT;
+    }
+
+    if (acc == ACCESS_WRITE && PD_WFAULT(pd)) {
+        return F_PAGE_WRITE;
+    }
+
+    *pa = PD_ADDR(pd) | POT(va);
+    return F_NONE;
+}
+
+static int parse_level(const char *s)
+{
+    switch (s[0]) {
+    case 'k': case '0': return 0;
+    case 'e': case '1': return 1;
+    case 's': case '2': return 2;
+    case 'u': case '3': return 3;
+    default: return -1;
+    }
+}
+
+static int parse_access(const char *s)
+{
+    switch (s[0]) {
+    case 'r': return ACCESS_READ;
+    case 'w': return ACCESS_WRITE;
+    case 'x': return ACCESS_EXEC;
+    default: return -1;
+    }
+}
+
+/*
+ * Read the next trace entry: a hex address, optionally followed on
+ * the same line by an access (r, w or x) and an execution level (k, e,
+ * s or u). Returns 1 on success, 0 at end of input and -1 on a line
+ * that doesn't parse.
+ */
+static int next_entry(FILE *in, int binary, uint32_t *va, int *level, int *acc)
+{
+    char line[256];
+    char *p, *end;
+    int v;
+
+    if (binary) {
+        unsigned char b[4];
+
+        if (fread(b, 1, 4, in) != 4) {
+            return 0;
+        }
+
+        *va = ((uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 |
+               (uint32_t) b[2] << 8 | (uint32_t) b[3]);
+        return 1;
+    }
+
+    do {
+        if (fgets(line, sizeof(line), in) == NULL) {
+            return 0;
+        }
+        p = line + strspn(line, " \t");
+    } while (*p == '\n' || *p == '\0' || *p == '#');
+
+    *va = (uint32_t) strtoul(p, &end, 16);
+
+    if (end == p) {
+        return -1;
+    }
+
+    p = end + strspn(end, " \t");
+
+    if (*p != '\n' && *p != '\0') {
+        if ((v = parse_access(p)) < 0) {
+            return -1;
+        }
+        *acc = v;
+        p += strcspn(p, " \t\n");
+        p += strspn(p, " \t");
+    }
+
+    if (*p != '\n' && *p != '\0') {
+        if ((v = parse_level(p)) < 0) {
+            return -1;
+        }
+        *level = v;
+    }
+
+    return 1;
+}
+
+static void print_stats(const struct mmu *m)
+{
+    uint64_t faulted = 0;
+    int i;
+
+    for (i = 1; i < F_COUNT; i++) {
+        faulted += m->faults[i];
+    }
+
+    fprintf(stderr, "Translations:  %llu\n", (unsigned long long) m->translations);
+    fprintf(stderr, "Faults:        %llu\n", (unsigned long long) faulted);
+
+    for (i = 1; i < F_COUNT; i++) {
+        if (m->faults[i] > 0) {
+            fprintf(stderr, "  %-16s %llu\n", fault_names[i], (unsigned long long) m->faults[i]);
+        }
+    }
+
+    fprintf(stderr, "SD cache:      %llu hits, %llu misses\n",
+            (unsigned long long) m->sdc_hits, (unsigned long long) m->sdc_misses);
+    fprintf(stderr, "PD cache:      %llu hits, %llu misses\n",
+            (unsigned long long) m->pdc_hits, (unsigned long long) m->pdc_misses);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmu_xlate [-m base] -s sid:srama:sramb ... [-f file] [-b] [-c | -q]\n");
+    fprintf(stderr, "                 [-a access] [-l level] [-v] <memory dump>\n");
+    fprintf(stderr, "  Translate every virtual address on stdin (or in file), one per line,\n");
+    fprintf(stderr, "  each optionally followed by an access (r, w, x) and a level (k, e, s, u).\n");
+    fprintf(stderr, "  -m base   Physical address of the first byte of the dump (default 2000000)\n");
+    fprintf(stderr, "  -s        Section RAM registers for one section, in hex\n");
+    fprintf(stderr, "  -b        Input is raw big-endian 32-bit addresses\n");
+    fprintf(stderr, "  -c        CSV output\n");
+    fprintf(stderr, "  -q        No per-address output\n");
+    fprintf(stderr, "  -a        Default access (default r)\n");
+    fprintf(stderr, "  -l        Default execution level (default k)\n");
+    fprintf(stderr, "  -v        Print translation and cache statistics at the end\n");
+}
+
+int main(int argc, char **argv)
+{
+    static char outbuf[1 << 20];
+    static struct mmu m;
+    const char *file = NULL;
+    FILE *in = stdin;
+    int binary = 0, csv = 0, quiet = 0, verbose = 0;
+    int def_level = 0, def_acc = ACCESS_READ;
+    int c, fd, r, bad = 0, nsec = 0;
+    struct stat st;
+    void *map;
+
+    m.mem_base = 0x2000000;
+
+    while ((c = getopt(argc, argv, "m:s:f:bcqa:l:v")) != -1) {
+        switch (c) {
+        case 'm':
+            m.mem_base = (uint32_t) strtoul(optarg, NULL, 16);
+            break;
+        case 's': {
+            unsigned sid, srama, sramb;
+
+            if (sscanf(optarg, "%u:%x:%x", &sid, &srama, &sramb) != 3 || sid > 3) {
+                fprintf(stderr, "Bad section registers: %s\n", optarg);
+                return 1;
+            }
+            m.sec[sid].srama = srama;
+            m.sec[sid].sramb = sramb;
+            m.sec[sid].set = 1;
+            nsec++;
+            break;
+        }
+        case 'f':
+            file = optarg;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'a':
+            if ((def_acc = parse_access(optarg)) < 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'l':
+            if ((def_level = parse_level(optarg)) < 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1 || nsec == 0) {
+        usage();
+        return 1;
+    }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (map == MAP_FAILED) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    m.mem = map;
+    m.mem_size = (uint64_t) st.st_size;
+
+    if (file != NULL && (in = fopen(file, binary ? "rb" : "r")) == NULL) {
+        perror(file);
+        return 1;
+    }
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    if (csv && !quiet) {
+        puts("VADDR,PADDR,FAULT");
+    }
+
+    for (;;) {
+        uint32_t va, pa = 0;
+        int level = def_level, acc = def_acc;
+        enum fault f;
+
+        if ((r = next_entry(in, binary, &va, &level, &acc)) == 0) {
+            break;
+        }
+
+        if (r < 0) {
+            bad++;
+            continue;
+        }
+
+        /* A section without registers has nothing mapped. */
+        f = m.sec[SID(va)].set ? translate(&m, va, level, acc, &pa) : F_SDT_LENGTH;
+        m.faults[f]++;
+
+        if (quiet) {
+            continue;
+        }
+
+        if (csv) {
+            if (f == F_NONE) {
+                printf("%08x,%08x,\n", va, pa);
+            } else {
+                printf("%08x,,%s\n", va, fault_names[f]);
+            }
+        } else if (f == F_NONE) {
+            printf("%08x %08x\n", va, pa);
+        } else {
+            printf("%08x fault=%s\n", va, fault_names[f]);
+        }
+    }
+
+    fflush(stdout);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (verbose) {
+        print_stats(&m);
+    }
+
+    if (bad > 0) {
+        fprintf(stderr, "%d line(s) could not be parsed.\n", bad);
+        return 1;
+    }
+
+    return 0;
+}
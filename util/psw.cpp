@@ -3,9 +3,10 @@
 #include <bitset>
 #include <cstdint>
 
+#include "fields.h"
+
 using std::cerr;
 using std::cout;
-using std::endl;
 
 void output_exec_level(uint16_t level) {
     cout << "\t(";
@@ -23,34 +24,34 @@ void output_exec_level(uint16_t level) {
         cout << "User";
         break;
     default:
-        cerr << "UNEXPECTED PM!" << endl;
+        cerr << "UNEXPECTED PM!" << '\n';
         return;
     }
-    cout << ")" << endl;
+    cout << ")" << '\n';
 }
 
 void translate_psw(uint32_t psw) {
-    cout << "PSW: 0x" << std::hex << psw << endl;
-
-    cout << endl;
-
-    uint16_t et = psw & 0x03;
-    uint16_t tm = psw >> 2 & 0x01;
-    uint16_t isc = psw >> 3 & 0x0f;
-    uint16_t i = psw >> 7 & 0x01;
-    uint16_t r = psw >> 8 & 0x01;
-    uint16_t pm = psw >> 9 & 0x03;
-    uint16_t cm = psw >> 11 & 0x03;
-    uint16_t ipl = psw >> 13 & 0x0f;
-    uint16_t te = psw >> 17 & 0x01;
-    uint16_t c = psw >> 18 & 0x01;
-    uint16_t v = psw >> 19 & 0x01;
-    uint16_t z = psw >> 20 & 0x01;
-    uint16_t n = psw >> 21 & 0x01;
-    uint16_t oe = psw >> 22 & 0x01;
-    uint16_t cd = psw >> 23 & 0x01;
-    uint16_t qie = psw >> 24 & 0x01;
-    uint16_t cfd = psw >> 25 & 0x01;
+    cout << "PSW: 0x" << std::hex << psw << '\n';
+
+    cout << '\n';
+
+    uint16_t et = fields_get(&psw_fields, psw, "ET");
+    uint16_t tm = fields_get(&psw_fields, psw, "TM");
+    uint16_t isc = fields_get(&psw_fields, psw, "ISC");
+    uint16_t i = fields_get(&psw_fields, psw, "I");
+    uint16_t r = fields_get(&psw_fields, psw, "R");
+    uint16_t pm = fields_get(&psw_fields, psw, "PM");
+    uint16_t cm = fields_get(&psw_fields, psw, "CM");
+    uint16_t ipl = fields_get(&psw_fields, psw, "IPL");
+    uint16_t te = fields_get(&psw_fields, psw, "TE");
+    uint16_t c = fields_get(&psw_fields, psw, "C");
+    uint16_t v = fields_get(&psw_fields, psw, "V");
+    uint16_t z = fields_get(&psw_fields, psw, "Z");
+    uint16_t n = fields_get(&psw_fields, psw, "N");
+    uint16_t oe = fields_get(&psw_fields, psw, "OE");
+    uint16_t cd = fields_get(&psw_fields, psw, "CD");
+    uint16_t qie = fields_get(&psw_fields, psw, "QIE");
+    uint16_t cfd = fields_get(&psw_fields, psw, "CFD");
 
     cout << "ET:\t" << et << "\t(";
     switch(et) {
@@ -67,15 +68,15 @@ void translate_psw(uint32_t psw) {
         cout << "On Normal Exception";
         break;
     default:
-        cerr << "UNEXPECTED ET!" << endl;
+        cerr << "UNEXPECTED ET!" << '\n';
         return;
     }
-    cout << ")" << endl;
+    cout << ")" << '\n';
 
-    cout << "TM:\t" << tm << endl;
-    cout << "ISC:\t" << std::bitset<4>(isc) << "b" << endl;
-    cout << "I:\t" << i << endl;
-    cout << "R:\t" << r << endl;
+    cout << "TM:\t" << tm << '\n';
+    cout << "ISC:\t" << std::bitset<4>(isc) << "b" << '\n';
+    cout << "I:\t" << i << '\n';
+    cout << "R:\t" << r << '\n';
 
     cout << "PM:\t" << pm;
     output_exec_level(pm);
@@ -83,17 +84,17 @@ void translate_psw(uint32_t psw) {
     cout << "CM:\t" << cm;
     output_exec_level(cm);
 
-    cout << "IPL:\t" << std::bitset<4>(ipl) << "b" << endl;
+    cout << "IPL:\t" << std::bitset<4>(ipl) << "b" << '\n';
 
-    cout << "TE:\t" << te << endl;
-    cout << "C Flag:\t" << c << endl;
-    cout << "V Flag:\t" << v << endl;
-    cout << "Z Flag:\t" << z << endl;
-    cout << "N Flag:\t" << n << endl;
-    cout << "OE:\t" << oe << endl;
-    cout << "CD:\t" << cd << endl;
-    cout << "QIE:\t" << qie << endl;
-    cout << "CFD:\t" << cfd << endl;
+    cout << "TE:\t" << te << '\n';
+    cout << "C Flag:\t" << c << '\n';
+    cout << "V Flag:\t" << v << '\n';
+    cout << "Z Flag:\t" << z << '\n';
+    cout << "N Flag:\t" << n << '\n';
+    cout << "OE:\t" << oe << '\n';
+    cout << "CD:\t" << cd << '\n';
+    cout << "QIE:\t" << qie << '\n';
+    cout << "CFD:\t" << cfd << '\n';
 
 }
 
@@ -101,12 +102,24 @@ int main(int argc, char** argv) {
     std::stringstream hex_stream;
     uint32_t psw;
 
-    if (argc != 2) {
-        cerr << "usage: psw <status word>" << endl;
+    struct fields_opts opts;
+    int arg = fields_parse_opts(argc, argv, &opts);
+
+    if (arg < 0 || argc - arg > 1) {
+        cerr << "usage: psw <status word>" << '\n';
+        cerr << "       psw [-c | -r] [-b] [-f file]" << '\n';
+        cerr << "  With no status word, decode every word on stdin (or in file)." << '\n';
+        cerr << "  -c  CSV output" << '\n';
+        cerr << "  -r  Fixed-width binary records (see fields.h)" << '\n';
+        cerr << "  -b  Input is raw big-endian 32-bit words" << '\n';
         return 1;
     }
 
-    hex_stream << std::hex << argv[1];
+    if (arg == argc) {
+        return fields_run(&psw_fields, &opts);
+    }
+
+    hex_stream << std::hex << argv[arg];
     hex_stream >> psw;
 
     translate_psw(psw);